@@ -12,9 +12,29 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <assert.h>
+#include <time.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <regex.h>
 #include <vector>
+#include <deque>
+#include <set>
+#include <map>
 #include <algorithm>
 #include "common.h"
+#include "trace_format.h"
+#include "text_format.h"
+#include "addr_table.h"
+#include "record_filter.h"
+#include "staging_alloc.h"
 
 /* ================================================================== */
 // Global variables 
@@ -35,15 +55,125 @@ std::ostream * out = &cerr;
 
 std::vector<ADDRINT> instrumented;
 
+/*
+ * Stall statistics of threads that have finished
+ */
+PIN_LOCK stats_lock;
+UINT64 total_stall_ns = 0;
+UINT64 total_flushes = 0;
+UINT64 total_records = 0;
+
+/*
+ * With -buffer_budget, the trace buffers of all threads, their own and
+ * their spares for the writer thread, share a budget of budget_buffers
+ * buffers, of which budget_used are allocated. A buffer holds
+ * buffer_records records.
+ */
+PIN_LOCK budget_lock;
+UINT64 budget_buffers = 0;
+UINT64 budget_used = 0;
+UINT64 buffer_records = 0;
+
+/*
+ * Reduction stage applied to every buffer, configured from the command
+ * line and copied to each thread, and the drop counts of finished threads
+ */
+RecordFilter filter_proto;
+FilterStats filter_totals;
+
+/*
+ * Summaries of finished threads in aggregate mode
+ */
+typedef AddrTable<READSTAT> READ_TABLE;
+READ_TABLE aggregate_reads;
+UINT64 aggregate_count = 0;
+UINT64 aggregate_bytes_read = 0;
+UINT64 aggregate_bytes_written = 0;
+bool aggregate_mode = false;
+
+/*
+ * Records carry a timestamp, an instruction id, or both (MEMREF_EXT)
+ * when these are true. Instruction ids are given out in order of
+ * instrumentation and listed in the .pcs table with the address,
+ * source line and disassembly of the instruction.
+ */
+bool timestamp_mode = false;
+bool pc_mode = false;
+std::map<ADDRINT, UINT32> pc_ids;
+std::ofstream pcs_file;
+
+/*
+ * In scoped mode, scope_reg holds the number of traced functions on the
+ * stack of each thread. Code runs in one of two trace versions: outside
+ * the scope only calls are instrumented, and inside every reference is
+ * recorded. Each basic block switches version when scope_reg moves
+ * between 0 and 1.
+ */
+enum
+{
+  VERSION_OUTSIDE = 0,
+  VERSION_INSIDE = 1
+};
+
+bool scoped_mode = false;
+REG scope_reg;
+
+/*
+ * Sampling mode (TRACE_SAMPLE_*) and its parameters, which are written
+ * to the trace header. sample_reg points to the SAMPLER of each thread.
+ */
+UINT32 sample_mode = TRACE_SAMPLE_NONE;
+TraceSampling sampling;
+REG sample_reg;
+
+/*
+ * With -heap, calls to the allocation functions record their blocks.
+ * The outermost allocation call on the stack of a thread saves its
+ * stack pointer in alloc_sp_reg, and the size and call site of the
+ * request in alloc_size_reg and alloc_site_reg, until it returns.
+ * alloc_entered_reg tells whether the last entry to an allocation
+ * function started the outermost call. Call sites get ids in order of
+ * first use, listed in the .allocs table.
+ */
+bool heap_mode = false;
+REG alloc_sp_reg;
+REG alloc_size_reg;
+REG alloc_site_reg;
+REG alloc_entered_reg;
+PIN_LOCK sites_lock;
+std::map<ADDRINT, UINT32> site_ids;
+std::ofstream allocs_file;
+
+/*
+ * With -stream, all threads write their blocks to one stream, a named
+ * pipe or a Unix domain socket, instead of a file each. Blocks carry
+ * the thread of every record and are written whole under stream_lock,
+ * so the blocks of the threads interleave but never mix.
+ */
+int stream_fd = -1;
+bool stream_socket = false;
+PIN_LOCK stream_lock;
+
 /* ===================================================================== */
 // Command line switches
 /* ===================================================================== */
 KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE,  "pintool",
                             "o", "pin.out", "specify file name for MemoryTracer output");
 
-KNOB<string> KnobFunction(KNOB_MODE_WRITEONCE,  "pintool",
-                          "f", "__NO_SUCH_FUNCTION__",
-                          "name of function to trace");
+KNOB<string> KnobFunction(KNOB_MODE_APPEND,  "pintool",
+                          "f", "",
+                          "name of function to trace; may be repeated");
+
+KNOB<string> KnobFunctionFile(KNOB_MODE_WRITEONCE,  "pintool",
+                              "f_file", "",
+                              "file with names of functions to trace, one "
+                              "per line");
+
+KNOB<string> KnobFunctionRegex(KNOB_MODE_APPEND,  "pintool",
+                               "f_regex", "",
+                               "trace functions whose whole name matches "
+                               "this POSIX extended regular expression; "
+                               "may be repeated");
 
 KNOB<UINT32> KnobNumPagesInBuffer(KNOB_MODE_WRITEONCE,  "pintool",
                                   "num_pages_in_buffer", "256",
@@ -53,8 +183,136 @@ KNOB<bool> KnobDumpText(KNOB_MODE_WRITEONCE,  "pintool",
                         "dump_text_trace", "1",
                         "dump trace in text");
 
-string target_func("__NO_SUCH_FUNCTION__");
-ADDRINT target_func_addr = 0;
+KNOB<bool> KnobCompress(KNOB_MODE_WRITEONCE,  "pintool",
+                        "compress_trace", "1",
+                        "compress blocks of binary trace");
+
+KNOB<string> KnobMode(KNOB_MODE_WRITEONCE,  "pintool",
+                      "mode", "trace",
+                      "trace: write the full trace; aggregate: write only "
+                      "a summary of the reads");
+
+KNOB<UINT32> KnobAggregateLineSize(KNOB_MODE_WRITEONCE,  "pintool",
+                                   "aggregate_line_size", "0",
+                                   "summarize reads per cache line of this "
+                                   "size instead of per address");
+
+KNOB<UINT32> KnobWriterBuffers(KNOB_MODE_WRITEONCE,  "pintool",
+                               "writer_buffers", "0",
+                               "number of spare buffers per thread handed to "
+                               "a background writer thread (0: write "
+                               "synchronously)");
+
+KNOB<UINT32> KnobBufferBudget(KNOB_MODE_WRITEONCE,  "pintool",
+                              "buffer_budget", "0",
+                              "megabytes of trace buffers shared by all "
+                              "threads; with -writer_buffers, spare buffers "
+                              "go to the threads that flush most often (0: "
+                              "-writer_buffers spares per thread)");
+
+KNOB<bool> KnobHugeStaging(KNOB_MODE_WRITEONCE,  "pintool",
+                           "huge_staging", "0",
+                           "back the buffers that trace buffers are encoded "
+                           "into with huge pages");
+
+KNOB<bool> KnobTimestamp(KNOB_MODE_WRITEONCE,  "pintool",
+                         "timestamp", "0",
+                         "record the time stamp counter with every record so "
+                         "that analysis/merge can order the threads");
+
+KNOB<bool> KnobPc(KNOB_MODE_WRITEONCE,  "pintool",
+                  "pc", "0",
+                  "record the id of the instruction with every record; ids "
+                  "are listed in the .pcs file");
+
+KNOB<bool> KnobHeap(KNOB_MODE_WRITEONCE,  "pintool",
+                    "heap", "0",
+                    "record the blocks allocated and freed by malloc, "
+                    "calloc, realloc, free and operator new and delete; "
+                    "call sites are listed in the .allocs file");
+
+KNOB<string> KnobStream(KNOB_MODE_WRITEONCE,  "pintool",
+                        "stream", "",
+                        "write the binary trace of all threads to this named "
+                        "pipe, or to the Unix domain socket unix:PATH, "
+                        "instead of files");
+
+KNOB<UINT32> KnobCoalesceLine(KNOB_MODE_WRITEONCE,  "pintool",
+                              "coalesce_line", "0",
+                              "drop accesses to the same cache line of this "
+                              "size as the last record kept (0: off)");
+
+KNOB<bool> KnobFilterStack(KNOB_MODE_WRITEONCE,  "pintool",
+                           "filter_stack", "0",
+                           "drop accesses to the stack of the thread");
+
+KNOB<string> KnobKeepRange(KNOB_MODE_APPEND,  "pintool",
+                           "keep_range", "",
+                           "record only accesses to addresses in LO:HI; may "
+                           "be repeated");
+
+KNOB<bool> KnobScoped(KNOB_MODE_WRITEONCE,  "pintool",
+                      "scoped", "0",
+                      "record all references made while a traced function "
+                      "is on the stack, including those of its callees");
+
+KNOB<string> KnobSample(KNOB_MODE_WRITEONCE,  "pintool",
+                        "sample", "none",
+                        "none: record every reference; invocation: record "
+                        "every -sample_every-th invocation; burst: record "
+                        "bursts of -burst_length references every "
+                        "-burst_period references; random: record each "
+                        "reference with probability -sample_rate");
+
+KNOB<UINT64> KnobSampleEvery(KNOB_MODE_WRITEONCE,  "pintool",
+                             "sample_every", "10",
+                             "record one of this many invocations");
+
+KNOB<UINT64> KnobBurstLength(KNOB_MODE_WRITEONCE,  "pintool",
+                             "burst_length", "1000000",
+                             "number of references in a burst");
+
+KNOB<UINT64> KnobBurstPeriod(KNOB_MODE_WRITEONCE,  "pintool",
+                             "burst_period", "100000000",
+                             "number of references from one burst to the "
+                             "next");
+
+KNOB<double> KnobSampleRate(KNOB_MODE_WRITEONCE,  "pintool",
+                            "sample_rate", "0.01",
+                            "probability that a reference is recorded");
+
+/*
+ * Functions to trace, by name and by pattern. Routines are matched
+ * against them when their image is loaded. Patterns are POSIX extended
+ * regular expressions, anchored to match the whole name.
+ */
+std::set<string> target_names;
+std::vector<regex_t *> target_patterns;
+
+/*
+ * Sorted addresses of the matched functions and their ids. Call and
+ * return records carry the id of the function in their size field.
+ * Image loads publish a new set, so that analysis routines of other
+ * threads can keep using the old one; old sets are freed at exit.
+ */
+#define NO_FUNCTION (~(UINT32)0)
+
+struct FUNC_SET
+{
+  std::vector<ADDRINT> addrs;
+  std::vector<UINT32> ids;
+};
+
+FUNC_SET * volatile target_set = NULL;
+std::vector<FUNC_SET *> retired_sets;
+UINT32 num_functions = 0;
+std::ofstream functions_file;
+
+/*
+ * Tool register that passes the id of the target of an indirect call
+ * from its lookup to the buffer fill.
+ */
+REG func_reg;
 
 /* ===================================================================== */
 // Utilities
@@ -66,16 +324,248 @@ ADDRINT target_func_addr = 0;
 INT32 Usage()
 {
   cerr << "This tool records memory reads and stores in the running application."
-       << endl << endl;
+       << endl;
+  cerr << "At least one function to trace must be given with -f, -f_file or "
+       << "-f_regex." << endl << endl;
 
   cerr << KNOB_BASE::StringKnobSummary() << endl;
 
   return -1;
 }
 
+/*!
+ *  Monotonic time in nanoseconds.
+ */
+static UINT64 NowNanos()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (UINT64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /* ===================================================================== */
 // Analysis routines
 /* ===================================================================== */
+/*
+ * SAMPLER - per-thread state of the sampling modes. References are
+ * recorded while on is set. Burst and random sampling count down left
+ * with every reference, and switch phase when it reaches zero.
+ */
+struct SAMPLER
+{
+  ADDRINT on;
+  INT64 left;
+  UINT32 depth;       // nesting of traced functions
+  UINT64 invocations; // outermost invocations so far
+  UINT64 rng;         // xorshift64* state
+};
+
+/*
+ * Number of references from one randomly sampled reference to the next,
+ * drawn from the geometric distribution of the sampling rate.
+ */
+static UINT64 NextSpacing(SAMPLER *s)
+{
+  s->rng ^= s->rng >> 12;
+  s->rng ^= s->rng << 25;
+  s->rng ^= s->rng >> 27;
+  UINT64 r = s->rng * 2685821657736338717ULL;
+  double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);  // (0, 1]
+  return 1 + (UINT64)(log(u) / log(1.0 - sampling.sample_fraction));
+}
+
+static VOID SamplerInit(SAMPLER *s, THREADID tid)
+{
+  s->depth = 0;
+  s->invocations = 0;
+  s->rng = 0x9e3779b97f4a7c15ULL * (tid + 1);
+  s->on = 1;
+  s->left = 0;
+  if (sample_mode == TRACE_SAMPLE_BURST) {
+    // The reference that reaches zero already belongs to the gap, so the
+    // first burst counts one more to record sample_length references
+    s->left = sampling.sample_length + 1;
+  } else if (sample_mode == TRACE_SAMPLE_RANDOM) {
+    s->on = 0;
+    s->left = NextSpacing(s);
+  }
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL SampleOn(SAMPLER *s)
+{
+  return s->on;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL SampleOnMatch(SAMPLER *s, ADDRINT id)
+{
+  return s->on & (id != NO_FUNCTION);
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL SampleTick(SAMPLER *s)
+{
+  return --s->left == 0;
+}
+
+/*
+ * Called when left reaches zero. A burst alternates with a gap. A random
+ * sample records the reference that reached zero, and then draws the
+ * distance to the next one.
+ */
+static VOID SampleSwitch(SAMPLER *s)
+{
+  if (sample_mode == TRACE_SAMPLE_BURST) {
+    s->on = !s->on;
+    s->left = s->on ? sampling.sample_length
+                    : sampling.sample_period - sampling.sample_length;
+  } else if (!s->on) {
+    s->on = 1;
+    s->left = 1;
+  } else {
+    UINT64 spacing = NextSpacing(s);
+    s->on = spacing == 1;
+    s->left = spacing == 1 ? 1 : spacing - 1;
+  }
+}
+
+/*
+ * An invocation of a traced function begins. Whether it is recorded is
+ * decided once per outermost invocation, so that calls and returns stay
+ * balanced.
+ */
+static VOID PIN_FAST_ANALYSIS_CALL SampleEnter(SAMPLER *s)
+{
+  if (s->depth++ == 0) {
+    s->on = s->invocations++ % sampling.sample_period == 0;
+  }
+}
+
+static VOID PIN_FAST_ANALYSIS_CALL SampleLeave(SAMPLER *s)
+{
+  if (s->depth > 0) s->depth--;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL ScopeEnter(ADDRINT depth)
+{
+  return depth + 1;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL ScopeEnterMatch(ADDRINT depth, ADDRINT id)
+{
+  return depth + (id != NO_FUNCTION);
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL ScopeLeave(ADDRINT depth)
+{
+  return depth - (depth != 0);
+}
+
+/*
+ * Take one buffer from the budget, if any is left.
+ */
+static bool BudgetAcquire()
+{
+  PIN_GetLock(&budget_lock, PIN_ThreadId() + 1);
+  bool ok = budget_used < budget_buffers;
+  if (ok) ++budget_used;
+  PIN_ReleaseLock(&budget_lock);
+  return ok;
+}
+
+/*
+ * Charge n buffers to the budget, whether they fit or not, or give -n
+ * buffers back.
+ */
+static VOID BudgetCharge(INT64 n)
+{
+  PIN_GetLock(&budget_lock, PIN_ThreadId() + 1);
+  budget_used += n;
+  PIN_ReleaseLock(&budget_lock);
+}
+
+/*
+ * Write to the named pipe of the stream with SIGPIPE blocked, so that a
+ * reader that went away fails the write with EPIPE, as send() does with
+ * MSG_NOSIGNAL, rather than killing the application. The SIGPIPE raised
+ * by the write is taken off the pending set before it is unblocked.
+ */
+static ssize_t PipeWrite(const char *p, size_t len)
+{
+  sigset_t pipe_set, old_set, pending;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+  sigpending(&pending);
+  bool was_pending = sigismember(&pending, SIGPIPE);
+  ssize_t n = write(stream_fd, p, len);
+  if (n < 0 && errno == EPIPE && !was_pending) {
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&pipe_set, NULL, &zero) < 0 && errno == EINTR) {
+    }
+    errno = EPIPE;
+  }
+  sigprocmask(SIG_SETMASK, &old_set, NULL);
+  return n;
+}
+
+/*
+ * Write len bytes to the stream as one piece. Writes of other threads
+ * wait, so that blocks are never interleaved.
+ */
+static bool StreamWrite(const void *data, size_t len)
+{
+  const char *p = static_cast<const char *>(data);
+  PIN_GetLock(&stream_lock, PIN_ThreadId() + 1);
+  while (len > 0) {
+    ssize_t n = stream_socket ? send(stream_fd, p, len, MSG_NOSIGNAL)
+                              : PipeWrite(p, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    p += n;
+    len -= n;
+  }
+  PIN_ReleaseLock(&stream_lock);
+  return len == 0;
+}
+
+/*
+ * Open the stream given with -stream and write the file header. A named
+ * pipe blocks until the reader opens it; a socket must be listening.
+ */
+static bool OpenStream(const string &path, UINT32 flags)
+{
+  if (path.compare(0, 5, "unix:") == 0) {
+    struct sockaddr_un sa;
+    string name = path.substr(5);
+    if (name.size() >= sizeof(sa.sun_path)) {
+      cerr << "Error: socket path too long: " << name << endl;
+      return false;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, name.c_str());
+    stream_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    stream_socket = true;
+    if (stream_fd >= 0 &&
+        connect(stream_fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+      close(stream_fd);
+      stream_fd = -1;
+    }
+  } else {
+    cerr << "Waiting for a reader on " << path << endl;
+    stream_fd = open(path.c_str(), O_WRONLY);
+  }
+  if (stream_fd < 0) {
+    cerr << "Error: could not open stream " << path << endl;
+    return false;
+  }
+  PIN_InitLock(&stream_lock);
+  TraceFileHeader fh;
+  InitFileHeader(fh);
+  fh.flags = flags;
+  fh.sampling = sampling;
+  return StreamWrite(&fh, sizeof(fh));
+}
+
 /*
  * MLOG - thread specific data that is not handled by the buffering API.
  */
@@ -85,20 +575,120 @@ class MLOG
   MLOG(THREADID tid);
   ~MLOG();
 
-  VOID DumpBufferToFile( struct MEMREF * reference, UINT64 numElements, THREADID tid );
+  VOID ProcessBuffer( VOID * buf, UINT64 numElements );
+  VOID DumpBufferToFile( const struct MEMREF * reference, const uint64_t * ts,
+                         const uint32_t * pc, UINT64 numElements,
+                         THREADID tid );
+  VOID AggregateBuffer( const struct MEMREF * reference, UINT64 numElements );
+
+  VOID * HandOff( VOID * buf, UINT64 numElements );
+  VOID ReleaseBuffer( VOID * buf, UINT64 queued_ns );
+  VOID Drain();
+
+  THREADID Tid() const { return _tid; }
+
+  SAMPLER sampler;
+  RecordFilter filter;
+
+  // Time the application thread spent in BufferFull
+  UINT64 stall_ns;
+  UINT64 num_flushes;
+  UINT64 records_flushed;
+
+  // End of the last flush, and the time the thread takes to fill a
+  // buffer, smoothed over the last flushes
+  UINT64 last_flush_ns;
+  double flush_interval_ns;
+
+  // Most spare buffers the thread had at once
+  UINT32 max_spares;
+
+  // Summary of the buffers in aggregate mode
+  READ_TABLE reads;
+  UINT64 count;
+  UINT64 bytes_read;
+  UINT64 bytes_written;
 
  private:
   FILE *_ofile;
+  TraceWriter _writer;
+  std::vector<char, StagingAllocator<char> > _text;
+  THREADID _tid;
+
+  bool GrowPool();
+  VOID TrimPool();
+
+  // Records and fields of a MEMREF_EXT buffer, split for the encoders
+  std::vector<MEMREF, StagingAllocator<MEMREF> > _refs;
+  std::vector<uint64_t, StagingAllocator<uint64_t> > _ts;
+  std::vector<uint32_t, StagingAllocator<uint32_t> > _pc;
+
+  // Thread ids of the blocks written to the stream, and the encoded or
+  // formatted buffer
+  std::vector<uint32_t, StagingAllocator<uint32_t> > _tids;
+  std::vector<uint8_t, StagingAllocator<uint8_t> > _raw;
+  std::vector<uint8_t, StagingAllocator<uint8_t> > _block;
+
+  // Spare buffers for the writer thread
+  PIN_LOCK _pool_lock;
+  PIN_SEMAPHORE _pool_sem;
+  std::vector<VOID *> _free_buffers;
+  UINT32 _in_flight;
+  UINT32 _spares;
+  // Time from hand-off to release of a buffer, smoothed
+  double _latency_ns;
 };
 
+/*
+ * A full buffer waiting for the writer thread
+ */
+struct PENDING_BUFFER
+{
+  MLOG *mlog;
+  VOID *buf;
+  UINT64 numElements;
+  UINT64 queued_ns;
+};
+
+std::deque<PENDING_BUFFER> pending;
+PIN_LOCK pending_lock;
+PIN_SEMAPHORE pending_sem;
+bool writer_exiting = false;
+PIN_THREAD_UID writer_uid;
+
 
 MLOG::MLOG(THREADID tid)
+    : stall_ns(0), num_flushes(0), records_flushed(0),
+      last_flush_ns(NowNanos()), flush_interval_ns(0), max_spares(0),
+      count(0), bytes_read(0), bytes_written(0), _ofile(NULL), _tid(tid),
+      _in_flight(0), _spares(0), _latency_ns(0)
 {
+  filter = filter_proto;
+  SamplerInit(&sampler, tid);
+  PIN_InitLock(&_pool_lock);
+  PIN_SemaphoreInit(&_pool_sem);
+  // The buffer Pin gives the thread counts against the budget too
+  if (budget_buffers) BudgetCharge(1);
+  for (UINT32 i = 0; i < KnobWriterBuffers; ++i) {
+    if (budget_buffers && !BudgetAcquire()) break;
+    VOID *buf = PIN_AllocateBuffer(bufId);
+    if (!buf) {
+      cerr << "Error: could not allocate writer buffer." << endl;
+      exit(1);
+    }
+    _free_buffers.push_back(buf);
+  }
+  _spares = max_spares = _free_buffers.size();
+
+  if (aggregate_mode || stream_fd >= 0) return;
+
   string filename = KnobOutputFile.Value() + "." + decstr(getpid_portable()) + "." + decstr(tid);
   cerr << "New MLOG: Trace will be saved in " << filename << endl;
   if (KnobDumpText) {
     cerr << "Dump trace in text" << endl;
     _ofile = fopen(filename.c_str(), "w");
+    // Whole buffers are formatted at once; write them without copying
+    if (_ofile) setvbuf(_ofile, NULL, _IONBF, 0);
   } else {
     cerr << "Dump trace in binary" << endl;
     _ofile = fopen(filename.c_str(), "wb");
@@ -108,6 +698,13 @@ MLOG::MLOG(THREADID tid)
     cerr << "Error: could not open output file." << endl;
     exit(1);
   }
+  UINT32 flags = (timestamp_mode ? TRACE_HAS_TIMESTAMP : 0) |
+      (pc_mode ? TRACE_HAS_PC : 0);
+  if (!KnobDumpText &&
+      !_writer.Open(_ofile, KnobCompress, flags, &sampling)) {
+    cerr << "Error: could not write trace header." << endl;
+    exit(1);
+  }
     
   //_ofile << hex;
 }
@@ -115,30 +712,245 @@ MLOG::MLOG(THREADID tid)
 
 MLOG::~MLOG()
 {
-  fclose(_ofile);
+  if (_ofile) fclose(_ofile);
+  if (budget_buffers) BudgetCharge(-(INT64)(1 + _free_buffers.size()));
+  for (size_t i = 0; i < _free_buffers.size(); ++i) {
+    PIN_DeallocateBuffer(bufId, _free_buffers[i]);
+  }
+  PIN_SemaphoreFini(&_pool_sem);
 }
 
 
-VOID MLOG::DumpBufferToFile( struct MEMREF * reference, UINT64 numElements, THREADID tid )
+VOID MLOG::ProcessBuffer( VOID * buf, UINT64 numElements )
 {
-  if (KnobDumpText) {
-    for(UINT64 i=0; i<numElements; i++, reference++)
-    {
-      //if (reference->addr != 0)
-      fprintf(_ofile, "%d %p %u\n", reference->type, (void*)reference->addr,
-              reference->size);
+  MEMREF *reference = static_cast<MEMREF*>(buf);
+  uint64_t *ts = NULL;
+  uint32_t *pc = NULL;
+  if ((timestamp_mode || pc_mode) && numElements > 0) {
+    const MEMREF_EXT *records = static_cast<MEMREF_EXT*>(buf);
+    _refs.resize(numElements);
+    for (UINT64 i = 0; i < numElements; i++) _refs[i] = records[i].ref;
+    reference = &_refs[0];
+    if (timestamp_mode) {
+      _ts.resize(numElements);
+      for (UINT64 i = 0; i < numElements; i++) _ts[i] = records[i].ts;
+      ts = &_ts[0];
     }
+    if (pc_mode) {
+      _pc.resize(numElements);
+      for (UINT64 i = 0; i < numElements; i++) _pc[i] = records[i].pc;
+      pc = &_pc[0];
+    }
+  }
+  // The buffer is refilled from the start afterwards, so it can be
+  // filtered in place
+  if (filter.Active()) {
+    numElements = filter.Apply(reference, ts, pc, numElements);
+  }
+
+  if (aggregate_mode) {
+    AggregateBuffer(reference, numElements);
   } else {
-    size_t nelm = fwrite(reference, sizeof(MEMREF), numElements, _ofile);
-    
-    if (nelm != numElements) {
-      cerr << nelm << " of "  << numElements << " written." << endl;
-      cerr << (numElements - nelm) << " remains." << endl;
+    DumpBufferToFile(reference, ts, pc, numElements, _tid);
+  }
+}
+
+
+VOID MLOG::DumpBufferToFile( const struct MEMREF * reference, const uint64_t * ts,
+                             const uint32_t * pc, UINT64 numElements,
+                             THREADID tid )
+{
+  if (stream_fd >= 0) {
+    if (numElements == 0) return;
+    _tids.assign(numElements, tid);
+    EncodeBlock(reference, ts, &_tids[0], pc, numElements, KnobCompress,
+                _raw, _block);
+    if (!StreamWrite(&_block[0], _block.size())) {
+      cerr << "Error: could not write block of " << numElements
+           << " records to the stream." << endl;
+      exit(1);
+    }
+  } else if (KnobDumpText) {
+    if (numElements == 0) return;
+    _text.resize(numElements *
+                 (TEXT_RECORD_MAX + TEXT_TIMESTAMP_MAX + TEXT_PC_MAX));
+    size_t len = FormatTextRecords(reference, numElements, &_text[0], ts, pc);
+    if (fwrite(&_text[0], 1, len, _ofile) != len) {
+      cerr << "Error: could not write " << numElements << " records." << endl;
+      exit(1);
+    }
+  } else {
+    if (numElements == 0) return;
+    // Encoded into the staging buffers rather than the writer's own
+    EncodeBlock(reference, ts, NULL, pc, numElements, KnobCompress, _raw,
+                _block);
+    if (fwrite(&_block[0], 1, _block.size(), _ofile) != _block.size()) {
+      cerr << "Error: could not write block of " << numElements
+           << " records." << endl;
       exit(1);
     }
   }
 }
 
+/*
+ * Add the reads of a buffer to the summary of this thread. Reads are
+ * keyed by address, or by cache line with -aggregate_line_size.
+ */
+VOID MLOG::AggregateBuffer( const struct MEMREF * reference, UINT64 numElements )
+{
+  intptr_t line_mask = ~(intptr_t)0;
+  if (KnobAggregateLineSize) line_mask = ~(intptr_t)(KnobAggregateLineSize - 1);
+  for (UINT64 i = 0; i < numElements; i++, reference++) {
+    if (reference->type == TRACE_READ) {
+      READSTAT &rs = reads[reference->addr & line_mask];
+      ++rs.count;
+      rs.size = std::max(rs.size, reference->size);
+      bytes_read += reference->size;
+    } else if (reference->type == TRACE_WRITE) {
+      bytes_written += reference->size;
+    }
+  }
+  count += numElements;
+}
+
+/*
+ * Queue a full buffer for the writer thread and return a spare one,
+ * waiting for the writer when all spare buffers are in flight. Once
+ * the writer thread is exiting, the buffer is written synchronously,
+ * after the writer has written the buffers queued before it.
+ * With a budget, a thread that would wait gets another spare buffer if
+ * the budget allows, and one with more spares than it needs gives one
+ * back.
+ */
+VOID * MLOG::HandOff( VOID * buf, UINT64 numElements )
+{
+  PENDING_BUFFER pb = { this, buf, numElements, NowNanos() };
+
+  PIN_GetLock(&pending_lock, _tid + 1);
+  if (writer_exiting) {
+    PIN_ReleaseLock(&pending_lock);
+    // The writer may still be writing earlier buffers of this thread
+    Drain();
+    ProcessBuffer(buf, numElements);
+    return buf;
+  }
+  PIN_GetLock(&_pool_lock, _tid + 1);
+  ++_in_flight;
+  PIN_ReleaseLock(&_pool_lock);
+  pending.push_back(pb);
+  PIN_SemaphoreSet(&pending_sem);
+  PIN_ReleaseLock(&pending_lock);
+
+  PIN_GetLock(&_pool_lock, _tid + 1);
+  if (budget_buffers) TrimPool();
+  while (_free_buffers.empty()) {
+    if (budget_buffers && GrowPool()) break;
+    PIN_SemaphoreClear(&_pool_sem);
+    PIN_ReleaseLock(&_pool_lock);
+    PIN_SemaphoreWait(&_pool_sem);
+    PIN_GetLock(&_pool_lock, _tid + 1);
+  }
+  VOID *next = _free_buffers.back();
+  _free_buffers.pop_back();
+  PIN_ReleaseLock(&_pool_lock);
+  return next;
+}
+
+/*
+ * Called by the writer thread once a buffer has been written.
+ */
+VOID MLOG::ReleaseBuffer( VOID * buf, UINT64 queued_ns )
+{
+  double latency = (double)(NowNanos() - queued_ns);
+  PIN_GetLock(&_pool_lock, _tid + 1);
+  _latency_ns = _latency_ns > 0 ? _latency_ns + (latency - _latency_ns) / 8
+                                : latency;
+  _free_buffers.push_back(buf);
+  --_in_flight;
+  PIN_SemaphoreSet(&_pool_sem);
+  PIN_ReleaseLock(&_pool_lock);
+}
+
+/*
+ * Add a spare buffer if the budget has one left. Called with _pool_lock
+ * held.
+ */
+bool MLOG::GrowPool()
+{
+  if (!BudgetAcquire()) return false;
+  VOID *buf = PIN_AllocateBuffer(bufId);
+  if (!buf) {
+    BudgetCharge(-1);
+    return false;
+  }
+  _free_buffers.push_back(buf);
+  max_spares = std::max(max_spares, ++_spares);
+  return true;
+}
+
+/*
+ * Give a free spare buffer back to the budget when the thread has more
+ * than it needs: enough to cover the time a buffer spends with the
+ * writer at the rate the thread fills them, and one more. Called with
+ * _pool_lock held.
+ */
+VOID MLOG::TrimPool()
+{
+  if (_free_buffers.size() < 2 || !(flush_interval_ns > 0)) return;
+  double needed = 1 + ceil(_latency_ns / flush_interval_ns);
+  if (_spares <= needed) return;
+  PIN_DeallocateBuffer(bufId, _free_buffers.back());
+  _free_buffers.pop_back();
+  --_spares;
+  BudgetCharge(-1);
+}
+
+/*
+ * Wait until the writer thread has written all buffers of this thread.
+ */
+VOID MLOG::Drain()
+{
+  PIN_GetLock(&_pool_lock, _tid + 1);
+  while (_in_flight > 0) {
+    PIN_SemaphoreClear(&_pool_sem);
+    PIN_ReleaseLock(&_pool_lock);
+    PIN_SemaphoreWait(&_pool_sem);
+    PIN_GetLock(&_pool_lock, _tid + 1);
+  }
+  PIN_ReleaseLock(&_pool_lock);
+}
+
+/* ===================================================================== */
+// Writer thread
+/* ===================================================================== */
+
+/*!
+ * Internal tool thread that encodes and writes the buffers handed off
+ * by the application threads. It drains the queue before exiting.
+ */
+static VOID WriterThread(VOID *arg)
+{
+  for (;;) {
+    PIN_GetLock(&pending_lock, 0);
+    while (pending.empty() && !writer_exiting) {
+      PIN_SemaphoreClear(&pending_sem);
+      PIN_ReleaseLock(&pending_lock);
+      PIN_SemaphoreWait(&pending_sem);
+      PIN_GetLock(&pending_lock, 0);
+    }
+    if (pending.empty()) {
+      PIN_ReleaseLock(&pending_lock);
+      break;
+    }
+    PENDING_BUFFER pb = pending.front();
+    pending.pop_front();
+    PIN_ReleaseLock(&pending_lock);
+
+    pb.mlog->ProcessBuffer(pb.buf, pb.numElements);
+    pb.mlog->ReleaseBuffer(pb.buf, pb.queued_ns);
+  }
+}
+
 
 /* ===================================================================== */
 // Instrumentation callbacks
@@ -204,23 +1016,278 @@ VOID Trace(TRACE trace, VOID *v)
 }
 #endif
 
-static int FunctionMatch(ADDRINT target) {
-  return target == target_func_addr;
+/*
+ * Id of the instruction ins. A new id is listed in the .pcs table as
+ *
+ *   id address file:line disassembly
+ *
+ * with "?:0" when the source line is unknown.
+ */
+static UINT32 PcId(INS ins)
+{
+  ADDRINT addr = INS_Address(ins);
+  std::map<ADDRINT, UINT32>::iterator it = pc_ids.find(addr);
+  if (it != pc_ids.end()) return it->second;
+  UINT32 id = pc_ids.size();
+  pc_ids[addr] = id;
+  INT32 line = 0;
+  string file;
+  PIN_GetSourceLocation(addr, NULL, &line, &file);
+  pcs_file << id << " " << hexstr(addr) << " "
+           << (file.empty() ? "?" : file) << ":" << line << " "
+           << INS_Disassemble(ins) << endl;
+  return id;
+}
+
+/*
+ * Fill-buffer arguments of the optional fields of a record made by ins.
+ * The caller frees the list once the fill is inserted.
+ */
+static IARGLIST FieldArgs(INS ins)
+{
+  IARGLIST args = IARGLIST_Alloc();
+  if (timestamp_mode) {
+    IARGLIST_AddArguments(args, IARG_TSC, offsetof(struct MEMREF_EXT, ts),
+                          IARG_END);
+  }
+  if (pc_mode) {
+    IARGLIST_AddArguments(args, IARG_UINT32, PcId(ins),
+                          offsetof(struct MEMREF_EXT, pc), IARG_END);
+  }
+  return args;
+}
+
+/*
+ * Id of the function at target, or NO_FUNCTION. The binary search
+ * narrows the range with conditional moves rather than branches.
+ */
+static UINT32 FindFunction(ADDRINT target) {
+  const FUNC_SET *set = target_set;
+  if (!set) return NO_FUNCTION;
+  size_t n = set->addrs.size();
+  if (n == 0) return NO_FUNCTION;
+  const ADDRINT *base = &set->addrs[0];
+  while (n > 1) {
+    size_t half = n / 2;
+    base = base[half] <= target ? base + half : base;
+    n -= half;
+  }
+  return *base == target ? set->ids[base - &set->addrs[0]] : NO_FUNCTION;
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL LookupFunction(ADDRINT target) {
+  return FindFunction(target);
+}
+
+static ADDRINT PIN_FAST_ANALYSIS_CALL FunctionMatch(ADDRINT id) {
+  return id != NO_FUNCTION;
+}
+
+/*
+ * Record a call if it goes to a traced function. Direct calls are
+ * resolved here; indirect calls look up their target when executed. In
+ * scoped mode, the call also enters the scope.
+ */
+static VOID InstrumentCall(INS ins)
+{
+  if (INS_IsDirectBranchOrCall(ins)) {
+    ADDRINT target = INS_DirectBranchOrCallTargetAddress(ins);
+    UINT32 id = FindFunction(target);
+    if (id == NO_FUNCTION) return;
+    IARGLIST args = FieldArgs(ins);
+    if (sample_mode == TRACE_SAMPLE_INVOCATION) {
+      INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleEnter,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, sample_reg, IARG_END);
+      INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleOn,
+                       IARG_FAST_ANALYSIS_CALL,
+                       IARG_REG_VALUE, sample_reg, IARG_END);
+      INS_InsertFillBufferThen(
+          ins, IPOINT_BEFORE, bufId,
+          IARG_ADDRINT, target, offsetof(struct MEMREF, addr),
+          IARG_UINT32, id, offsetof(struct MEMREF, size),
+          IARG_UINT32, TRACE_FUNC_CALL, offsetof(struct MEMREF, type),
+          IARG_IARGLIST, args,
+          IARG_END);
+    } else {
+      INS_InsertFillBuffer(
+          ins, IPOINT_BEFORE, bufId,
+          IARG_ADDRINT, target, offsetof(struct MEMREF, addr),
+          IARG_UINT32, id, offsetof(struct MEMREF, size),
+          IARG_UINT32, TRACE_FUNC_CALL, offsetof(struct MEMREF, type),
+          IARG_IARGLIST, args,
+          IARG_END);
+    }
+    IARGLIST_Free(args);
+    if (scoped_mode) {
+      INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ScopeEnter,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, scope_reg,
+                     IARG_RETURN_REGS, scope_reg, IARG_END);
+    }
+    return;
+  }
+
+  INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)LookupFunction,
+                 IARG_FAST_ANALYSIS_CALL,
+                 IARG_BRANCH_TARGET_ADDR,
+                 IARG_RETURN_REGS, func_reg, IARG_END);
+  if (sample_mode == TRACE_SAMPLE_INVOCATION) {
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)FunctionMatch,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, func_reg, IARG_END);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleEnter,
+                       IARG_FAST_ANALYSIS_CALL,
+                       IARG_REG_VALUE, sample_reg, IARG_END);
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleOnMatch,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, sample_reg,
+                     IARG_REG_VALUE, func_reg, IARG_END);
+  } else {
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)FunctionMatch,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, func_reg, IARG_END);
+  }
+  IARGLIST args = FieldArgs(ins);
+  INS_InsertFillBufferThen(
+      ins, IPOINT_BEFORE, bufId,
+      IARG_BRANCH_TARGET_ADDR, offsetof(struct MEMREF, addr),
+      IARG_REG_VALUE, func_reg, offsetof(struct MEMREF, size),
+      IARG_UINT32, TRACE_FUNC_CALL, offsetof(struct MEMREF, type),
+      IARG_IARGLIST, args,
+      IARG_END);
+  IARGLIST_Free(args);
+  if (scoped_mode) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ScopeEnterMatch,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_REG_VALUE, scope_reg,
+                   IARG_REG_VALUE, func_reg,
+                   IARG_RETURN_REGS, scope_reg, IARG_END);
+  }
+}
+
+/*
+ * Record a return from the traced function rtn with id func_id. In
+ * scoped mode, the return also leaves the scope.
+ */
+static VOID InstrumentRet(INS ins, RTN rtn, UINT32 func_id)
+{
+  IARGLIST args = FieldArgs(ins);
+  if (sample_mode == TRACE_SAMPLE_INVOCATION) {
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleOn,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, sample_reg, IARG_END);
+    INS_InsertFillBufferThen
+        (ins, IPOINT_BEFORE, bufId,
+         IARG_ADDRINT, RTN_Address(rtn), offsetof(struct MEMREF, addr),
+         IARG_UINT32, func_id, offsetof(struct MEMREF, size), 
+         IARG_UINT32, TRACE_FUNC_RET, offsetof(struct MEMREF, type),
+         IARG_IARGLIST, args,
+         IARG_END);
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleLeave,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_REG_VALUE, sample_reg, IARG_END);
+  } else {
+    INS_InsertFillBuffer
+        (ins, IPOINT_BEFORE, bufId,
+         IARG_ADDRINT, RTN_Address(rtn), offsetof(struct MEMREF, addr),
+         IARG_UINT32, func_id, offsetof(struct MEMREF, size), 
+         IARG_UINT32, TRACE_FUNC_RET, offsetof(struct MEMREF, type),
+         IARG_IARGLIST, args,
+         IARG_END);
+  }
+  IARGLIST_Free(args);
+  if (scoped_mode) {
+    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ScopeLeave,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_REG_VALUE, scope_reg,
+                   IARG_RETURN_REGS, scope_reg, IARG_END);
+  }
 }
 
 static void TraceCall(TRACE trace, VOID *v) {
   for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl=BBL_Next(bbl)) {
     for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins=INS_Next(ins)) {
-      if (INS_IsProcedureCall(ins)) {
-        INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)FunctionMatch,
-                         IARG_BRANCH_TARGET_ADDR, IARG_END);
-        INS_InsertFillBufferThen(
-            ins, IPOINT_BEFORE, bufId,
-            IARG_BRANCH_TARGET_ADDR, offsetof(struct MEMREF, addr),
-            IARG_UINT32, 0, offsetof(struct MEMREF, size),      
-            IARG_UINT32, TRACE_FUNC_CALL, offsetof(struct MEMREF, type),      
-            IARG_END);
+      if (INS_IsProcedureCall(ins)) InstrumentCall(ins);
+    }
+  }
+}
+
+/*
+ * Record a memory operand of type TRACE_READ or TRACE_WRITE. With
+ * sampling, inlined predicates skip the buffer fill while the thread is
+ * not sampling; burst and random sampling also count the reference.
+ */
+static VOID InsertMemoryFill(INS ins, UINT32 memOp, UINT32 refSize, UINT32 type)
+{
+  IARGLIST args = FieldArgs(ins);
+  if (sample_mode == TRACE_SAMPLE_NONE) {
+    INS_InsertFillBufferPredicated(
+        ins, IPOINT_BEFORE, bufId,
+        IARG_MEMORYOP_EA, memOp, offsetof(struct MEMREF, addr),
+        IARG_UINT32, refSize, offsetof(struct MEMREF, size),
+        IARG_UINT32, type, offsetof(struct MEMREF, type),
+        IARG_IARGLIST, args,
+        IARG_END);
+    IARGLIST_Free(args);
+    return;
+  }
+  if (sample_mode != TRACE_SAMPLE_INVOCATION) {
+    INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleTick,
+                               IARG_FAST_ANALYSIS_CALL,
+                               IARG_REG_VALUE, sample_reg, IARG_END);
+    INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleSwitch,
+                                 IARG_REG_VALUE, sample_reg, IARG_END);
+  }
+  INS_InsertIfPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)SampleOn,
+                             IARG_FAST_ANALYSIS_CALL,
+                             IARG_REG_VALUE, sample_reg, IARG_END);
+  INS_InsertFillBufferThen(
+      ins, IPOINT_BEFORE, bufId,
+      IARG_MEMORYOP_EA, memOp, offsetof(struct MEMREF, addr),
+      IARG_UINT32, refSize, offsetof(struct MEMREF, size),
+      IARG_UINT32, type, offsetof(struct MEMREF, type),
+      IARG_IARGLIST, args,
+      IARG_END);
+  IARGLIST_Free(args);
+}
+
+/*
+ * Instrument a trace in scoped mode. Both versions record calls to and
+ * returns from the traced functions and track the depth; the inside
+ * version also records every memory reference.
+ */
+static VOID TraceScoped(TRACE trace)
+{
+  bool inside = TRACE_Version(trace) == VERSION_INSIDE;
+  RTN rtn = TRACE_Rtn(trace);
+  UINT32 func_id = RTN_Valid(rtn) ? FindFunction(RTN_Address(rtn)) : NO_FUNCTION;
+
+  for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl=BBL_Next(bbl)) {
+    if (inside) {
+      INS_InsertVersionCase(BBL_InsHead(bbl), scope_reg, 0, VERSION_OUTSIDE,
+                            IARG_END);
+    } else {
+      INS_InsertVersionCase(BBL_InsHead(bbl), scope_reg, 1, VERSION_INSIDE,
+                            IARG_END);
+    }
+    for(INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins=INS_Next(ins)) {
+      if (inside) {
+        UINT32 memoryOperands = INS_MemoryOperandCount(ins);
+        for (UINT32 memOp = 0; memOp < memoryOperands; memOp++) {
+          UINT32 refSize = INS_MemoryOperandSize(ins, memOp);
+          if (INS_MemoryOperandIsRead(ins, memOp)) {
+            InsertMemoryFill(ins, memOp, refSize, TRACE_READ);
+          }
+          if (INS_MemoryOperandIsWritten(ins, memOp)) {
+            InsertMemoryFill(ins, memOp, refSize, TRACE_WRITE);
+          }
+        }
+        if (INS_IsRet(ins) && func_id != NO_FUNCTION) {
+          InstrumentRet(ins, rtn, func_id);
+        }
       }
+      if (INS_IsProcedureCall(ins)) InstrumentCall(ins);
     }
   }
 }
@@ -231,18 +1298,20 @@ static void TraceCall(TRACE trace, VOID *v) {
  */
 VOID Trace(TRACE trace, VOID *v)
 {
+  if (scoped_mode) {
+    TraceScoped(trace);
+    return;
+  }
+
   TraceCall(trace, v);
   
   RTN rtn = TRACE_Rtn(trace);
   if (!RTN_Valid(rtn)) return;
   
-  const string &rtn_name = RTN_Name(rtn);
-
-  //*out << "Rtn name: " << rtn_name << endl;
-  
-  if (rtn_name != target_func) return;
+  UINT32 func_id = FindFunction(RTN_Address(rtn));
+  if (func_id == NO_FUNCTION) return;
   
-  cerr << "Trace of target function, " << target_func << ", found.\n";
+  cerr << "Trace of target function, " << RTN_Name(rtn) << ", found.\n";
 
 #if 0 // Does not work; why?
   RTN_Open(rtn);
@@ -271,48 +1340,71 @@ VOID Trace(TRACE trace, VOID *v)
         // Note that if the operand is both read and written we log it once
         // for each.
         if (INS_MemoryOperandIsRead(ins, memOp)) {
-          INS_InsertFillBufferPredicated(
-              ins, IPOINT_BEFORE, bufId,
-              IARG_MEMORYOP_EA, memOp, offsetof(struct MEMREF, addr),
-              IARG_UINT32, refSize, offsetof(struct MEMREF, size),
-              IARG_UINT32, TRACE_READ, offsetof(struct MEMREF, type),
-              IARG_END);
+          InsertMemoryFill(ins, memOp, refSize, TRACE_READ);
         }
 
         if (INS_MemoryOperandIsWritten(ins, memOp)) {
-          INS_InsertFillBufferPredicated
-              (ins, IPOINT_BEFORE, bufId,
-               IARG_MEMORYOP_EA, memOp, offsetof(struct MEMREF, addr),
-               IARG_UINT32, refSize, offsetof(struct MEMREF, size), 
-               IARG_UINT32, TRACE_WRITE, offsetof(struct MEMREF, type),
-               IARG_END);
+          InsertMemoryFill(ins, memOp, refSize, TRACE_WRITE);
         }
       }
 
       if (INS_IsRet(ins)) {
-        INS_InsertFillBuffer
-            (ins, IPOINT_BEFORE, bufId,
-             IARG_ADDRINT, RTN_Address(rtn), offsetof(struct MEMREF, addr),
-             IARG_UINT32, 0, offsetof(struct MEMREF, size), 
-             IARG_UINT32, TRACE_FUNC_RET, offsetof(struct MEMREF, type),
-             IARG_END);
+        InstrumentRet(ins, rtn, func_id);
       }
     }    
   }
 }
 
-// Pin calls this function every time a new rtn is executed
+/*
+ * Whether a routine is one of the functions to trace
+ */
+static bool IsTargetName(const string &name)
+{
+  if (target_names.count(name)) return true;
+  for (size_t i = 0; i < target_patterns.size(); i++) {
+    if (regexec(target_patterns[i], name.c_str(), 0, NULL, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Give the function at addr the next id, publish a new set with it, and
+ * record it in the functions table. Aliases of a function keep the id
+ * of the first name.
+ */
+static VOID AddFunction(ADDRINT addr, const string &name)
+{
+  if (FindFunction(addr) != NO_FUNCTION) return;
+
+  FUNC_SET *set = new FUNC_SET;
+  if (target_set) *set = *target_set;
+  size_t pos = std::lower_bound(set->addrs.begin(), set->addrs.end(), addr) -
+      set->addrs.begin();
+  UINT32 id = num_functions++;
+  set->addrs.insert(set->addrs.begin() + pos, addr);
+  set->ids.insert(set->ids.begin() + pos, id);
+
+  if (target_set) retired_sets.push_back(target_set);
+  __sync_synchronize();
+  target_set = set;
+
+  functions_file << id << " " << hexstr(addr) << " " << name << endl;
+}
+
+// Pin calls this function for every rtn of an image when it is loaded
 VOID Routine(RTN rtn, VOID *v)
 {
   const string &rtn_name = RTN_Name(rtn);
 
-  if (rtn_name != target_func) return;
-  cerr << "Routine of target function, " << target_func << ", found.\n";
+  if (!IsTargetName(rtn_name)) return;
+  cerr << "Routine of target function, " << rtn_name << ", found.\n";
 
   RTN_Open(rtn);
   ADDRINT rtn_addr = RTN_Address(rtn);
   cerr << "rtn: " << rtn_addr << endl;
-  target_func_addr = rtn_addr;
+  AddFunction(rtn_addr, rtn_name);
 
 #if 0  
   INS_InsertFillBuffer(
@@ -338,6 +1430,241 @@ VOID Routine(RTN rtn, VOID *v)
   RTN_Close(rtn);  
 }
 
+/*
+ * Allocation functions recorded with -heap, by mangled name. The size
+ * argument of malloc-like functions is size_arg; calloc multiplies it
+ * by argument count_arg.
+ */
+enum
+{
+  ALLOC_MALLOC,
+  ALLOC_CALLOC,
+  ALLOC_REALLOC,
+  ALLOC_FREE
+};
+
+struct ALLOC_FUNC
+{
+  const char *name;
+  UINT32 kind;
+  UINT32 size_arg;
+  UINT32 count_arg;
+};
+
+static const ALLOC_FUNC alloc_funcs[] = {
+  { "malloc", ALLOC_MALLOC, 0, 0 },
+  { "calloc", ALLOC_CALLOC, 1, 0 },
+  { "realloc", ALLOC_REALLOC, 1, 0 },
+  { "free", ALLOC_FREE, 0, 0 },
+  { "_Znwm", ALLOC_MALLOC, 0, 0 },                 // operator new
+  { "_Znam", ALLOC_MALLOC, 0, 0 },                 // operator new[]
+  { "_ZnwmRKSt9nothrow_t", ALLOC_MALLOC, 0, 0 },
+  { "_ZnamRKSt9nothrow_t", ALLOC_MALLOC, 0, 0 },
+  { "_Znwj", ALLOC_MALLOC, 0, 0 },                 // 32-bit size_t
+  { "_Znaj", ALLOC_MALLOC, 0, 0 },
+  { "_ZdlPv", ALLOC_FREE, 0, 0 },                  // operator delete
+  { "_ZdaPv", ALLOC_FREE, 0, 0 },                  // operator delete[]
+  { "_ZdlPvm", ALLOC_FREE, 0, 0 },                 // sized delete
+  { "_ZdaPvm", ALLOC_FREE, 0, 0 },
+  { "_ZdlPvj", ALLOC_FREE, 0, 0 },
+  { "_ZdaPvj", ALLOC_FREE, 0, 0 },
+};
+
+/*
+ * Id of the allocation call site that returns to ret_ip. A new id is
+ * listed in the .allocs table as
+ *
+ *   id address file:line function
+ *
+ * where address is the return address of the call.
+ */
+static UINT32 SiteId(ADDRINT ret_ip)
+{
+  PIN_GetLock(&sites_lock, PIN_ThreadId() + 1);
+  std::map<ADDRINT, UINT32>::iterator it = site_ids.find(ret_ip);
+  if (it != site_ids.end()) {
+    UINT32 id = it->second;
+    PIN_ReleaseLock(&sites_lock);
+    return id;
+  }
+  UINT32 id = site_ids.size();
+  site_ids[ret_ip] = id;
+  INT32 line = 0;
+  string file;
+  PIN_LockClient();
+  // The call is the instruction before the return address
+  PIN_GetSourceLocation(ret_ip - 1, NULL, &line, &file);
+  string function = RTN_FindNameByAddress(ret_ip - 1);
+  PIN_UnlockClient();
+  allocs_file << id << " " << hexstr(ret_ip) << " "
+              << (file.empty() ? "?" : file) << ":" << line << " "
+              << (function.empty() ? "?" : function) << endl;
+  PIN_ReleaseLock(&sites_lock);
+  return id;
+}
+
+/*
+ * Entry of an allocation function. Nested calls, such as malloc from
+ * operator new, run below the saved stack pointer and are ignored. So
+ * are entries at the saved stack pointer: they are tail calls, such as
+ * the jump of operator delete to free, and belong to the same call. A
+ * saved stack pointer below sp was left by a call that did not return,
+ * e.g. one that threw, and is replaced.
+ */
+static BOOL EnterOutermost(ADDRINT sp, ADDRINT *saved_sp, ADDRINT *entered)
+{
+  *entered = *saved_sp == 0 || sp > *saved_sp;
+  if (*entered) *saved_sp = sp;
+  return *entered;
+}
+
+/* Entry of malloc-like functions and realloc; saves the request */
+static VOID AllocEnter(ADDRINT sp, ADDRINT size, ADDRINT count, ADDRINT ret_ip,
+                       ADDRINT *saved_sp, ADDRINT *saved_size,
+                       ADDRINT *saved_site, ADDRINT *entered)
+{
+  if (!EnterOutermost(sp, saved_sp, entered)) return;
+  *saved_size = size * count;
+  *saved_site = SiteId(ret_ip);
+}
+
+/* Entry of free-like functions, whose records carry no call site */
+static VOID PIN_FAST_ANALYSIS_CALL FreeEnter(ADDRINT sp, ADDRINT *saved_sp,
+                                              ADDRINT *entered)
+{
+  EnterOutermost(sp, saved_sp, entered);
+}
+
+/* Whether the outermost allocation call is at sp and ptr is a block */
+static ADDRINT PIN_FAST_ANALYSIS_CALL IsOutermostBlock(ADDRINT sp,
+                                                       ADDRINT saved_sp,
+                                                       ADDRINT ptr)
+{
+  return (sp == saved_sp) & (ptr != 0);
+}
+
+/* Whether the function just entered started the outermost call */
+static ADDRINT PIN_FAST_ANALYSIS_CALL IsEnteredBlock(ADDRINT entered,
+                                                     ADDRINT ptr)
+{
+  return entered & (ptr != 0);
+}
+
+/* Clears the saved stack pointer when the outermost call returns */
+static ADDRINT PIN_FAST_ANALYSIS_CALL AllocLeave(ADDRINT sp, ADDRINT saved_sp)
+{
+  return sp == saved_sp ? 0 : saved_sp;
+}
+
+/*
+ * Record a free of the block in argument 0 at ins, the head of free or
+ * realloc, if the call is the outermost one. A free reached by a tail
+ * call from operator delete is recorded only once, at delete.
+ */
+static VOID InstrumentFree(INS ins)
+{
+  IARGLIST args = FieldArgs(ins);
+  INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsEnteredBlock,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_REG_VALUE, alloc_entered_reg,
+                   IARG_FUNCARG_ENTRYPOINT_VALUE, 0, IARG_END);
+  INS_InsertFillBufferThen(
+      ins, IPOINT_BEFORE, bufId,
+      IARG_FUNCARG_ENTRYPOINT_VALUE, 0, offsetof(struct MEMREF, addr),
+      IARG_UINT32, 0, offsetof(struct MEMREF, size),
+      IARG_UINT32, TRACE_FREE, offsetof(struct MEMREF, type),
+      IARG_IARGLIST, args,
+      IARG_END);
+  IARGLIST_Free(args);
+}
+
+/* Record the block returned by an allocation function at ret */
+static VOID InstrumentAllocReturn(INS ins)
+{
+  IARGLIST args = FieldArgs(ins);
+  INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsOutermostBlock,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_REG_VALUE, REG_STACK_PTR,
+                   IARG_REG_VALUE, alloc_sp_reg,
+                   IARG_REG_VALUE, REG_GAX, IARG_END);
+  INS_InsertFillBufferThen(
+      ins, IPOINT_BEFORE, bufId,
+      IARG_REG_VALUE, REG_GAX, offsetof(struct MEMREF, addr),
+      IARG_REG_VALUE, alloc_site_reg, offsetof(struct MEMREF, size),
+      IARG_UINT32, TRACE_ALLOC, offsetof(struct MEMREF, type),
+      IARG_IARGLIST, args,
+      IARG_END);
+  INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsOutermostBlock,
+                   IARG_FAST_ANALYSIS_CALL,
+                   IARG_REG_VALUE, REG_STACK_PTR,
+                   IARG_REG_VALUE, alloc_sp_reg,
+                   IARG_REG_VALUE, REG_GAX, IARG_END);
+  INS_InsertFillBufferThen(
+      ins, IPOINT_BEFORE, bufId,
+      IARG_REG_VALUE, alloc_size_reg, offsetof(struct MEMREF, addr),
+      IARG_REG_VALUE, alloc_site_reg, offsetof(struct MEMREF, size),
+      IARG_UINT32, TRACE_ALLOC, offsetof(struct MEMREF, type),
+      IARG_IARGLIST, args,
+      IARG_END);
+  IARGLIST_Free(args);
+}
+
+/*
+ * Instrument the allocation functions of an image. Their records are
+ * written whatever the scope and sampling, so that every access can be
+ * attributed to its block.
+ */
+VOID ImageLoad(IMG img, VOID *v)
+{
+  for (size_t i = 0; i < sizeof(alloc_funcs) / sizeof(alloc_funcs[0]); i++) {
+    const ALLOC_FUNC &f = alloc_funcs[i];
+    RTN rtn = RTN_FindByName(img, f.name);
+    if (!RTN_Valid(rtn)) continue;
+    RTN_Open(rtn);
+    INS head = RTN_InsHead(rtn);
+    if (f.kind == ALLOC_FREE) {
+      INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)FreeEnter,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, REG_STACK_PTR,
+                     IARG_REG_REFERENCE, alloc_sp_reg,
+                     IARG_REG_REFERENCE, alloc_entered_reg, IARG_END);
+    } else if (f.kind == ALLOC_CALLOC) {
+      INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)AllocEnter,
+                     IARG_REG_VALUE, REG_STACK_PTR,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, f.size_arg,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, f.count_arg,
+                     IARG_RETURN_IP,
+                     IARG_REG_REFERENCE, alloc_sp_reg,
+                     IARG_REG_REFERENCE, alloc_size_reg,
+                     IARG_REG_REFERENCE, alloc_site_reg,
+                     IARG_REG_REFERENCE, alloc_entered_reg, IARG_END);
+    } else {
+      INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)AllocEnter,
+                     IARG_REG_VALUE, REG_STACK_PTR,
+                     IARG_FUNCARG_ENTRYPOINT_VALUE, f.size_arg,
+                     IARG_ADDRINT, (ADDRINT)1,
+                     IARG_RETURN_IP,
+                     IARG_REG_REFERENCE, alloc_sp_reg,
+                     IARG_REG_REFERENCE, alloc_size_reg,
+                     IARG_REG_REFERENCE, alloc_site_reg,
+                     IARG_REG_REFERENCE, alloc_entered_reg, IARG_END);
+    }
+    if (f.kind == ALLOC_FREE || f.kind == ALLOC_REALLOC) InstrumentFree(head);
+    for (INS ins = head; INS_Valid(ins); ins = INS_Next(ins)) {
+      if (!INS_IsRet(ins)) continue;
+      if (f.kind != ALLOC_FREE) InstrumentAllocReturn(ins);
+      INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AllocLeave,
+                     IARG_FAST_ANALYSIS_CALL,
+                     IARG_REG_VALUE, REG_STACK_PTR,
+                     IARG_REG_VALUE, alloc_sp_reg,
+                     IARG_RETURN_REGS, alloc_sp_reg, IARG_END);
+    }
+    RTN_Close(rtn);
+    cerr << "Allocation function " << f.name << " in " << IMG_Name(img)
+         << " is instrumented" << endl;
+  }
+}
+
 
 /**************************************************************************
  *
@@ -359,16 +1686,68 @@ VOID Routine(RTN rtn, VOID *v)
 VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
                   UINT64 numElements, VOID *v)
 {
-    struct MEMREF * reference=(struct MEMREF*)buf;
-
     MLOG * mlog = static_cast<MLOG*>( PIN_GetThreadData( mlog_key, tid ) );
 
-    mlog->DumpBufferToFile( reference, numElements, tid );
+    UINT64 start = NowNanos();
+    double interval = (double)(start - mlog->last_flush_ns);
+    mlog->flush_interval_ns = mlog->num_flushes
+        ? mlog->flush_interval_ns + (interval - mlog->flush_interval_ns) / 8
+        : interval;
+    VOID *next = buf;
+    if (KnobWriterBuffers) {
+      next = mlog->HandOff( buf, numElements );
+    } else {
+      mlog->ProcessBuffer( buf, numElements );
+    }
+    mlog->last_flush_ns = NowNanos();
+    mlog->stall_ns += mlog->last_flush_ns - start;
+    ++mlog->num_flushes;
+    mlog->records_flushed += numElements;
     
-    return buf;
+    return next;
 }
 
 
+/*!
+ * Bounds of the mapping that holds the stack pointer sp, from
+ * /proc/self/maps. Only the main stack, the [stack] mapping, may still
+ * grow down to the stack size limit; the stacks of other threads are
+ * fixed mappings with other mappings right below them. Without the
+ * maps, the limit below sp is used for the main thread, and other
+ * threads get no bounds.
+ * @return  whether bounds were found
+ */
+static BOOL StackBounds(ADDRINT sp, BOOL main_thread, ADDRINT *lo,
+                        ADDRINT *hi)
+{
+  ADDRINT limit = 8 << 20;
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    limit = rl.rlim_cur;
+  }
+  *lo = sp > limit ? sp - limit : 0;
+  *hi = sp + 1;
+
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (!maps) return main_thread;
+  BOOL found = FALSE;
+  char line[512];
+  while (fgets(line, sizeof(line), maps)) {
+    unsigned long start, end;
+    if (sscanf(line, "%lx-%lx", &start, &end) != 2) continue;
+    if (sp < start || sp >= end) continue;
+    *hi = end;
+    *lo = start;
+    if (strstr(line, "[stack]")) {
+      *lo = std::min<ADDRINT>(start, end > limit ? end - limit : 0);
+    }
+    found = TRUE;
+    break;
+  }
+  fclose(maps);
+  return found;
+}
+
 /*!
  * Increase counter of threads in the application.
  * This function is called for every thread created by the application when it is
@@ -386,6 +1765,25 @@ VOID ThreadStart(THREADID threadIndex, CONTEXT *ctxt, INT32 flags, VOID *v)
 
   // A thread will need to look up its MLOG, so save pointer in TLS
   PIN_SetThreadData(mlog_key, mlog, threadIndex);
+
+  if (scoped_mode) PIN_SetContextReg(ctxt, scope_reg, 0);
+  if (heap_mode) PIN_SetContextReg(ctxt, alloc_sp_reg, 0);
+
+  if (KnobFilterStack) {
+    ADDRINT lo, hi;
+    if (StackBounds(PIN_GetContextReg(ctxt, REG_STACK_PTR), threadIndex == 0,
+                    &lo, &hi)) {
+      mlog->filter.SetDropRange(lo, hi);
+    } else {
+      cerr << "Warning: stack of thread " << threadIndex
+           << " not found; its accesses are not filtered" << endl;
+    }
+  }
+
+  // The sampling predicates find the state of the thread in a register
+  if (sample_mode != TRACE_SAMPLE_NONE) {
+    PIN_SetContextReg(ctxt, sample_reg, (ADDRINT)&mlog->sampler);
+  }
 }
 
 /*!
@@ -399,11 +1797,119 @@ VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
 {
   MLOG * mlog = static_cast<MLOG*>(PIN_GetThreadData(mlog_key, tid));
 
+  mlog->Drain();
+  double fill = mlog->num_flushes
+      ? 100.0 * mlog->records_flushed / (mlog->num_flushes * buffer_records)
+      : 0;
+  cerr << "Thread " << tid << " stalled for " << mlog->stall_ns / 1000000
+       << " ms in " << mlog->num_flushes << " buffer flushes, buffers "
+       << fill << "% full on average";
+  if (KnobWriterBuffers) {
+    cerr << ", at most " << mlog->max_spares << " spare buffers";
+  }
+  cerr << endl;
+  PIN_GetLock(&stats_lock, tid + 1);
+  total_stall_ns += mlog->stall_ns;
+  total_flushes += mlog->num_flushes;
+  total_records += mlog->records_flushed;
+  const FilterStats &fs = mlog->filter.Stats();
+  filter_totals.in += fs.in;
+  filter_totals.coalesced += fs.coalesced;
+  filter_totals.stack += fs.stack;
+  filter_totals.range += fs.range;
+  if (aggregate_mode) {
+    for (size_t i = 0; i < mlog->reads.Capacity(); ++i) {
+      if (!mlog->reads.Used(i)) continue;
+      const READSTAT &rs = mlog->reads.Value(i);
+      READSTAT &merged = aggregate_reads[mlog->reads.Key(i)];
+      merged.count += rs.count;
+      merged.size = std::max(merged.size, rs.size);
+    }
+    aggregate_count += mlog->count;
+    aggregate_bytes_read += mlog->bytes_read;
+    aggregate_bytes_written += mlog->bytes_written;
+  }
+  PIN_ReleaseLock(&stats_lock);
+
   delete mlog;
 
   PIN_SetThreadData(mlog_key, 0, tid);
 }
 
+/*!
+ * Stop the writer thread after it has written all queued buffers.
+ * Buffers flushed after this point are written synchronously.
+ * @param[in]   v               value specified by the tool in the
+ *                              PIN_AddPrepareForFiniFunction function call
+ */
+VOID PrepareForFini(VOID *v)
+{
+  PIN_GetLock(&pending_lock, 0);
+  writer_exiting = true;
+  PIN_SemaphoreSet(&pending_sem);
+  PIN_ReleaseLock(&pending_lock);
+  PIN_WaitForThreadTermination(writer_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+/*!
+ * Write the merged summary of all threads in aggregate mode. The report
+ * has the same fields as analysis/uniq.
+ */
+static VOID WriteAggregateReport()
+{
+  UINT64 uniq_read_bytes = 0;
+  UINT64 dup_read_bytes = 0;
+  for (size_t i = 0; i < aggregate_reads.Capacity(); ++i) {
+    if (!aggregate_reads.Used(i)) continue;
+    const READSTAT &rs = aggregate_reads.Value(i);
+    uniq_read_bytes += KnobAggregateLineSize ? KnobAggregateLineSize.Value() : rs.size;
+    dup_read_bytes += rs.count * rs.size;
+  }
+  const char *unit = KnobAggregateLineSize ? "lines" : "addresses";
+  *out << "Number of elements processed: " << aggregate_count << endl;
+  *out << "Total bytes read: " << aggregate_bytes_read << endl;
+  *out << "Total bytes written: " << aggregate_bytes_written << endl;
+  *out << "Number of uniq " << unit << ": " << aggregate_reads.Size() << endl;
+  *out << "Total uniq bytes read: " << uniq_read_bytes << endl;
+  *out << "Total dup bytes read: " << dup_read_bytes << endl;
+  if (sample_mode != TRACE_SAMPLE_NONE) {
+    *out << "Sampled fraction of references: " << sampling.sample_fraction
+         << endl;
+  }
+  out->flush();
+}
+
+/*!
+ * Print out the total stall time and records of the application threads.
+ * @param[in]   code            exit code of the application
+ * @param[in]   v               value specified by the tool in the
+ *                              PIN_AddFiniFunction function call
+ */
+VOID Fini(INT32 code, VOID *v)
+{
+  double fill = total_flushes
+      ? 100.0 * total_records / (total_flushes * buffer_records)
+      : 0;
+  cerr << "Application threads stalled for " << total_stall_ns / 1000000
+       << " ms in " << total_flushes << " buffer flushes, buffers " << fill
+       << "% full on average" << endl;
+  cerr << "Recorded " << total_records << " records" << endl;
+  if (filter_proto.Active()) {
+    UINT64 dropped =
+        filter_totals.coalesced + filter_totals.stack + filter_totals.range;
+    double percent = filter_totals.in ? 100.0 * dropped / filter_totals.in : 0;
+    cerr << "Filter dropped " << dropped << " of " << filter_totals.in
+         << " records (" << percent << "%): " << filter_totals.coalesced << " coalesced, "
+         << filter_totals.stack << " on the stack, " << filter_totals.range
+         << " outside the keep ranges" << endl;
+  }
+  if (aggregate_mode) WriteAggregateReport();
+  if (stream_fd >= 0) close(stream_fd);
+
+  for (size_t i = 0; i < retired_sets.size(); i++) delete retired_sets[i];
+  retired_sets.clear();
+}
+
 /*!
  * The main procedure of the tool.
  * This function is called when the application image is loaded but not yet started.
@@ -430,17 +1936,193 @@ int main(int argc, char *argv[])
     return Usage();
   }
   
-  target_func = KnobFunction.Value();
-  if (target_func.empty()) {
+  for (UINT32 i = 0; i < KnobFunction.NumberOfValues(); i++) {
+    if (!KnobFunction.Value(i).empty()) target_names.insert(KnobFunction.Value(i));
+  }
+  if (!KnobFunctionFile.Value().empty()) {
+    std::ifstream names(KnobFunctionFile.Value().c_str());
+    if (!names) {
+      cerr << "Error: could not open " << KnobFunctionFile.Value() << endl;
+      return Usage();
+    }
+    string name;
+    while (std::getline(names, name)) {
+      size_t begin = name.find_first_not_of(" \t\r");
+      if (begin == string::npos || name[begin] == '#') continue;
+      size_t end = name.find_last_not_of(" \t\r");
+      target_names.insert(name.substr(begin, end - begin + 1));
+    }
+  }
+  for (UINT32 i = 0; i < KnobFunctionRegex.NumberOfValues(); i++) {
+    const string &pattern = KnobFunctionRegex.Value(i);
+    if (pattern.empty()) continue;
+    regex_t *re = new regex_t;
+    string anchored = "^(" + pattern + ")$";
+    int err = regcomp(re, anchored.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (err != 0) {
+      char msg[256];
+      regerror(err, re, msg, sizeof(msg));
+      cerr << "Error: invalid regular expression " << pattern << ": " << msg
+           << endl;
+      delete re;
+      return Usage();
+    }
+    target_patterns.push_back(re);
+  }
+  if (target_names.empty() && target_patterns.empty()) {
+    cerr << "Error: no function to trace; give -f, -f_file or -f_regex"
+         << endl;
     return Usage();
   }
 
+  // Ids of the traced functions, for the size field of call and return
+  // records
+  string functionsName = fileName + ".functions";
+  functions_file.open(functionsName.c_str());
+  if (!functions_file) {
+    cerr << "Error: could not open " << functionsName << endl;
+    return 1;
+  }
+  func_reg = PIN_ClaimToolRegister();
+  if (!REG_valid(func_reg)) {
+    cerr << "Error: no tool register available" << endl;
+    return 1;
+  }
+  scoped_mode = KnobScoped;
+  if (scoped_mode) {
+    scope_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(scope_reg)) {
+      cerr << "Error: no tool register available" << endl;
+      return 1;
+    }
+  }
+
+  if (KnobMode.Value() == "aggregate") {
+    aggregate_mode = true;
+  } else if (KnobMode.Value() != "trace") {
+    cerr << "Error: unknown mode " << KnobMode.Value() << endl;
+    return Usage();
+  }
+  if (KnobAggregateLineSize & (KnobAggregateLineSize - 1)) {
+    cerr << "Error: line size must be a power of two" << endl;
+    return Usage();
+  }
+
+  UINT32 coalesce_line = KnobCoalesceLine;
+  if (coalesce_line && (coalesce_line < 8 || (coalesce_line & (coalesce_line - 1)))) {
+    cerr << "Error: coalescing line size must be a power of two of at least 8"
+         << endl;
+    return Usage();
+  }
+  filter_proto.SetLineSize(coalesce_line);
+  for (UINT32 i = 0; i < KnobKeepRange.NumberOfValues(); i++) {
+    const string &range = KnobKeepRange.Value(i);
+    if (range.empty()) continue;
+    char *end;
+    unsigned long long lo = strtoull(range.c_str(), &end, 0);
+    unsigned long long hi = *end == ':' ? strtoull(end + 1, &end, 0) : 0;
+    if (*end || hi <= lo) {
+      cerr << "Error: invalid address range " << range << endl;
+      return Usage();
+    }
+    filter_proto.AddKeepRange((uintptr_t)lo, (uintptr_t)hi);
+  }
+  // The stack range is set per thread, so filter_proto is not active yet
+  if (KnobFilterStack) filter_proto.SetDropRange(0, 1);
+  memset(&filter_totals, 0, sizeof(filter_totals));
+
+  memset(&sampling, 0, sizeof(sampling));
+  if (KnobSample.Value() == "invocation") {
+    sample_mode = TRACE_SAMPLE_INVOCATION;
+    sampling.sample_length = 1;
+    sampling.sample_period = KnobSampleEvery;
+  } else if (KnobSample.Value() == "burst") {
+    sample_mode = TRACE_SAMPLE_BURST;
+    sampling.sample_length = KnobBurstLength;
+    sampling.sample_period = KnobBurstPeriod;
+  } else if (KnobSample.Value() == "random") {
+    sample_mode = TRACE_SAMPLE_RANDOM;
+    sampling.sample_fraction = KnobSampleRate;
+    if (!(sampling.sample_fraction > 0 && sampling.sample_fraction < 1)) {
+      cerr << "Error: sample rate must be between 0 and 1" << endl;
+      return Usage();
+    }
+  } else if (KnobSample.Value() != "none") {
+    cerr << "Error: unknown sampling mode " << KnobSample.Value() << endl;
+    return Usage();
+  }
+  if (sample_mode == TRACE_SAMPLE_INVOCATION && sampling.sample_period == 0) {
+    cerr << "Error: -sample_every must be positive" << endl;
+    return Usage();
+  }
+  if (sample_mode == TRACE_SAMPLE_BURST &&
+      (sampling.sample_length == 0 ||
+       sampling.sample_length >= sampling.sample_period)) {
+    cerr << "Error: burst length must be positive and less than the burst "
+         << "period" << endl;
+    return Usage();
+  }
+  if (sample_mode == TRACE_SAMPLE_INVOCATION ||
+      sample_mode == TRACE_SAMPLE_BURST) {
+    sampling.sample_fraction =
+        (double)sampling.sample_length / sampling.sample_period;
+  }
+  sampling.sample_mode = sample_mode;
+  if (sample_mode != TRACE_SAMPLE_NONE) {
+    sample_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(sample_reg)) {
+      cerr << "Error: no tool register available" << endl;
+      return 1;
+    }
+  }
+
+  // Timestamps order the records of the threads, and instruction ids
+  // attribute them to the code; aggregate mode needs neither
+  timestamp_mode = KnobTimestamp && !aggregate_mode;
+  pc_mode = KnobPc && !aggregate_mode;
+  if (pc_mode) {
+    string pcsName = fileName + ".pcs";
+    pcs_file.open(pcsName.c_str());
+    if (!pcs_file) {
+      cerr << "Error: could not open " << pcsName << endl;
+      return 1;
+    }
+  }
+
+  heap_mode = KnobHeap && !aggregate_mode;
+  if (heap_mode) {
+    alloc_sp_reg = PIN_ClaimToolRegister();
+    alloc_size_reg = PIN_ClaimToolRegister();
+    alloc_site_reg = PIN_ClaimToolRegister();
+    alloc_entered_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(alloc_sp_reg) || !REG_valid(alloc_size_reg) ||
+        !REG_valid(alloc_site_reg) || !REG_valid(alloc_entered_reg)) {
+      cerr << "Error: no tool register available" << endl;
+      return 1;
+    }
+    string allocsName = fileName + ".allocs";
+    allocs_file.open(allocsName.c_str());
+    if (!allocs_file) {
+      cerr << "Error: could not open " << allocsName << endl;
+      return 1;
+    }
+    PIN_InitLock(&sites_lock);
+  }
+
+  if (!KnobStream.Value().empty() && !aggregate_mode) {
+    UINT32 flags = TRACE_HAS_THREAD | (timestamp_mode ? TRACE_HAS_TIMESTAMP : 0) |
+        (pc_mode ? TRACE_HAS_PC : 0);
+    if (!OpenStream(KnobStream.Value(), flags)) return 1;
+  }
+
   // Initialize the memory reference buffer;
   // set up the callback to process the buffer.
   //
-  bufId = PIN_DefineTraceBuffer(sizeof(struct MEMREF),
-                                KnobNumPagesInBuffer,
+  size_t record_size = timestamp_mode || pc_mode ? sizeof(struct MEMREF_EXT)
+                                                 : sizeof(struct MEMREF);
+  bufId = PIN_DefineTraceBuffer(record_size, KnobNumPagesInBuffer,
                                 BufferFull, 0);
+  buffer_records = (UINT64)KnobNumPagesInBuffer * 4096 / record_size;
 
   if(bufId == BUFFER_ID_INVALID)
   {
@@ -448,6 +2130,23 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  // Trace buffers are sized once for all threads; a budget moves spare
+  // buffers between them instead
+  if (KnobBufferBudget) {
+    if (!KnobWriterBuffers) {
+      cerr << "Error: -buffer_budget needs -writer_buffers" << endl;
+      return Usage();
+    }
+    budget_buffers = ((UINT64)KnobBufferBudget << 20) /
+        ((UINT64)KnobNumPagesInBuffer * 4096);
+    if (budget_buffers == 0) {
+      cerr << "Error: -buffer_budget is less than one buffer" << endl;
+      return Usage();
+    }
+    PIN_InitLock(&budget_lock);
+  }
+  SetStagingHugePages(KnobHugeStaging);
+
   // Initialize thread-specific data not handled by buffering api.
   mlog_key = PIN_CreateThreadDataKey(0);
    
@@ -457,17 +2156,48 @@ RTN_AddInstrumentFunction(Routine, 0);
   // Register function to be called to instrument traces
   TRACE_AddInstrumentFunction(Trace, 0);
 
+  // Register function to find the allocation functions of every image
+  if (heap_mode) IMG_AddInstrumentFunction(ImageLoad, 0);
+
 
   // Register function to be called for every thread before it starts running
   PIN_AddThreadStartFunction(ThreadStart, 0);
 
   // Register function to be called when the application exits
   PIN_AddThreadFiniFunction(ThreadFini, 0);
+  PIN_AddFiniFunction(Fini, 0);
+
+  PIN_InitLock(&stats_lock);
+
+  // Start the background writer thread
+  if (KnobWriterBuffers) {
+    PIN_InitLock(&pending_lock);
+    PIN_SemaphoreInit(&pending_sem);
+    if (PIN_SpawnInternalThread(WriterThread, 0, 0, &writer_uid) ==
+        INVALID_THREADID) {
+      cerr << "Error: could not start writer thread" << endl;
+      return 1;
+    }
+    PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+  }
 
     
   cerr <<  "===============================================" << endl;
-  cerr <<  "Function " << target_func << " is instrumented by Memory Tracer" << endl;  
-  cerr <<  "See file " << KnobOutputFile.Value() << ".PID.TID for analysis results" << endl;
+  for (std::set<string>::const_iterator it = target_names.begin();
+       it != target_names.end(); ++it) {
+    cerr <<  "Function " << *it << " is instrumented by Memory Tracer" << endl;
+  }
+  for (UINT32 i = 0; i < KnobFunctionRegex.NumberOfValues(); i++) {
+    if (KnobFunctionRegex.Value(i).empty()) continue;
+    cerr <<  "Functions matching " << KnobFunctionRegex.Value(i)
+         << " are instrumented by Memory Tracer" << endl;
+  }
+  cerr <<  "See file " << functionsName << " for the ids of the functions" << endl;
+  if (aggregate_mode) {
+    cerr <<  "See file " << KnobOutputFile.Value() << " for analysis results" << endl;
+  } else {
+    cerr <<  "See file " << KnobOutputFile.Value() << ".PID.TID for analysis results" << endl;
+  }
   cerr <<  "===============================================" << endl;
 
   // Start the program, never returns
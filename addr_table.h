@@ -0,0 +1,132 @@
+#ifndef ADDR_TABLE_H_
+#define ADDR_TABLE_H_
+
+/*
+ * Open-addressing hash table keyed by address, with linear probing.
+ * Keys and values live in flat arrays, so lookups touch one or two
+ * cache lines and there is no per-entry allocation.
+ *
+ * Slots are visited with Capacity()/Used()/Key()/Value(). The key used
+ * to mark empty slots is stored in an extra slot at index Capacity() - 1
+ * so that every address can be a key.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#define ADDR_TABLE_EMPTY ((intptr_t)-1)
+
+static inline uint64_t HashAddr(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+template <typename V>
+class AddrTable {
+ public:
+  /* capacity is rounded up to a power of two */
+  explicit AddrTable(size_t capacity = 1024): _size(0), _has_empty_key(false) {
+    size_t n = 16;
+    while (n < capacity) n <<= 1;
+    Init(n);
+  }
+
+  size_t Size() const { return _size; }
+
+  /* Returns the value of key, inserting a default value if missing. */
+  V &operator[](intptr_t key) {
+    if (key == ADDR_TABLE_EMPTY) {
+      if (!_has_empty_key) {
+        _has_empty_key = true;
+        ++_size;
+      }
+      return _values[_mask + 1];
+    }
+    size_t i = HashAddr((uint64_t)key) & _mask;
+    while (true) {
+      intptr_t k = _keys[i];
+      if (k == key) return _values[i];
+      if (k == ADDR_TABLE_EMPTY) break;
+      i = (i + 1) & _mask;
+    }
+    if ((_size + 1) * 4 > (_mask + 1) * 3) {
+      Grow();
+      return (*this)[key];
+    }
+    _keys[i] = key;
+    ++_size;
+    return _values[i];
+  }
+
+  /* Returns NULL if key is missing. */
+  V *Find(intptr_t key) {
+    if (key == ADDR_TABLE_EMPTY) {
+      return _has_empty_key ? &_values[_mask + 1] : NULL;
+    }
+    size_t i = HashAddr((uint64_t)key) & _mask;
+    while (true) {
+      intptr_t k = _keys[i];
+      if (k == key) return &_values[i];
+      if (k == ADDR_TABLE_EMPTY) return NULL;
+      i = (i + 1) & _mask;
+    }
+  }
+
+  /* Hints the cache about an upcoming lookup of key. */
+  void Prefetch(intptr_t key) const {
+    size_t i = HashAddr((uint64_t)key) & _mask;
+    __builtin_prefetch(&_keys[i]);
+    __builtin_prefetch(&_values[i]);
+  }
+
+  size_t Capacity() const { return _mask + 2; }
+  bool Used(size_t i) const {
+    return i <= _mask ? _keys[i] != ADDR_TABLE_EMPTY : _has_empty_key;
+  }
+  intptr_t Key(size_t i) const { return i <= _mask ? _keys[i] : ADDR_TABLE_EMPTY; }
+  V &Value(size_t i) { return _values[i]; }
+  const V &Value(size_t i) const { return _values[i]; }
+
+  void Clear() {
+    Init(16);
+    _size = 0;
+    _has_empty_key = false;
+  }
+
+ private:
+  void Init(size_t n) {
+    _mask = n - 1;
+    _keys.assign(n, ADDR_TABLE_EMPTY);
+    _values.assign(n + 1, V());
+  }
+
+  void Grow() {
+    std::vector<intptr_t> keys;
+    std::vector<V> values;
+    keys.swap(_keys);
+    values.swap(_values);
+    size_t old_cap = _mask + 1;
+    Init(old_cap * 2);
+    _values[_mask + 1] = values[old_cap];
+    for (size_t i = 0; i < old_cap; ++i) {
+      if (keys[i] == ADDR_TABLE_EMPTY) continue;
+      size_t j = HashAddr((uint64_t)keys[i]) & _mask;
+      while (_keys[j] != ADDR_TABLE_EMPTY) j = (j + 1) & _mask;
+      _keys[j] = keys[i];
+      _values[j] = values[i];
+    }
+  }
+
+  std::vector<intptr_t> _keys;
+  std::vector<V> _values;
+  size_t _mask;
+  size_t _size;
+  bool _has_empty_key;
+};
+
+#endif /* ADDR_TABLE_H_ */
@@ -0,0 +1,354 @@
+/*
+ * Classifies the memory accesses of a trace as streaming, strided or
+ * irregular, the way a hardware stride prefetcher would see them.
+ *
+ *   access_pattern [-a] [-e ENTRIES] [-l LINE_SIZE] [-w WINDOW] trace
+ *
+ * Accesses are matched to streams in a small table of ENTRIES streams
+ * (16 by default), replaced in LRU order. Each stream has the address
+ * of its last access, a stride and a confidence counter, as in a
+ * reference prediction table. In traces recorded with -pc, streams are
+ * keyed by instruction id unless -a is given. Otherwise an access
+ * belongs to the stream whose next address it is, or else to the
+ * nearest stream within WINDOW bytes (4096 by default) of its last
+ * access.
+ *
+ * An access at the stride of its stream after the stride has been
+ * confirmed once is covered: a prefetcher would have fetched it. Covered
+ * accesses are streaming if the stride is at most LINE_SIZE bytes (64 by
+ * default), strided if it is larger, and repeated if it is 0. The rest
+ * are irregular; of those, the ones in the window of a stream are
+ * counted apart as near misses, since a prefetcher with a larger window
+ * or another stride could still cover them.
+ *
+ * Results are reported for the whole trace and per traced function,
+ * attributed to the innermost function between TRACE_FUNC_CALL and
+ * TRACE_FUNC_RET markers, with a histogram of the strides of the covered
+ * accesses. The trace is replayed in one pass in order; memory does not
+ * depend on its length.
+ */
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../common.h"
+#include "mapped_trace.h"
+
+using namespace std;
+
+/* Distinct strides kept in the histogram of a function */
+#define MAX_STRIDES (32)
+/* Confidence of a stream once its stride has been confirmed */
+#define CONFIRMED (1)
+#define MAX_CONFIDENCE (3)
+
+enum {
+  PATTERN_REPEATED = 0,
+  PATTERN_STREAMING,
+  PATTERN_STRIDED,
+  PATTERN_NEAR,
+  PATTERN_IRREGULAR,
+  NUM_PATTERNS
+};
+
+static const char *pattern_names[NUM_PATTERNS] = {
+  "repeated", "streaming", "strided", "near miss", "irregular"
+};
+
+struct StrideCount {
+  int64_t stride;
+  uint64_t count;
+};
+
+struct PatternStats {
+  uint64_t counts[NUM_PATTERNS];
+  /* Strides of covered accesses; strides beyond MAX_STRIDES go to other */
+  StrideCount strides[MAX_STRIDES];
+  size_t num_strides;
+  uint64_t other_strides;
+
+  void Clear() { memset(this, 0, sizeof(*this)); }
+
+  void AddStride(int64_t stride, uint64_t count) {
+    for (size_t i = 0; i < num_strides; ++i) {
+      if (strides[i].stride == stride) {
+        strides[i].count += count;
+        return;
+      }
+    }
+    if (num_strides == MAX_STRIDES) {
+      other_strides += count;
+      return;
+    }
+    strides[num_strides].stride = stride;
+    strides[num_strides].count = count;
+    ++num_strides;
+  }
+
+  void Merge(const PatternStats &s) {
+    for (int p = 0; p < NUM_PATTERNS; ++p) counts[p] += s.counts[p];
+    for (size_t i = 0; i < s.num_strides; ++i) {
+      AddStride(s.strides[i].stride, s.strides[i].count);
+    }
+    other_strides += s.other_strides;
+  }
+};
+
+struct Stream {
+  bool valid;
+  uint32_t key;
+  intptr_t last_addr;
+  int64_t stride;
+  int confidence;
+  uint64_t last_use;
+};
+
+/*
+ * The stream table. Lookups scan the entries, which is cheap for the
+ * table sizes of hardware prefetchers.
+ */
+class StreamTable {
+ public:
+  StreamTable(size_t entries, int64_t window, uint64_t line_size)
+      : _streams(entries), _window(window), _line_size(line_size),
+        _clock(0) {
+    memset(&_streams[0], 0, entries * sizeof(Stream));
+  }
+
+  /* Classifies an access by instruction key, or by address if !keyed */
+  int Access(intptr_t addr, bool keyed, uint32_t key, int64_t *stride) {
+    Stream *s = keyed ? FindKey(key) : FindAddr(addr);
+    if (!s) {
+      s = Victim();
+      s->valid = true;
+      s->key = key;
+      s->last_addr = addr;
+      s->stride = 0;
+      s->confidence = 0;
+      s->last_use = ++_clock;
+      return PATTERN_IRREGULAR;
+    }
+    s->last_use = ++_clock;
+    int64_t delta = (int64_t)addr - (int64_t)s->last_addr;
+    s->last_addr = addr;
+    if (delta == s->stride) {
+      bool covered = s->confidence >= CONFIRMED;
+      if (s->confidence < MAX_CONFIDENCE) ++s->confidence;
+      if (covered) {
+        *stride = delta;
+        if (delta == 0) return PATTERN_REPEATED;
+        return Magnitude(delta) <= _line_size ? PATTERN_STREAMING
+                                              : PATTERN_STRIDED;
+      }
+    } else if (s->confidence > CONFIRMED) {
+      // A confirmed stride survives one miss, as in a reference
+      // prediction table; otherwise the stream takes the new stride
+      s->confidence = CONFIRMED;
+    } else {
+      s->stride = delta;
+      s->confidence = 0;
+    }
+    return !InWindow(delta) ? PATTERN_IRREGULAR : PATTERN_NEAR;
+  }
+
+ private:
+  static uint64_t Magnitude(int64_t delta) {
+    return delta < 0 ? -(uint64_t)delta : (uint64_t)delta;
+  }
+
+  bool InWindow(int64_t delta) const {
+    return delta >= -_window && delta <= _window;
+  }
+
+  Stream *FindKey(uint32_t key) {
+    for (size_t i = 0; i < _streams.size(); ++i) {
+      if (_streams[i].valid && _streams[i].key == key) return &_streams[i];
+    }
+    return NULL;
+  }
+
+  /* The stream whose next address is addr, or else the nearest one */
+  Stream *FindAddr(intptr_t addr) {
+    Stream *nearest = NULL;
+    uint64_t best = 0;
+    for (size_t i = 0; i < _streams.size(); ++i) {
+      Stream &s = _streams[i];
+      if (!s.valid) continue;
+      int64_t delta = (int64_t)addr - (int64_t)s.last_addr;
+      if (delta == s.stride) return &s;
+      if (!InWindow(delta)) continue;
+      uint64_t dist = Magnitude(delta);
+      if (!nearest || dist < best) {
+        nearest = &s;
+        best = dist;
+      }
+    }
+    return nearest;
+  }
+
+  Stream *Victim() {
+    Stream *victim = &_streams[0];
+    for (size_t i = 0; i < _streams.size(); ++i) {
+      if (!_streams[i].valid) return &_streams[i];
+      if (_streams[i].last_use < victim->last_use) victim = &_streams[i];
+    }
+    return victim;
+  }
+
+  vector<Stream> _streams;
+  int64_t _window;
+  uint64_t _line_size;
+  uint64_t _clock;
+};
+
+/* Orders strides by decreasing count */
+struct ByCount {
+  bool operator()(const StrideCount &a, const StrideCount &b) const {
+    if (a.count != b.count) return a.count > b.count;
+    return a.stride < b.stride;
+  }
+};
+
+static void PrintStats(const PatternStats &s, const char *indent) {
+  uint64_t accesses = 0;
+  for (int p = 0; p < NUM_PATTERNS; ++p) accesses += s.counts[p];
+  uint64_t covered = s.counts[PATTERN_REPEATED] + s.counts[PATTERN_STREAMING] +
+      s.counts[PATTERN_STRIDED];
+  printf("%saccesses %llu covered %llu (%.4f)\n", indent,
+         (unsigned long long)accesses, (unsigned long long)covered,
+         accesses ? (double)covered / accesses : 0.0);
+  for (int p = 0; p < NUM_PATTERNS; ++p) {
+    printf("%s  %-10s %14llu %8.4f\n", indent, pattern_names[p],
+           (unsigned long long)s.counts[p],
+           accesses ? (double)s.counts[p] / accesses : 0.0);
+  }
+  if (covered == 0) return;
+  vector<StrideCount> strides(s.strides, s.strides + s.num_strides);
+  sort(strides.begin(), strides.end(), ByCount());
+  printf("%sstrides:\n", indent);
+  for (size_t i = 0; i < strides.size(); ++i) {
+    printf("%s  %14lld %14llu %8.4f\n", indent, (long long)strides[i].stride,
+           (unsigned long long)strides[i].count,
+           (double)strides[i].count / covered);
+  }
+  if (s.other_strides) {
+    printf("%s  %14s %14llu %8.4f\n", indent, "other",
+           (unsigned long long)s.other_strides,
+           (double)s.other_strides / covered);
+  }
+}
+
+bool classify(const char *path, size_t entries, size_t line_size,
+              int64_t window, bool by_addr) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  bool keyed = !by_addr && !trace.IsLegacy() &&
+      (trace.Header().flags & TRACE_HAS_PC);
+  StreamTable table(entries, window, line_size);
+
+  // Per-function statistics; index 0 is code outside any traced call
+  vector<PatternStats> func_stats(1);
+  func_stats[0].Clear();
+  map<intptr_t, size_t> func_index;
+  vector<intptr_t> func_addrs(1, 0);
+  vector<uint32_t> func_ids(1, 0);  // id in the tracer's .functions table
+  vector<size_t> call_stack;
+  size_t cur = 0;
+
+  OrderedChunkReader reader(trace);
+  MemrefSpan buf;
+  size_t count = 0;
+  while (reader.Next(&buf)) {
+    for (size_t i = 0; i < buf.size; ++i) {
+      const MEMREF &mr = buf.data[i];
+      if (mr.type == TRACE_READ || mr.type == TRACE_WRITE) {
+        int64_t stride = 0;
+        int p = table.Access(mr.addr, keyed, keyed ? buf.pc[i] : 0, &stride);
+        PatternStats &s = func_stats[cur];
+        ++s.counts[p];
+        if (p <= PATTERN_STRIDED) s.AddStride(stride, 1);
+      } else if (mr.type == TRACE_FUNC_CALL) {
+        pair<map<intptr_t, size_t>::iterator, bool> ret =
+            func_index.insert(make_pair(mr.addr, func_addrs.size()));
+        if (ret.second) {
+          func_addrs.push_back(mr.addr);
+          func_ids.push_back(mr.size);
+          func_stats.resize(func_stats.size() + 1);
+          func_stats.back().Clear();
+        }
+        call_stack.push_back(ret.first->second);
+        cur = ret.first->second;
+      } else if (mr.type == TRACE_FUNC_RET) {
+        if (!call_stack.empty()) call_stack.pop_back();
+        cur = call_stack.empty() ? 0 : call_stack.back();
+      }
+    }
+    count += buf.size;
+  }
+  if (reader.Error()) return false;
+
+  PatternStats total;
+  total.Clear();
+  for (size_t f = 0; f < func_stats.size(); ++f) total.Merge(func_stats[f]);
+
+  cout << "Number of processed trace entries: " << count << endl;
+  printf("Stream table: %zu entries, keyed by %s, window %lld bytes, "
+         "%zu-byte lines\n", entries, keyed ? "instruction" : "address",
+         (long long)window, line_size);
+  cout << "Total:" << endl;
+  PrintStats(total, "  ");
+  for (size_t f = 0; f < func_addrs.size(); ++f) {
+    if (f == 0) {
+      cout << "Outside traced functions:" << endl;
+    } else {
+      printf("Function %p (id %u):\n", (void *)func_addrs[f], func_ids[f]);
+    }
+    PrintStats(func_stats[f], "  ");
+  }
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog
+       << " [-a] [-e ENTRIES] [-l LINE_SIZE] [-w WINDOW] trace" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t entries = 16;
+  size_t line_size = 64;
+  int64_t window = 4096;
+  bool by_addr = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "ae:l:w:h")) != -1) {
+    switch (opt) {
+      case 'a':
+        by_addr = true;
+        break;
+      case 'e':
+        entries = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        line_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'w':
+        window = strtoll(optarg, NULL, 10);
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || entries == 0 || window < 0 || line_size == 0 ||
+      (line_size & (line_size - 1))) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!classify(argv[optind], entries, line_size, window, by_addr)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
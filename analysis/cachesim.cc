@@ -0,0 +1,517 @@
+/*
+ * Replays a MEMREF trace through a multi-level cache hierarchy and
+ * reports hit and miss rates per level and per traced function.
+ *
+ *   cachesim [-1 CONFIG] [-2 CONFIG] [-3 CONFIG] trace
+ *
+ * CONFIG is SIZE:ASSOC:LINE[:wb|:wt], e.g. 32k:8:64:wb, or "none" to
+ * drop a level and the levels below it; L1 cannot be dropped, and no
+ * level may be given below a dropped one. Sizes take k, m and g
+ * suffixes.
+ *
+ * Each level is set associative with LRU replacement. Write-back levels
+ * allocate on write misses and write dirty victims to the next level;
+ * write-through levels forward every write to the next level and do not
+ * allocate on write misses. Accesses that straddle L1 lines access each
+ * line. Accesses are attributed to the innermost function between
+ * TRACE_FUNC_CALL and TRACE_FUNC_RET markers.
+ *
+ * Blocks of the trace are decoded in parallel with OpenMP; the replay
+ * itself is sequential.
+ */
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../common.h"
+#include "mapped_trace.h"
+
+using namespace std;
+
+#define MAX_LEVELS (3)
+#define INVALID_TAG (~(uint64_t)0)
+
+struct CacheConfig {
+  size_t size;
+  size_t assoc;
+  size_t line;
+  bool write_back;
+};
+
+struct LevelStats {
+  uint64_t hits[2];
+  uint64_t misses[2];
+  uint64_t writebacks;
+};
+
+/* Bytes of a word, for comparing eight bytes at once */
+#define BYTE_ONES (0x0101010101010101ULL)
+#define BYTE_HIGHS (0x8080808080808080ULL)
+#define NO_WAY (~(size_t)0)
+
+/*
+ * A set-associative cache, stored set by set in one array. A set holds a
+ * one-byte key per way, hashed from its line and packed eight to a word,
+ * then an LRU stamp per way, then a tag per way, padded with invalid
+ * tags to a whole word of keys. A tag is the line shifted left by one
+ * with its dirty bit. A lookup compares the keys of eight ways at once
+ * and checks the tags of the ways whose key matches, which is usually
+ * one way on a hit and none on a miss, so it costs the same wherever the
+ * line is in the set. A hit then only stamps its way, and does not wait
+ * for the previous access to the set to reorder it.
+ */
+class Cache {
+ public:
+  /*
+   * How the sets of a cache are laid out, with its clock. A replay loop
+   * copies them to a local, which stays in registers, as stores to the
+   * sets cannot alias it.
+   */
+  struct Sets {
+    size_t words;  // per set: keys, stamps and padded tags
+    size_t key_words;  // words of keys per set
+    size_t tag_offset;  // words before the tags of a set
+    uint64_t dirty;  // dirty bit of a write: 1 if write-back
+    uint64_t clock;  // the last stamp
+  };
+
+  Cache(const CacheConfig &config): _config(config) {
+    _line_shift = __builtin_ctzl(config.line);
+    _num_sets = config.size / (config.line * config.assoc);
+    _set_mask = (_num_sets & (_num_sets - 1)) ? 0 : _num_sets - 1;
+    _sets.key_words = (config.assoc + 7) / 8;
+    _sets.tag_offset = _sets.key_words + config.assoc;
+    _sets.words = _sets.tag_offset + _sets.key_words * 8;
+    _sets.dirty = config.write_back ? 1 : 0;
+    _sets.clock = 0;
+    _data.assign(_num_sets * _sets.words, 0);
+    for (size_t set = 0; set < _num_sets; ++set) {
+      uint64_t *tags = &_data[set * _sets.words + _sets.tag_offset];
+      for (size_t w = 0; w < _sets.key_words * 8; ++w) tags[w] = INVALID_TAG;
+    }
+  }
+
+  const CacheConfig &Config() const { return _config; }
+  int LineShift() const { return _line_shift; }
+  size_t SetMask() const { return _set_mask; }
+  Sets &GetSets() { return _sets; }
+  uint64_t *Data() { return &_data[0]; }
+
+  /* Looks up line and makes it MRU on a hit; a miss changes nothing */
+  bool Hit(uint64_t line, bool write) {
+    return HitInSet(_sets, Data(), SetIndex(line), line, write & _sets.dirty);
+  }
+
+  /*
+   * Hit() in the cache with sets s at data, for a line known to map to
+   * set index; dirty is 1 for a write to a write-back cache
+   */
+  static bool HitInSet(Sets &s, uint64_t *data, size_t index, uint64_t line,
+                       uint64_t dirty) {
+    uint64_t *set = data + index * s.words;
+    uint64_t *tags = set + s.tag_offset;
+    uint64_t pattern = KeyOf(line) * BYTE_ONES;
+    // Sets of up to eight ways, the common case, have one word of keys
+    size_t way = FindInWord(set[0], pattern, tags, (line << 1) | 1);
+    if (way == NO_WAY && s.key_words > 1) way = FindInWords(s, set, line);
+    if (way == NO_WAY) return false;
+    set[s.key_words + way] = ++s.clock;
+    tags[way] |= dirty;
+    return true;
+  }
+
+  /*
+   * Puts line, which missed, in place of the LRU line of its set, and
+   * makes it MRU. Returns the tag of the evicted line, or INVALID_TAG if
+   * the way was empty.
+   */
+  uint64_t Fill(uint64_t line, bool write) {
+    uint64_t *set = &_data[SetIndex(line) * _sets.words];
+    uint64_t *stamps = set + _sets.key_words;
+    uint64_t *tags = set + _sets.tag_offset;
+    // Empty ways have stamp 0 and are filled first. Two interleaved
+    // searches halve the chain of selects; the LRU way is too random to
+    // branch on.
+    size_t lru[2] = {0, 0};
+    uint64_t oldest[2] = {stamps[0], stamps[0]};
+    size_t w = 1;
+    for (; w + 1 < _config.assoc; w += 2) {
+      bool older0 = stamps[w] < oldest[0];
+      bool older1 = stamps[w + 1] < oldest[1];
+      oldest[0] = older0 ? stamps[w] : oldest[0];
+      lru[0] = older0 ? w : lru[0];
+      oldest[1] = older1 ? stamps[w + 1] : oldest[1];
+      lru[1] = older1 ? w + 1 : lru[1];
+    }
+    if (w < _config.assoc && stamps[w] < oldest[0]) {
+      oldest[0] = stamps[w];
+      lru[0] = w;
+    }
+    size_t way = oldest[1] < oldest[0] ? lru[1] : lru[0];
+    uint64_t victim = tags[way];
+    tags[way] = (line << 1) | (write & _sets.dirty);
+    stamps[way] = ++_sets.clock;
+    uint64_t &keys = set[way / 8];
+    int shift = 8 * (way % 8);
+    keys = (keys & ~(0xffULL << shift)) | (KeyOf(line) << shift);
+    return victim;
+  }
+
+ private:
+  size_t SetIndex(uint64_t line) const {
+    return _set_mask ? (line & _set_mask) : (line % _num_sets);
+  }
+
+  /*
+   * The way among eight, with keys and tags, that holds a line, or
+   * NO_WAY. pattern is the key of the line in every byte, and odd_tag
+   * its tag with the dirty bit set.
+   */
+  static size_t FindInWord(uint64_t keys, uint64_t pattern,
+                           const uint64_t *tags, uint64_t odd_tag) {
+    uint64_t x = keys ^ pattern;
+    // The high bit of every zero byte of x, and of a few bytes above
+    // one; the tags rule those out, as do the padding tags
+    uint64_t match = (x - BYTE_ONES) & ~x & BYTE_HIGHS;
+    for (; match; match &= match - 1) {
+      size_t w = (size_t)__builtin_ctzll(match) / 8;
+      if ((tags[w] | 1) == odd_tag) return w;
+    }
+    return NO_WAY;
+  }
+
+  /* The way of line among those past the first eight, or NO_WAY */
+  __attribute__((noinline)) static size_t FindInWords(const Sets &s,
+                                                      const uint64_t *set,
+                                                      uint64_t line) {
+    const uint64_t *tags = set + s.tag_offset;
+    uint64_t pattern = KeyOf(line) * BYTE_ONES;
+    for (size_t k = 1; k < s.key_words; ++k) {
+      size_t way = FindInWord(set[k], pattern, tags + k * 8, (line << 1) | 1);
+      if (way != NO_WAY) return k * 8 + way;
+    }
+    return NO_WAY;
+  }
+
+  /* Key of a line: a byte of a multiplicative hash of all its bits */
+  static uint64_t KeyOf(uint64_t line) {
+    return (line * 0x9e3779b97f4a7c15ULL) >> 56;
+  }
+
+  CacheConfig _config;
+  int _line_shift;
+  size_t _num_sets;
+  size_t _set_mask;  // 0 unless the number of sets is a power of two
+  Sets _sets;
+  vector<uint64_t> _data;
+};
+
+class Hierarchy {
+ public:
+  explicit Hierarchy(const vector<CacheConfig> &configs) {
+    for (size_t i = 0; i < configs.size(); ++i) {
+      _levels.push_back(Cache(configs[i]));
+    }
+    _l1_shift = _levels[0].LineShift();
+    _l1_offset_mask = configs[0].line - 1;
+    _l1_set_mask = _levels[0].SetMask();
+    // Writes to a write-through L1 go on to the next level, hit or not,
+    // and the set of a line in an L1 with other than a power of two sets
+    // takes a division
+    _l1_fast_end[0] = _l1_set_mask ? configs[0].line + 1 : 0;
+    _l1_fast_end[1] = configs[0].write_back ? _l1_fast_end[0] : 0;
+  }
+
+  size_t NumLevels() const { return _levels.size(); }
+  const CacheConfig &Config(size_t level) const { return _levels[level].Config(); }
+
+  /*
+   * Replays the accesses at the start of refs[0, n), up to the first
+   * record of another type, and counts them in stats. Returns the number
+   * of accesses replayed.
+   */
+  size_t Replay(const MEMREF *refs, size_t n, LevelStats *stats) {
+    // The common case, an access within one L1 line that hits in L1 and
+    // stops there, runs on locals; everything else goes out of line
+    Cache &l1 = _levels[0];
+    Cache::Sets sets = l1.GetSets();
+    uint64_t *data = l1.Data();
+    int shift = _l1_shift;
+    uint64_t offset_mask = _l1_offset_mask;
+    uint64_t set_mask = _l1_set_mask;
+    uint64_t fast_end[2] = {_l1_fast_end[0], _l1_fast_end[1]};
+    // Hits are the accesses that did not go out of line
+    size_t out_of_line = 0;
+    uint64_t write_hits = 0;
+    const MEMREF *mr = refs;
+    for (; mr < refs + n && mr->type <= TRACE_WRITE; ++mr) {
+      uint64_t first = (uint64_t)mr->addr;
+      uint32_t size = mr->size;
+      uint64_t write = mr->type;  // TRACE_READ is 0, TRACE_WRITE 1
+      uint64_t line = first >> shift;
+      // Writes here are to a write-back L1, so they make the line dirty
+      if ((first & offset_mask) + size < fast_end[write] &&
+          Cache::HitInSet(sets, data, line & set_mask, line, write)) {
+        write_hits += write;
+        continue;
+      }
+      ++out_of_line;
+      l1.GetSets().clock = sets.clock;
+      AccessSlow(first, size, write, stats);
+      sets.clock = l1.GetSets().clock;
+    }
+    l1.GetSets().clock = sets.clock;
+    size_t i = mr - refs;
+    stats[0].hits[0] += i - out_of_line - write_hits;
+    stats[0].hits[1] += write_hits;
+    return i;
+  }
+
+ private:
+  /* The rest of Replay(): an L1 miss, or an access it does not handle */
+  __attribute__((noinline)) void AccessSlow(uint64_t first, uint32_t size,
+                                            bool write, LevelStats *stats) {
+    if ((first & _l1_offset_mask) + size < _l1_fast_end[write]) {
+      MissLevel(0, first >> _l1_shift << _l1_shift, write, stats);
+      return;
+    }
+    uint64_t last = first + (size ? size - 1 : 0);
+    for (uint64_t line = first >> _l1_shift; line <= last >> _l1_shift; ++line) {
+      AccessLevel(0, line << _l1_shift, write, stats);
+    }
+  }
+
+  void AccessLevel(size_t level, uint64_t addr, bool write, LevelStats *stats) {
+    Cache &cache = _levels[level];
+    if (!cache.Hit(addr >> cache.LineShift(), write)) {
+      MissLevel(level, addr, write, stats);
+      return;
+    }
+    ++stats[level].hits[write];
+    if (write && !cache.Config().write_back && level + 1 < _levels.size()) {
+      AccessLevel(level + 1, addr, true, stats);
+    }
+  }
+
+  /* A miss at level, which has not allocated the line yet */
+  void MissLevel(size_t level, uint64_t addr, bool write, LevelStats *stats) {
+    Cache &cache = _levels[level];
+    bool wb = cache.Config().write_back;
+    ++stats[level].misses[write];
+    // Write-through levels do not allocate on write misses
+    uint64_t victim = INVALID_TAG;
+    if (!write || wb) victim = cache.Fill(addr >> cache.LineShift(), write);
+    if (victim != INVALID_TAG && (victim & 1)) {
+      ++stats[level].writebacks;
+      if (level + 1 < _levels.size()) {
+        AccessLevel(level + 1, (victim >> 1) << cache.LineShift(), true, stats);
+      }
+    }
+    if (level + 1 >= _levels.size()) return;
+    // Fill the line from the next level; a write-through write goes on
+    AccessLevel(level + 1, addr, write && wb ? false : write, stats);
+  }
+
+  vector<Cache> _levels;
+  // Replay() handles accesses whose offset in an L1 line plus size is
+  // below the fast end for reads, [0], or writes, [1]
+  int _l1_shift;
+  uint64_t _l1_offset_mask;
+  uint64_t _l1_set_mask;
+  uint64_t _l1_fast_end[2];
+};
+
+static size_t ParseSize(const string &s) {
+  char *end;
+  size_t v = strtoull(s.c_str(), &end, 10);
+  switch (*end) {
+    case 'k': case 'K': return v << 10;
+    case 'm': case 'M': return v << 20;
+    case 'g': case 'G': return v << 30;
+  }
+  return v;
+}
+
+/* Returns false for "none" or an invalid config */
+static bool ParseConfig(const char *arg, CacheConfig *config) {
+  if (strcmp(arg, "none") == 0) return false;
+  vector<string> fields;
+  string s(arg);
+  size_t pos;
+  while ((pos = s.find(':')) != string::npos) {
+    fields.push_back(s.substr(0, pos));
+    s = s.substr(pos + 1);
+  }
+  fields.push_back(s);
+  if (fields.size() < 3 || fields.size() > 4) {
+    cerr << "ERROR! Invalid cache config: " << arg << endl;
+    exit(EXIT_FAILURE);
+  }
+  config->size = ParseSize(fields[0]);
+  config->assoc = strtoul(fields[1].c_str(), NULL, 10);
+  config->line = strtoul(fields[2].c_str(), NULL, 10);
+  config->write_back = fields.size() < 4 || fields[3] != "wt";
+  if ((fields.size() == 4 && fields[3] != "wb" && fields[3] != "wt") ||
+      config->assoc == 0 || config->line == 0 ||
+      (config->line & (config->line - 1)) ||
+      config->size % (config->line * config->assoc)) {
+    cerr << "ERROR! Invalid cache config: " << arg << endl;
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+static void PrintStats(const Hierarchy &h, const LevelStats *stats,
+                       const char *indent) {
+  for (size_t l = 0; l < h.NumLevels(); ++l) {
+    const LevelStats &s = stats[l];
+    uint64_t hits = s.hits[0] + s.hits[1];
+    uint64_t misses = s.misses[0] + s.misses[1];
+    uint64_t accesses = hits + misses;
+    printf("%sL%zu: accesses %llu hits %llu misses %llu (read %llu write %llu)"
+           " miss rate %.4f writebacks %llu\n",
+           indent, l + 1, (unsigned long long)accesses,
+           (unsigned long long)hits, (unsigned long long)misses,
+           (unsigned long long)s.misses[0], (unsigned long long)s.misses[1],
+           accesses ? (double)misses / accesses : 0.0,
+           (unsigned long long)s.writebacks);
+  }
+}
+
+bool simulate(const char *path, const vector<CacheConfig> &configs) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  Hierarchy hierarchy(configs);
+  size_t num_levels = hierarchy.NumLevels();
+
+  // Per-function statistics; index 0 is code outside any traced call
+  vector<LevelStats> func_stats(MAX_LEVELS);
+  map<intptr_t, size_t> func_index;
+  vector<intptr_t> func_addrs(1, 0);
+  vector<uint32_t> func_ids(1, 0);  // id in the tracer's .functions table
+  vector<size_t> call_stack;
+  LevelStats *cur = &func_stats[0];
+  LevelStats total[MAX_LEVELS];
+  memset(total, 0, sizeof(total));
+  memset(&func_stats[0], 0, func_stats.size() * sizeof(LevelStats));
+
+  OrderedChunkReader reader(trace);
+  MemrefSpan buf;
+  size_t count = 0;
+  while (reader.Next(&buf)) {
+    for (size_t i = 0; i < buf.size; ++i) {
+      i += hierarchy.Replay(&buf.data[i], buf.size - i, cur);
+      if (i == buf.size) break;
+      const MEMREF &mr = buf.data[i];
+      if (!IsMarkerType(mr.type)) continue;
+      if (mr.type == TRACE_FUNC_CALL) {
+        pair<map<intptr_t, size_t>::iterator, bool> ret =
+            func_index.insert(make_pair(mr.addr, func_addrs.size()));
+        if (ret.second) {
+          func_addrs.push_back(mr.addr);
+          func_ids.push_back(mr.size);
+          func_stats.resize(func_stats.size() + MAX_LEVELS);
+          memset(&func_stats[func_stats.size() - MAX_LEVELS], 0,
+                 MAX_LEVELS * sizeof(LevelStats));
+        }
+        call_stack.push_back(ret.first->second);
+        cur = &func_stats[ret.first->second * MAX_LEVELS];
+      } else if (mr.type == TRACE_FUNC_RET) {
+        if (!call_stack.empty()) call_stack.pop_back();
+        cur = &func_stats[(call_stack.empty() ? 0 : call_stack.back()) *
+                          MAX_LEVELS];
+      }
+    }
+    count += buf.size;
+  }
+  if (reader.Error()) return false;
+
+  for (size_t f = 0; f < func_addrs.size(); ++f) {
+    for (size_t l = 0; l < num_levels; ++l) {
+      const LevelStats &s = func_stats[f * MAX_LEVELS + l];
+      for (int w = 0; w < 2; ++w) {
+        total[l].hits[w] += s.hits[w];
+        total[l].misses[w] += s.misses[w];
+      }
+      total[l].writebacks += s.writebacks;
+    }
+  }
+
+  cout << "Number of processed trace entries: " << count << endl;
+  if (trace.Header().sampling.sample_mode != TRACE_SAMPLE_NONE) {
+    // Rates carry over to the full run; counts scale by the inverse
+    cout << "Sampled fraction of references: "
+         << trace.Header().sampling.sample_fraction << endl;
+  }
+  for (size_t l = 0; l < num_levels; ++l) {
+    const CacheConfig &c = hierarchy.Config(l);
+    printf("L%zu config: %zu bytes, %zu-way, %zu-byte lines, %s\n", l + 1,
+           c.size, c.assoc, c.line, c.write_back ? "write-back" : "write-through");
+  }
+  cout << "Total:" << endl;
+  PrintStats(hierarchy, total, "  ");
+  for (size_t f = 0; f < func_addrs.size(); ++f) {
+    if (f == 0) {
+      cout << "Outside traced functions:" << endl;
+    } else {
+      printf("Function %p (id %u):\n", (void *)func_addrs[f], func_ids[f]);
+    }
+    PrintStats(hierarchy, &func_stats[f * MAX_LEVELS], "  ");
+  }
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog
+       << " [-1 CONFIG] [-2 CONFIG] [-3 CONFIG] trace" << endl
+       << "  CONFIG: SIZE:ASSOC:LINE[:wb|:wt] or none" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  const char *args[MAX_LEVELS] = {"32k:8:64:wb", "1m:16:64:wb", "8m:16:64:wb"};
+  bool given[MAX_LEVELS] = {false, false, false};
+  int opt;
+  while ((opt = getopt(argc, argv, "1:2:3:h")) != -1) {
+    switch (opt) {
+      case '1': case '2': case '3':
+        args[opt - '1'] = optarg;
+        given[opt - '1'] = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  vector<CacheConfig> configs;
+  for (int l = 0; l < MAX_LEVELS; ++l) {
+    CacheConfig c;
+    if (!ParseConfig(args[l], &c)) {
+      if (l == 0) {
+        cerr << "ERROR! L1 cannot be none" << endl;
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    configs.push_back(c);
+  }
+  // Default levels below a dropped one are dropped with it
+  for (int l = configs.size() + 1; l < MAX_LEVELS; ++l) {
+    if (given[l] && strcmp(args[l], "none") != 0) {
+      cerr << "ERROR! L" << l + 1 << " is configured below L"
+           << configs.size() + 1 << ", which is none" << endl;
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!simulate(argv[optind], configs)) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,336 @@
+/*
+ * Attributes the memory accesses of a trace recorded with -heap to the
+ * heap blocks they fall in, and reports the traffic per allocation site.
+ *
+ *   heap_sites [-l LINE_SIZE] [-n TOP] [-a ALLOCS] trace
+ *
+ * The trace is replayed in order. Live blocks are kept in a sorted
+ * range index from block address to block; an access belongs to the
+ * block with the largest address at or below it, if the access is
+ * before the end of that block. A block whose range is allocated again
+ * before it is freed, because its free was not seen, is dropped.
+ *
+ * For each of the TOP (20 by default) sites with the most accessed
+ * bytes, the report has the blocks allocated, bytes allocated, peak live
+ * bytes, accesses and bytes accessed, the number of distinct cache
+ * lines of its blocks that were accessed (estimated with a HyperLogLog
+ * sketch), and the reuse: accesses per accessed line. Sites are
+ * described from the .allocs table of the tracer, ALLOCS or by default
+ * the trace name without its .PID.TID suffix followed by .allocs.
+ *
+ * In a multi-threaded program, blocks may be allocated by one thread
+ * and accessed by another; merge the traces of the threads first. The
+ * two records of an allocation are paired within the records of their
+ * thread.
+ */
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../common.h"
+#include "mapped_trace.h"
+#include "hyperloglog.h"
+
+using namespace std;
+
+/* Precision of the distinct line sketch of every site */
+#define SITE_HLL_PRECISION (10)
+
+struct Block {
+  intptr_t end;
+  uint32_t site;
+};
+
+struct SiteStats {
+  SiteStats()
+      : blocks(0), bytes_allocated(0), live_bytes(0), peak_bytes(0),
+        reads(0), writes(0), bytes_read(0), bytes_written(0),
+        lines(SITE_HLL_PRECISION) {}
+
+  uint64_t blocks;
+  uint64_t bytes_allocated;
+  uint64_t live_bytes;
+  uint64_t peak_bytes;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+  HyperLogLog lines;
+};
+
+/*
+ * Live blocks by address. The last block found is remembered, since
+ * consecutive accesses tend to fall in the same block.
+ */
+class BlockIndex {
+ public:
+  BlockIndex(): _last(_blocks.end()) {}
+
+  /* The block holding addr, or NULL */
+  const Block *Find(intptr_t addr) {
+    if (_last != _blocks.end() && addr >= _last->first &&
+        addr < _last->second.end) {
+      return &_last->second;
+    }
+    map<intptr_t, Block>::iterator it = _blocks.upper_bound(addr);
+    if (it == _blocks.begin()) return NULL;
+    --it;
+    if (addr >= it->second.end) return NULL;
+    _last = it;
+    return &it->second;
+  }
+
+  /* Adds [start, end), dropping the blocks it overlaps into *dropped */
+  void Insert(intptr_t start, intptr_t end, uint32_t site,
+              vector<pair<intptr_t, Block> > *dropped) {
+    // A block at start is replaced even when either one is empty, which
+    // the overlap test below does not catch
+    map<intptr_t, Block>::iterator it = _blocks.find(start);
+    if (it != _blocks.end()) {
+      dropped->push_back(*it);
+      Erase(it);
+    }
+    it = _blocks.upper_bound(start);
+    if (it != _blocks.begin()) {
+      map<intptr_t, Block>::iterator prev = it;
+      --prev;
+      if (prev->second.end > start) it = prev;
+    }
+    while (it != _blocks.end() && it->first < end) {
+      dropped->push_back(*it);
+      Erase(it++);
+    }
+    Block b = { end, site };
+    _blocks.insert(make_pair(start, b));
+  }
+
+  /* Removes the block at start; returns false if there is none */
+  bool Remove(intptr_t start, Block *block) {
+    map<intptr_t, Block>::iterator it = _blocks.find(start);
+    if (it == _blocks.end()) return false;
+    *block = it->second;
+    Erase(it);
+    return true;
+  }
+
+  size_t Size() const { return _blocks.size(); }
+
+ private:
+  void Erase(map<intptr_t, Block>::iterator it) {
+    if (it == _last) _last = _blocks.end();
+    _blocks.erase(it);
+  }
+
+  map<intptr_t, Block> _blocks;
+  map<intptr_t, Block>::iterator _last;
+};
+
+/* Orders site ids by decreasing bytes accessed */
+struct ByBytes {
+  explicit ByBytes(const vector<SiteStats> &sites): _sites(sites) {}
+  bool operator()(uint32_t a, uint32_t b) const {
+    uint64_t x = _sites[a].bytes_read + _sites[a].bytes_written;
+    uint64_t y = _sites[b].bytes_read + _sites[b].bytes_written;
+    if (x != y) return x > y;
+    return a < b;
+  }
+  const vector<SiteStats> &_sites;
+};
+
+/* Descriptions of the call sites from the .allocs table, by id */
+static void ReadSites(const string &path, vector<string> *desc) {
+  ifstream in(path.c_str());
+  if (!in) {
+    cerr << "WARNING! Cannot open " << path << "; sites are shown by id"
+         << endl;
+    return;
+  }
+  string line;
+  while (getline(in, line)) {
+    size_t sp = line.find(' ');
+    if (sp == string::npos) continue;
+    size_t id = strtoul(line.c_str(), NULL, 10);
+    if (id >= desc->size()) desc->resize(id + 1);
+    (*desc)[id] = line.substr(sp + 1);
+  }
+}
+
+/* pin.out.PID.TID -> pin.out.allocs */
+static string DefaultSitesPath(const string &trace_path) {
+  string p = trace_path;
+  for (int k = 0; k < 2; ++k) {
+    size_t dot = p.rfind('.');
+    if (dot == string::npos || dot + 1 == p.size() ||
+        p.find_first_not_of("0123456789", dot + 1) != string::npos) {
+      break;
+    }
+    p.erase(dot);
+  }
+  return p + ".allocs";
+}
+
+static SiteStats &Site(vector<SiteStats> &sites, uint32_t id) {
+  if (id >= sites.size()) sites.resize(id + 1);
+  return sites[id];
+}
+
+static void Release(vector<SiteStats> &sites, intptr_t start,
+                    const Block &b) {
+  sites[b.site].live_bytes -= b.end - start;
+}
+
+bool heap_sites(const char *path, int line_shift, size_t top,
+                const string &sites_path) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  BlockIndex blocks;
+  vector<SiteStats> sites;
+  vector<pair<intptr_t, Block> > dropped;
+  uint64_t heap_accesses = 0;
+  uint64_t other_accesses = 0;
+  uint64_t unknown_frees = 0;
+  uint64_t count = 0;
+  // The first record of the allocation pair of each thread, until its
+  // size comes
+  map<uint32_t, intptr_t> pending;
+
+  OrderedChunkReader reader(trace);
+  MemrefSpan buf;
+  while (reader.Next(&buf)) {
+    for (size_t i = 0; i < buf.size; ++i) {
+      const MEMREF &mr = buf.data[i];
+      if (mr.type == TRACE_READ || mr.type == TRACE_WRITE) {
+        const Block *b = blocks.Find(mr.addr);
+        if (!b) {
+          ++other_accesses;
+          continue;
+        }
+        ++heap_accesses;
+        SiteStats &s = sites[b->site];
+        if (mr.type == TRACE_READ) {
+          ++s.reads;
+          s.bytes_read += mr.size;
+        } else {
+          ++s.writes;
+          s.bytes_written += mr.size;
+        }
+        s.lines.Add((uint64_t)mr.addr >> line_shift);
+      } else if (mr.type == TRACE_ALLOC) {
+        uint32_t tid = buf.tid ? buf.tid[i] : 0;
+        map<uint32_t, intptr_t>::iterator p = pending.find(tid);
+        if (p == pending.end()) {
+          pending[tid] = mr.addr;
+          continue;
+        }
+        intptr_t pending_start = p->second;
+        pending.erase(p);
+        SiteStats &s = Site(sites, mr.size);
+        uint64_t size = (uint64_t)mr.addr;
+        ++s.blocks;
+        s.bytes_allocated += size;
+        s.live_bytes += size;
+        s.peak_bytes = max(s.peak_bytes, s.live_bytes);
+        dropped.clear();
+        blocks.Insert(pending_start, pending_start + (intptr_t)size, mr.size,
+                      &dropped);
+        for (size_t k = 0; k < dropped.size(); ++k) {
+          Release(sites, dropped[k].first, dropped[k].second);
+        }
+      } else if (mr.type == TRACE_FREE) {
+        Block b;
+        if (blocks.Remove(mr.addr, &b)) {
+          Release(sites, mr.addr, b);
+        } else {
+          ++unknown_frees;
+        }
+      }
+    }
+    count += buf.size;
+  }
+  if (reader.Error()) return false;
+  if (sites.empty()) {
+    cerr << "WARNING! " << path << " has no allocations; trace with -heap"
+         << endl;
+  }
+
+  vector<string> desc;
+  ReadSites(sites_path, &desc);
+  vector<uint32_t> order;
+  for (size_t id = 0; id < sites.size(); ++id) {
+    if (sites[id].blocks) order.push_back((uint32_t)id);
+  }
+  sort(order.begin(), order.end(), ByBytes(sites));
+
+  uint64_t accesses = heap_accesses + other_accesses;
+  cout << "Number of processed trace entries: " << count << endl;
+  printf("Accesses to heap blocks: %llu of %llu (%.4f)\n",
+         (unsigned long long)heap_accesses, (unsigned long long)accesses,
+         accesses ? (double)heap_accesses / accesses : 0.0);
+  cout << "Allocation sites: " << order.size() << endl;
+  cout << "Blocks live at the end: " << blocks.Size() << endl;
+  if (unknown_frees) {
+    cout << "Frees of blocks not allocated in the trace: " << unknown_frees
+         << endl;
+  }
+  printf("%6s %10s %14s %12s %12s %14s %7s %10s %8s  %s\n", "site", "blocks",
+         "allocated", "peak live", "accesses", "bytes", "write%", "lines",
+         "reuse", "call site");
+  for (size_t k = 0; k < order.size() && k < top; ++k) {
+    uint32_t id = order[k];
+    const SiteStats &s = sites[id];
+    uint64_t n = s.reads + s.writes;
+    uint64_t lines = n ? s.lines.Estimate() : 0;
+    printf("%6u %10llu %14llu %12llu %12llu %14llu %7.2f %10llu %8.2f  %s\n",
+           id, (unsigned long long)s.blocks,
+           (unsigned long long)s.bytes_allocated,
+           (unsigned long long)s.peak_bytes, (unsigned long long)n,
+           (unsigned long long)(s.bytes_read + s.bytes_written),
+           n ? 100.0 * s.writes / n : 0.0, (unsigned long long)lines,
+           lines ? (double)n / lines : 0.0,
+           id < desc.size() ? desc[id].c_str() : "");
+  }
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-l LINE_SIZE] [-n TOP] [-a ALLOCS] trace"
+       << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t line_size = 64;
+  size_t top = 20;
+  const char *sites_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:a:h")) != -1) {
+    switch (opt) {
+      case 'l':
+        line_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        top = strtoul(optarg, NULL, 10);
+        break;
+      case 'a':
+        sites_path = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || line_size == 0 || (line_size & (line_size - 1))) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  string sites = sites_path ? sites_path : DefaultSitesPath(argv[optind]);
+  if (!heap_sites(argv[optind], __builtin_ctzl(line_size), top, sites)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
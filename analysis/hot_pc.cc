@@ -0,0 +1,304 @@
+/*
+ * Ranks the instructions of a trace recorded with -pc by the bytes they
+ * access, so that the loads and stores behind the memory traffic can be
+ * found in the code.
+ *
+ *   hot_pc [-l LINE_SIZE] [-n TOP] [-p PCS] trace
+ *
+ * For every instruction it reports the bytes and accesses, the number
+ * of distinct cache lines touched, and how regular its addresses are:
+ * the fraction of accesses at the same stride as the access before, and
+ * the most common stride. Instructions are described from the .pcs
+ * table of the tracer, PCS or by default the trace name without its
+ * .PID.TID suffix followed by .pcs.
+ *
+ * Chunks are processed in parallel. Each thread keeps the stats of the
+ * instructions in a table indexed by id; strides are followed within a
+ * chunk. Distinct lines are counted by aggregating (line, id) pairs in
+ * the hash-partitioned tables of UniqEngine.
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <omp.h>
+#include "../common.h"
+#include "mapped_trace.h"
+#include "uniq_engine.h"
+
+using namespace std;
+
+/* Bits of the instruction id in the (line, id) keys of distinct lines */
+#define PC_KEY_BITS (21)
+
+struct PcStat {
+  uint64_t accesses;
+  uint64_t bytes;
+  uint64_t uniq_lines;
+  uint64_t same_stride;
+  /* Most common stride, by majority vote */
+  int64_t stride;
+  uint64_t stride_votes;
+  /* State of the stride detection */
+  intptr_t last_addr;
+  int64_t last_stride;
+  size_t last_chunk;
+};
+
+static void Vote(PcStat &s, int64_t stride, uint64_t votes) {
+  if (s.stride_votes == 0 || s.stride == stride) {
+    s.stride = stride;
+    s.stride_votes += votes;
+  } else if (s.stride_votes >= votes) {
+    s.stride_votes -= votes;
+  } else {
+    s.stride = stride;
+    s.stride_votes = votes - s.stride_votes;
+  }
+}
+
+/*
+ * Accesses of one thread. The id of a record is at its position in the
+ * chunk, whatever the records before it.
+ */
+class PcVisitor {
+ public:
+  PcVisitor(vector<PcStat> &stats, UniqEngine *engine, int tid,
+            int line_shift)
+      : _stats(stats), _engine(engine), _tid(tid), _line_shift(line_shift),
+        _chunk(0) {}
+
+  void Visit(size_t chunk, const MemrefSpan &buf) {
+    _chunk = chunk + 1;
+    for (size_t i = 0; i < buf.size; ++i) {
+      const MEMREF &mr = buf.data[i];
+      if (mr.type == TRACE_READ || mr.type == TRACE_WRITE) {
+        Access(mr.addr, mr.size, buf.pc[i]);
+      }
+    }
+  }
+
+ private:
+  void Access(intptr_t addr, uint32_t size, uint32_t pc) {
+    if (pc >= _stats.size()) {
+      PcStat zero;
+      memset(&zero, 0, sizeof(zero));
+      _stats.resize(pc + 1, zero);
+    }
+    PcStat &s = _stats[pc];
+    ++s.accesses;
+    s.bytes += size;
+    if (s.last_chunk == _chunk) {
+      int64_t stride = (int64_t)addr - (int64_t)s.last_addr;
+      s.same_stride += stride == s.last_stride;
+      Vote(s, stride, 1);
+      s.last_stride = stride;
+    }
+    s.last_addr = addr;
+    s.last_chunk = _chunk;
+    if (pc < (1U << PC_KEY_BITS)) {
+      intptr_t line = addr >> _line_shift;
+      _engine->Add(_tid, (line << PC_KEY_BITS) | pc, size);
+    }
+  }
+
+  vector<PcStat> &_stats;
+  UniqEngine *_engine;
+  int _tid;
+  int _line_shift;
+  size_t _chunk;
+};
+
+/* Orders instruction ids by decreasing bytes */
+struct ByBytes {
+  explicit ByBytes(const vector<PcStat> &stats): _stats(stats) {}
+  bool operator()(uint32_t a, uint32_t b) const {
+    if (_stats[a].bytes != _stats[b].bytes) {
+      return _stats[a].bytes > _stats[b].bytes;
+    }
+    return a < b;
+  }
+  const vector<PcStat> &_stats;
+};
+
+/* Descriptions of the instructions from the .pcs table, by id */
+static void ReadPcs(const string &path, vector<string> *desc) {
+  ifstream in(path.c_str());
+  if (!in) {
+    cerr << "WARNING! Cannot open " << path << "; instructions are shown by id"
+         << endl;
+    return;
+  }
+  string line;
+  while (getline(in, line)) {
+    size_t sp = line.find(' ');
+    if (sp == string::npos) continue;
+    size_t id = strtoul(line.c_str(), NULL, 10);
+    if (id >= desc->size()) desc->resize(id + 1);
+    (*desc)[id] = line.substr(sp + 1);
+  }
+}
+
+/* pin.out.PID.TID -> pin.out.pcs */
+static string DefaultPcsPath(const string &trace_path) {
+  string p = trace_path;
+  for (int k = 0; k < 2; ++k) {
+    size_t dot = p.rfind('.');
+    if (dot == string::npos || dot + 1 == p.size() ||
+        p.find_first_not_of("0123456789", dot + 1) != string::npos) {
+      break;
+    }
+    p.erase(dot);
+  }
+  return p + ".pcs";
+}
+
+bool hot_pc(const char *path, size_t line_size, size_t top,
+            const string &pcs_path) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  if (trace.IsLegacy() || !(trace.Header().flags & TRACE_HAS_PC)) {
+    cerr << "ERROR! " << path << " has no instruction ids; trace with -pc"
+         << endl;
+    return false;
+  }
+  int line_shift = __builtin_ctzl(line_size);
+  size_t num_chunks = trace.NumChunks();
+  UniqEngine *engine = NULL;
+  vector<vector<PcStat> > stats;
+  bool ok = true;
+
+#pragma omp parallel reduction(&&:ok)
+  {
+    int num_threads = omp_get_num_threads();
+#pragma omp single
+    {
+      engine = new UniqEngine(num_threads);
+      stats.resize(num_threads);
+    }
+    int tid = omp_get_thread_num();
+    ChunkScratch scratch;
+    MemrefSpan buf;
+    PcVisitor visitor(stats[tid], engine, tid, line_shift);
+    size_t num_rounds = (num_chunks + num_threads - 1) / num_threads;
+    for (size_t round = 0; round < num_rounds; ++round) {
+      size_t i = round * num_threads + tid;
+      if (i < num_chunks && ok) {
+        if (trace.GetChunk(i, scratch, &buf)) {
+          visitor.Visit(i, buf);
+        } else {
+          ok = false;
+        }
+      }
+#pragma omp barrier
+      engine->Apply(tid);
+#pragma omp barrier
+    }
+  }
+  if (!ok) {
+    delete engine;
+    return false;
+  }
+
+  // Merge the threads
+  vector<PcStat> total;
+  for (size_t t = 0; t < stats.size(); ++t) {
+    if (stats[t].size() > total.size()) {
+      PcStat zero;
+      memset(&zero, 0, sizeof(zero));
+      total.resize(stats[t].size(), zero);
+    }
+    for (size_t pc = 0; pc < stats[t].size(); ++pc) {
+      const PcStat &s = stats[t][pc];
+      PcStat &m = total[pc];
+      m.accesses += s.accesses;
+      m.bytes += s.bytes;
+      m.same_stride += s.same_stride;
+      if (s.stride_votes) Vote(m, s.stride, s.stride_votes);
+    }
+  }
+  for (int shard = 0; shard < engine->NumShards(); ++shard) {
+    const AddrTable<READSTAT> &table = engine->Shard(shard);
+    for (size_t i = 0; i < table.Capacity(); ++i) {
+      if (!table.Used(i)) continue;
+      ++total[table.Key(i) & ((1 << PC_KEY_BITS) - 1)].uniq_lines;
+    }
+  }
+  delete engine;
+
+  vector<string> desc;
+  ReadPcs(pcs_path, &desc);
+
+  vector<uint32_t> order;
+  uint64_t total_bytes = 0;
+  uint64_t total_accesses = 0;
+  for (size_t pc = 0; pc < total.size(); ++pc) {
+    if (total[pc].accesses == 0) continue;
+    order.push_back((uint32_t)pc);
+    total_bytes += total[pc].bytes;
+    total_accesses += total[pc].accesses;
+  }
+  sort(order.begin(), order.end(), ByBytes(total));
+
+  cout << "Number of processed trace entries: " << trace.NumRecords() << endl;
+  cout << "Number of instructions: " << order.size() << endl;
+  cout << "Total accesses: " << total_accesses << endl;
+  cout << "Total bytes: " << total_bytes << endl;
+  printf("%8s %6s %14s %12s %10s %7s %10s  %s\n", "id", "bytes%", "bytes",
+         "accesses", "lines", "stride%", "stride", "instruction");
+  for (size_t k = 0; k < order.size() && k < top; ++k) {
+    uint32_t pc = order[k];
+    const PcStat &s = total[pc];
+    char stride[32] = "-";
+    if (s.stride_votes) {
+      snprintf(stride, sizeof(stride), "%lld", (long long)s.stride);
+    }
+    printf("%8u %6.2f %14llu %12llu %10llu %7.2f %10s  %s\n", pc,
+           total_bytes ? 100.0 * s.bytes / total_bytes : 0.0,
+           (unsigned long long)s.bytes, (unsigned long long)s.accesses,
+           (unsigned long long)s.uniq_lines,
+           s.accesses ? 100.0 * s.same_stride / s.accesses : 0.0, stride,
+           pc < desc.size() ? desc[pc].c_str() : "");
+  }
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-l LINE_SIZE] [-n TOP] [-p PCS] trace"
+       << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t line_size = 64;
+  size_t top = 20;
+  const char *pcs_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:p:h")) != -1) {
+    switch (opt) {
+      case 'l':
+        line_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        top = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        pcs_path = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || line_size == 0 || (line_size & (line_size - 1))) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  string pcs = pcs_path ? pcs_path : DefaultPcsPath(argv[optind]);
+  if (!hot_pc(argv[optind], line_size, top, pcs)) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
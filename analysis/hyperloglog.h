@@ -0,0 +1,75 @@
+#ifndef HYPERLOGLOG_H_
+#define HYPERLOGLOG_H_
+
+/*
+ * HyperLogLog sketch of the number of distinct keys (Flajolet et al.,
+ * 2007, with the linear counting correction for small counts).
+ *
+ * A sketch of precision p has 2^p one-byte registers. Keys are hashed;
+ * the top p bits of the hash pick a register, which keeps the largest
+ * number of leading zeros, plus one, seen in the other bits. The
+ * relative standard error of the estimate is about 1.04 / sqrt(2^p),
+ * 0.8% for the default p = 14. Sketches of the same precision merge by
+ * taking the maximum of each register, which gives the sketch of the
+ * union of their keys.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <vector>
+#include "../addr_table.h"
+
+#define HLL_MIN_PRECISION (4)
+#define HLL_MAX_PRECISION (18)
+#define HLL_DEFAULT_PRECISION (14)
+
+class HyperLogLog {
+ public:
+  explicit HyperLogLog(int precision = HLL_DEFAULT_PRECISION)
+      : _precision(precision), _registers((size_t)1 << precision, 0) {}
+
+  int Precision() const { return _precision; }
+
+  void Add(uint64_t key) {
+    uint64_t h = HashAddr(key);
+    size_t index = h >> (64 - _precision);
+    uint64_t rest = h << _precision;
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - _precision + 1;
+    if (rank > _registers[index]) _registers[index] = rank;
+  }
+
+  /* Adds the keys of other, which must have the same precision */
+  void Merge(const HyperLogLog &other) {
+    for (size_t i = 0; i < _registers.size(); ++i) {
+      if (other._registers[i] > _registers[i]) {
+        _registers[i] = other._registers[i];
+      }
+    }
+  }
+
+  uint64_t Estimate() const {
+    double m = (double)_registers.size();
+    double sum = 0;
+    size_t zeros = 0;
+    for (size_t i = 0; i < _registers.size(); ++i) {
+      sum += ldexp(1.0, -_registers[i]);
+      zeros += _registers[i] == 0;
+    }
+    double alpha = m >= 128 ? 0.7213 / (1 + 1.079 / m)
+                 : m >= 64  ? 0.709
+                 : m >= 32  ? 0.697
+                            : 0.673;
+    double e = alpha * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0) e = m * log(m / zeros);
+    return (uint64_t)(e + 0.5);
+  }
+
+  void Clear() { _registers.assign(_registers.size(), 0); }
+
+ private:
+  int _precision;
+  std::vector<uint8_t> _registers;
+};
+
+#endif /* HYPERLOGLOG_H_ */
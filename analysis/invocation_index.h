@@ -0,0 +1,188 @@
+#ifndef INVOCATION_INDEX_H_
+#define INVOCATION_INDEX_H_
+
+/*
+ * Index of the invocations of the traced functions in a trace, so that
+ * tools can go straight to the N-th invocation instead of replaying the
+ * trace up to it.
+ *
+ * An invocation is a TRACE_FUNC_CALL record and its matching
+ * TRACE_FUNC_RET of the same thread: in a trace with thread ids, such as
+ * a merged trace, each thread has its own call stack. Invocations are
+ * numbered in the order of their calls. Every entry has the position of
+ * both records, as the record number in the trace and the file offset of
+ * the chunk that holds the record, the thread, and the nesting depth of
+ * the call in its thread (0 for outermost calls).
+ *
+ * The index is built in one parallel pass: threads decode the chunks
+ * and collect their markers, which are then paired in order. It is
+ * saved next to the trace and reused as long as the size, the number of
+ * records and the modification time of the trace are unchanged.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <map>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../common.h"
+#include "mapped_trace.h"
+
+#define INDEX_MAGIC "MTRIDX\r\n"
+#define INDEX_VERSION (3)
+/* ret_record of an invocation whose return is not in the trace */
+#define INDEX_NO_RETURN (~(uint64_t)0)
+
+struct InvocationIndexHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t num_entries;
+  /* Size, number of records and modification time of the indexed trace */
+  uint64_t trace_size;
+  uint64_t trace_records;
+  uint64_t trace_mtime;
+};
+
+struct InvocationEntry {
+  uint64_t call_record;
+  uint64_t ret_record;
+  uint64_t call_offset;
+  uint64_t ret_offset;
+  uint64_t addr;
+  uint32_t func_id;
+  uint32_t depth;
+  uint32_t tid;  // 0 in a trace without thread ids
+  uint32_t unused;
+};
+
+/* A call or return record found while building the index */
+struct IndexMarker {
+  uint64_t record;
+  intptr_t addr;
+  uint32_t type;
+  uint32_t func_id;
+  uint32_t tid;
+};
+
+/*
+ * Builds the index of trace into entries. Fails on a return without a
+ * call and on a return that does not match its call; calls left without
+ * a return get INDEX_NO_RETURN.
+ */
+static inline bool BuildInvocationIndex(const MappedTrace &trace,
+                                        std::vector<InvocationEntry> *entries) {
+  size_t num_chunks = trace.NumChunks();
+  std::vector<std::vector<IndexMarker> > markers(num_chunks);
+  bool ok = true;
+#pragma omp parallel reduction(&&:ok)
+  {
+    ChunkScratch scratch;
+    MemrefSpan buf;
+#pragma omp for schedule(dynamic)
+    for (size_t c = 0; c < num_chunks; ++c) {
+      if (!trace.GetChunk(c, scratch, &buf)) {
+        ok = false;
+        continue;
+      }
+      uint64_t first = trace.ChunkFirstRecord(c);
+      for (size_t i = 0; i < buf.size; ++i) {
+        const MEMREF &mr = buf.data[i];
+        if (!IsMarkerType(mr.type)) continue;
+        IndexMarker m = { first + i, mr.addr, mr.type, mr.size,
+                          buf.tid ? buf.tid[i] : 0 };
+        markers[c].push_back(m);
+      }
+    }
+  }
+  if (!ok) return false;
+
+  entries->clear();
+  // Entries of the calls on the stack of each thread
+  std::map<uint32_t, std::vector<size_t> > stacks;
+  for (size_t c = 0; c < num_chunks; ++c) {
+    uint64_t offset = trace.ChunkOffset(c);
+    for (size_t k = 0; k < markers[c].size(); ++k) {
+      const IndexMarker &m = markers[c][k];
+      std::vector<size_t> &open = stacks[m.tid];
+      if (m.type == TRACE_FUNC_CALL) {
+        InvocationEntry e = { m.record, INDEX_NO_RETURN, offset, 0,
+                              (uint64_t)m.addr, m.func_id,
+                              (uint32_t)open.size(), m.tid, 0 };
+        open.push_back(entries->size());
+        entries->push_back(e);
+        continue;
+      }
+      if (open.empty()) {
+        std::cerr << "ERROR! No call for return (" << m.addr << ") at record "
+                  << m.record << std::endl;
+        return false;
+      }
+      InvocationEntry &e = (*entries)[open.back()];
+      if ((intptr_t)e.addr != m.addr) {
+        std::cerr << "ERROR! Call (" << (intptr_t)e.addr << ") and return ("
+                  << m.addr << ") do not match at record " << m.record
+                  << std::endl;
+        return false;
+      }
+      e.ret_record = m.record;
+      e.ret_offset = offset;
+      open.pop_back();
+    }
+    std::vector<IndexMarker>().swap(markers[c]);
+  }
+  return true;
+}
+
+/*
+ * Loads the index at path. Returns false if there is none, or it was
+ * built for another trace.
+ */
+static inline bool LoadInvocationIndex(const char *path,
+                                       const MappedTrace &trace,
+                                       std::vector<InvocationEntry> *entries) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) return false;
+  InvocationIndexHeader h;
+  bool ok = fread(&h, sizeof(h), 1, fp) == 1 &&
+      memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) == 0 &&
+      h.version == INDEX_VERSION && h.entry_size == sizeof(InvocationEntry) &&
+      h.trace_size == trace.FileSize() &&
+      h.trace_records == trace.NumRecords() &&
+      h.trace_mtime == trace.ModifyTime();
+  if (ok) {
+    entries->resize(h.num_entries);
+    ok = h.num_entries == 0 ||
+        fread(&(*entries)[0], sizeof(InvocationEntry), h.num_entries, fp) ==
+        h.num_entries;
+  }
+  fclose(fp);
+  return ok;
+}
+
+static inline bool SaveInvocationIndex(const char *path,
+                                       const MappedTrace &trace,
+                                       const std::vector<InvocationEntry> &entries) {
+  FILE *fp = fopen(path, "wb");
+  if (!fp) return false;
+  InvocationIndexHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+  h.version = INDEX_VERSION;
+  h.entry_size = sizeof(InvocationEntry);
+  h.num_entries = entries.size();
+  h.trace_size = trace.FileSize();
+  h.trace_records = trace.NumRecords();
+  h.trace_mtime = trace.ModifyTime();
+  bool ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+      (entries.empty() ||
+       fwrite(&entries[0], sizeof(InvocationEntry), entries.size(), fp) ==
+       entries.size());
+  return fclose(fp) == 0 && ok;
+}
+
+#endif /* INVOCATION_INDEX_H_ */
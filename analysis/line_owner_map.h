@@ -0,0 +1,132 @@
+#ifndef LINE_OWNER_MAP_H_
+#define LINE_OWNER_MAP_H_
+
+/*
+ * Concurrent map from cache line to the threads that accessed it, with
+ * the bytes each thread read and wrote, for the sharing analysis.
+ *
+ * Every thread of the traced program is a Sharer of a line: its reads,
+ * writes, and masks of the bytes of the line it read and wrote (bit i is
+ * byte i, so lines are at most 64 bytes). A line keeps its first sharer
+ * inline; further sharers go to a list of the shard, so lines that one
+ * thread touched, the common case, cost one entry.
+ *
+ * Lines are partitioned by address hash into shards, each an AddrTable
+ * behind its own lock. Analysis threads aggregate their traces into
+ * private tables first and then Publish() them, one lock per shard for
+ * all the lines of the shard, so threads publishing at the same time
+ * rarely wait for each other.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <omp.h>
+#include "../common.h"
+#include "../addr_table.h"
+
+#define LINE_OWNER_SHARDS (64)
+
+struct Sharer {
+  uint32_t thread;
+  uint64_t read_mask;
+  uint64_t write_mask;
+  uint64_t reads;
+  uint64_t writes;
+};
+
+struct LineOwners {
+  Sharer first;
+  /* 1 + index of the other sharers in the list of the shard, or 0 */
+  uint32_t more;
+};
+
+class LineOwnerMap {
+ public:
+  struct Shard {
+    AddrTable<LineOwners> lines;
+    std::vector<std::vector<Sharer> > more;
+  };
+
+  LineOwnerMap(): _shards(LINE_OWNER_SHARDS) {
+    for (int s = 0; s < LINE_OWNER_SHARDS; ++s) omp_init_lock(&_locks[s]);
+  }
+  ~LineOwnerMap() {
+    for (int s = 0; s < LINE_OWNER_SHARDS; ++s) omp_destroy_lock(&_locks[s]);
+  }
+
+  static int ShardOf(intptr_t line) {
+    // The table slot uses the low bits of the hash; shard on the high bits
+    return (int)((HashAddr((uint64_t)line) >> 32) % LINE_OWNER_SHARDS);
+  }
+
+  /*
+   * Adds the lines of one thread, a table from line to its accesses.
+   * Safe to call from several threads at once, for different threads
+   * of the traced program.
+   */
+  void Publish(const AddrTable<Sharer> &lines) {
+    std::vector<std::vector<size_t> > slots(LINE_OWNER_SHARDS);
+    for (size_t i = 0; i < lines.Capacity(); ++i) {
+      if (lines.Used(i)) slots[ShardOf(lines.Key(i))].push_back(i);
+    }
+    for (int s = 0; s < LINE_OWNER_SHARDS; ++s) {
+      if (slots[s].empty()) continue;
+      omp_set_lock(&_locks[s]);
+      Shard &shard = _shards[s];
+      for (size_t k = 0; k < slots[s].size(); ++k) {
+        size_t i = slots[s][k];
+        const Sharer &add = lines.Value(i);
+        LineOwners &o = shard.lines[lines.Key(i)];
+        if (o.first.reads + o.first.writes == 0) {
+          o.first = add;
+        } else if (o.first.thread == add.thread) {
+          Combine(o.first, add);
+        } else {
+          if (o.more == 0) {
+            shard.more.push_back(std::vector<Sharer>());
+            o.more = (uint32_t)shard.more.size();
+          }
+          AddSharer(shard.more[o.more - 1], add);
+        }
+      }
+      omp_unset_lock(&_locks[s]);
+    }
+  }
+
+  int NumShards() const { return LINE_OWNER_SHARDS; }
+  const Shard &GetShard(int s) const { return _shards[s]; }
+
+  /* Copies the sharers of a line of shard s into sharers */
+  void Sharers(int s, const LineOwners &o, std::vector<Sharer> *sharers) const {
+    sharers->assign(1, o.first);
+    if (o.more) {
+      const std::vector<Sharer> &more = _shards[s].more[o.more - 1];
+      sharers->insert(sharers->end(), more.begin(), more.end());
+    }
+  }
+
+ private:
+  static void Combine(Sharer &s, const Sharer &add) {
+    s.read_mask |= add.read_mask;
+    s.write_mask |= add.write_mask;
+    s.reads += add.reads;
+    s.writes += add.writes;
+  }
+
+  /* The same thread may be published from several traces */
+  static void AddSharer(std::vector<Sharer> &sharers, const Sharer &add) {
+    for (size_t k = 0; k < sharers.size(); ++k) {
+      if (sharers[k].thread == add.thread) {
+        Combine(sharers[k], add);
+        return;
+      }
+    }
+    sharers.push_back(add);
+  }
+
+  std::vector<Shard> _shards;
+  omp_lock_t _locks[LINE_OWNER_SHARDS];
+};
+
+#endif /* LINE_OWNER_MAP_H_ */
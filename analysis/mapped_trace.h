@@ -0,0 +1,321 @@
+#ifndef MAPPED_TRACE_H_
+#define MAPPED_TRACE_H_
+
+/*
+ * Memory-mapped trace reader for the analysis tools.
+ *
+ * The trace is split into chunks: the blocks of a binary trace, or runs
+ * of MAPPED_LEGACY_CHUNK records of a legacy raw trace. Chunks are
+ * independent, so threads can process any subset of them. Raw chunks
+ * are returned in place without copying; blocks are decoded straight
+ * from the mapping into a per-thread scratch buffer.
+ *
+ * GetChunkAs() returns the records of a chunk in one of the layouts of
+ * record_layout.h instead, without the optional fields.
+ *
+ * OrderedChunkReader walks the chunks in order for sequential tools.
+ * ThreadOfPath() gives the thread of a per-thread trace from its name.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../common.h"
+#include "../trace_format.h"
+#include "record_layout.h"
+
+/* Number of records per chunk of a legacy raw trace */
+#define MAPPED_LEGACY_CHUNK (65536)
+
+enum {
+  MAPPED_ADVISE_SEQUENTIAL = 1,
+  MAPPED_ADVISE_HUGEPAGE = 2,
+  MAPPED_ADVISE_WILLNEED = 4
+};
+
+/*
+ * Records of a chunk. ts, tid and pc point to the optional fields of the
+ * records, or are NULL when the chunk does not carry them.
+ */
+struct MemrefSpan {
+  const MEMREF *data;
+  size_t size;
+  const uint64_t *ts;
+  const uint32_t *tid;
+  const uint32_t *pc;
+};
+
+/* Per-thread buffers for decoding blocks */
+struct ChunkScratch {
+  std::vector<uint8_t> raw;
+  std::vector<MEMREF> refs;
+  TraceFields fields;
+};
+
+class MappedTrace {
+ public:
+  MappedTrace()
+      : _base(NULL), _size(0), _mtime(0), _legacy(false), _num_records(0) {}
+  ~MappedTrace() { Close(); }
+
+  bool Open(const char *path,
+            int advice = MAPPED_ADVISE_SEQUENTIAL | MAPPED_ADVISE_HUGEPAGE) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "ERROR! Cannot open " << path << std::endl;
+      return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+      close(fd);
+      return false;
+    }
+    _size = sb.st_size;
+    _mtime = (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+    if (_size > 0) {
+      void *p = mmap(NULL, _size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        std::cerr << "ERROR! Cannot map " << path << std::endl;
+        close(fd);
+        return false;
+      }
+      _base = static_cast<const uint8_t *>(p);
+      Advise(advice);
+    }
+    close(fd);
+    return Index();
+  }
+
+  void Close() {
+    if (_base) munmap(const_cast<uint8_t *>(_base), _size);
+    _base = NULL;
+    _size = 0;
+    _offsets.clear();
+    _first_record.clear();
+  }
+
+  bool IsLegacy() const { return _legacy; }
+  const TraceFileHeader &Header() const { return _header; }
+  size_t FileSize() const { return _size; }
+  /* Last modification time of the file, in nanoseconds since the epoch */
+  uint64_t ModifyTime() const { return _mtime; }
+  size_t NumRecords() const { return _num_records; }
+  size_t NumChunks() const { return _first_record.size(); }
+
+  /* Index of the first record of chunk i in the whole trace */
+  size_t ChunkFirstRecord(size_t i) const { return _first_record[i]; }
+  size_t ChunkRecords(size_t i) const {
+    size_t end = i + 1 < NumChunks() ? _first_record[i + 1] : _num_records;
+    return end - _first_record[i];
+  }
+  /* Chunk that holds the given record */
+  size_t ChunkOfRecord(size_t record) const {
+    return std::upper_bound(_first_record.begin(), _first_record.end(),
+                            record) - _first_record.begin() - 1;
+  }
+  /* File offset of chunk i */
+  size_t ChunkOffset(size_t i) const {
+    return _legacy ? _first_record[i] * sizeof(MEMREF) : _offsets[i];
+  }
+
+  /*
+   * Returns the records of chunk i in span. The span stays valid until
+   * scratch is used for another chunk.
+   */
+  bool GetChunk(size_t i, ChunkScratch &scratch, MemrefSpan *span) const {
+    if (_legacy) {
+      span->data = reinterpret_cast<const MEMREF *>(_base) + _first_record[i];
+      span->size = ChunkRecords(i);
+      span->ts = NULL;
+      span->tid = NULL;
+      span->pc = NULL;
+      return true;
+    }
+    TraceBlockHeader bh;
+    memcpy(&bh, _base + _offsets[i], sizeof(bh));
+    if (!DecodeBlock(bh, _base + _offsets[i] + sizeof(bh), scratch.raw,
+                     scratch.refs, &scratch.fields)) {
+      std::cerr << "ERROR! Corrupt block at offset " << _offsets[i]
+                << std::endl;
+      return false;
+    }
+    span->data = scratch.refs.empty() ? NULL : &scratch.refs[0];
+    span->size = scratch.refs.size();
+    span->ts = scratch.fields.ts.empty() ? NULL : &scratch.fields.ts[0];
+    span->tid = scratch.fields.tid.empty() ? NULL : &scratch.fields.tid[0];
+    span->pc = scratch.fields.pc.empty() ? NULL : &scratch.fields.pc[0];
+    return true;
+  }
+
+  /*
+   * Returns the records of chunk i in chunk, an AosChunk, PackedChunk or
+   * SoaChunk. An AosChunk of a legacy trace points into the mapping.
+   */
+  template <class Chunk>
+  bool GetChunkAs(size_t i, ChunkScratch &scratch, Chunk *chunk) const {
+    if (_legacy) {
+      chunk->Assign(reinterpret_cast<const MEMREF *>(_base) + _first_record[i],
+                    ChunkRecords(i));
+      return true;
+    }
+    TraceBlockHeader bh;
+    memcpy(&bh, _base + _offsets[i], sizeof(bh));
+    chunk->Resize(bh.num_records);
+    if (!DecodeBlockTo(bh, _base + _offsets[i] + sizeof(bh), scratch.raw,
+                       *chunk)) {
+      std::cerr << "ERROR! Corrupt block at offset " << _offsets[i]
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  /* Chunks [*begin, *end) of part out of num_parts equal parts */
+  void Partition(size_t part, size_t num_parts, size_t *begin,
+                 size_t *end) const {
+    size_t n = NumChunks();
+    *begin = n * part / num_parts;
+    *end = n * (part + 1) / num_parts;
+  }
+
+ private:
+  void Advise(int advice) {
+    void *p = const_cast<uint8_t *>(_base);
+    // Hints only; failures are harmless
+    if (advice & MAPPED_ADVISE_SEQUENTIAL) madvise(p, _size, MADV_SEQUENTIAL);
+    if (advice & MAPPED_ADVISE_WILLNEED) madvise(p, _size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+    if (advice & MAPPED_ADVISE_HUGEPAGE) madvise(p, _size, MADV_HUGEPAGE);
+#endif
+  }
+
+  bool Index() {
+    InitFileHeader(_header);
+    size_t off = 0;
+    if (HasTraceMagic(_base, _size)) {
+      if (!ParseFileHeader(_base, _size, &_header)) {
+        std::cerr << "ERROR! Corrupt file header" << std::endl;
+        return false;
+      }
+      if (_header.version != TRACE_VERSION) {
+        std::cerr << "ERROR! Unsupported trace version: " << _header.version
+                  << std::endl;
+        return false;
+      }
+      off = _header.header_size;
+    } else {
+      _legacy = true;
+    }
+    _num_records = 0;
+    if (_legacy) {
+      if (_size % sizeof(MEMREF)) {
+        std::cerr << "ERROR! Size of a raw trace must be a multiple of "
+                  << sizeof(MEMREF) << std::endl;
+        return false;
+      }
+      _num_records = _size / sizeof(MEMREF);
+      for (size_t i = 0; i < _num_records; i += MAPPED_LEGACY_CHUNK) {
+        _first_record.push_back(i);
+      }
+      return true;
+    }
+    while (off < _size) {
+      TraceBlockHeader bh;
+      if (_size - off < sizeof(bh)) break;
+      memcpy(&bh, _base + off, sizeof(bh));
+      if (!BlockHeaderValid(bh) || bh.comp_size > _size - off - sizeof(bh))
+        break;
+      _offsets.push_back(off);
+      _first_record.push_back(_num_records);
+      _num_records += bh.num_records;
+      off += sizeof(bh) + bh.comp_size;
+    }
+    if (off != _size) {
+      std::cerr << "ERROR! Corrupt block header at offset " << off
+                << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  const uint8_t *_base;
+  size_t _size;
+  uint64_t _mtime;
+  bool _legacy;
+  TraceFileHeader _header;
+  size_t _num_records;
+  std::vector<size_t> _offsets;
+  std::vector<size_t> _first_record;
+};
+
+/* Thread id from the trace name pin.out.PID.TID, or fallback */
+static inline uint32_t ThreadOfPath(const char *path, uint32_t fallback) {
+  const char *dot = strrchr(path, '.');
+  if (!dot || !dot[1]) return fallback;
+  char *end;
+  unsigned long tid = strtoul(dot + 1, &end, 10);
+  return *end ? fallback : (uint32_t)tid;
+}
+
+/*
+ * Hands out the chunks of a trace in order for tools that replay the
+ * trace sequentially. With OpenMP, the next window of chunks is decoded
+ * in parallel before it is handed out.
+ */
+class OrderedChunkReader {
+ public:
+  explicit OrderedChunkReader(const MappedTrace &trace)
+      : _trace(trace), _next(0), _base(0), _filled(0), _error(false) {
+    size_t window = 1;
+#ifdef _OPENMP
+    window = 2 * omp_get_max_threads();
+#endif
+    _scratch.resize(window);
+    _spans.resize(window);
+  }
+
+  /* Returns false at the end of the trace or on a corrupt chunk. */
+  bool Next(MemrefSpan *span) {
+    if (_next == _base + _filled) {
+      _base = _next;
+      _filled = std::min(_spans.size(), _trace.NumChunks() - _base);
+      if (_filled == 0) return false;
+      bool ok = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+      for (size_t i = 0; i < _filled; ++i) {
+        ok = _trace.GetChunk(_base + i, _scratch[i], &_spans[i]) && ok;
+      }
+      if (!ok) {
+        _error = true;
+        _filled = 0;
+        return false;
+      }
+    }
+    *span = _spans[_next - _base];
+    ++_next;
+    return true;
+  }
+
+  bool Error() const { return _error; }
+
+ private:
+  const MappedTrace &_trace;
+  size_t _next;
+  size_t _base;
+  size_t _filled;
+  bool _error;
+  std::vector<ChunkScratch> _scratch;
+  std::vector<MemrefSpan> _spans;
+};
+
+#endif /* MAPPED_TRACE_H_ */
@@ -0,0 +1,173 @@
+/*
+ * Merges the per-thread traces of a run into one trace ordered by
+ * timestamp, so that the accesses of all threads can be analyzed as
+ * one interleaved stream.
+ *
+ *   merge [-o OUTPUT] trace...
+ *
+ * The inputs must be written with -timestamp. Every output record
+ * carries its timestamp and the id of its thread, taken from the TID
+ * suffix of the input name (pin.out.PID.TID), or from the records of an
+ * input that is itself merged. Instruction ids are kept when every input
+ * has them.
+ *
+ * The inputs are merged with a heap keyed by the timestamp of the next
+ * record of each input. The two records of an allocation stay next to
+ * each other, whatever their timestamps. Each input is decoded one chunk
+ * at a time, so memory is bounded by one chunk per input plus one output
+ * block.
+ */
+#include <iostream>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../common.h"
+#include "../trace_format.h"
+#include "mapped_trace.h"
+
+using namespace std;
+
+/* Reads the records of one input in order */
+class MergeInput {
+ public:
+  MergeInput()
+      : _chunk(0), _pos(0), _tid(0), _pair_open(false), _error(false) {
+    _span.size = 0;
+  }
+
+  bool Open(const char *path, uint32_t tid) {
+    _tid = tid;
+    if (!_trace.Open(path)) return false;
+    if (!(_trace.Header().flags & TRACE_HAS_TIMESTAMP)) {
+      cerr << "ERROR! " << path << " has no timestamps; trace with -timestamp"
+           << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /* Moves to the next record. Returns false at the end or on an error. */
+  bool Advance() {
+    if (_span.size > 0 && Record().type == TRACE_ALLOC) {
+      _pair_open = !_pair_open;
+    }
+    if (++_pos < _span.size) return true;
+    _pos = 0;
+    _span.size = 0;
+    while (_span.size == 0) {
+      if (_chunk == _trace.NumChunks()) return false;
+      if (!_trace.GetChunk(_chunk++, _scratch, &_span)) {
+        _error = true;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const TraceFileHeader &Header() const { return _trace.Header(); }
+  const MEMREF &Record() const { return _span.data[_pos]; }
+  uint64_t Timestamp() const { return _span.ts[_pos]; }
+  uint32_t Thread() const { return _span.tid ? _span.tid[_pos] : _tid; }
+  uint32_t Pc() const { return _span.pc ? _span.pc[_pos] : 0; }
+  /* Whether the record is the second of an allocation */
+  bool InPair() const { return _pair_open; }
+  bool Error() const { return _error; }
+
+ private:
+  MappedTrace _trace;
+  ChunkScratch _scratch;
+  MemrefSpan _span;
+  size_t _chunk;
+  size_t _pos;
+  uint32_t _tid;
+  bool _pair_open;
+  bool _error;
+};
+
+typedef pair<uint64_t, size_t> HeapEntry;  // timestamp, input
+
+bool merge(char **paths, size_t num_inputs, const char *output_path) {
+  vector<MergeInput> inputs(num_inputs);
+  priority_queue<HeapEntry, vector<HeapEntry>, greater<HeapEntry> > heap;
+  uint32_t flags = TRACE_HAS_TIMESTAMP | TRACE_HAS_THREAD | TRACE_HAS_PC;
+  for (size_t i = 0; i < num_inputs; ++i) {
+    if (!inputs[i].Open(paths[i], ThreadOfPath(paths[i], (uint32_t)i)))
+      return false;
+    if (!(inputs[i].Header().flags & TRACE_HAS_PC)) flags &= ~TRACE_HAS_PC;
+    // Inputs start before their first record
+    if (inputs[i].Advance()) {
+      heap.push(HeapEntry(inputs[i].Timestamp(), i));
+    } else if (inputs[i].Error()) {
+      return false;
+    }
+  }
+
+  FILE *out = fopen(output_path, "wb");
+  TraceWriter writer;
+  // The threads of a run share its sampling
+  if (!out || !writer.Open(out, true, flags, &inputs[0].Header().sampling)) {
+    cerr << "ERROR! Cannot write " << output_path << endl;
+    return false;
+  }
+
+  size_t count = 0;
+  while (!heap.empty()) {
+    size_t i = heap.top().second;
+    heap.pop();
+    MergeInput &in = inputs[i];
+    // Stay on this input while it is ahead of the others, or between the
+    // records of an allocation
+    uint64_t limit = heap.empty() ? UINT64_MAX : heap.top().first;
+    bool more;
+    do {
+      if (!writer.Append(in.Record(), in.Timestamp(), in.Thread(), in.Pc())) {
+        cerr << "ERROR! Cannot write " << output_path << endl;
+        return false;
+      }
+      ++count;
+      more = in.Advance();
+    } while (more && (in.Timestamp() <= limit || in.InPair()));
+    if (more) {
+      heap.push(HeapEntry(in.Timestamp(), i));
+    } else if (in.Error()) {
+      cerr << "Number of merged trace entries: " << count << endl;
+      return false;
+    }
+  }
+  if (!writer.Flush() || fclose(out) != 0) {
+    cerr << "ERROR! Cannot write " << output_path << endl;
+    return false;
+  }
+  cout << "Number of merged trace entries: " << count << endl;
+  cout << "Number of threads: " << num_inputs << endl;
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-o OUTPUT] trace..." << endl;
+}
+
+int main(int argc, char *argv[]) {
+  const char *output_path = "pin.out.merged";
+  int opt;
+  while ((opt = getopt(argc, argv, "o:h")) != -1) {
+    switch (opt) {
+      case 'o':
+        output_path = optarg;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!merge(argv + optind, argc - optind, output_path)) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
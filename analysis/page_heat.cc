@@ -0,0 +1,451 @@
+/*
+ * Aggregates the accesses of the threads of a run per 4K and 2M page
+ * and advises on huge pages and NUMA placement.
+ *
+ *   page_heat [-d SHARE] [-n ROWS] [-T ENTRIES] trace...
+ *
+ * The traces are the per-thread traces of a run (pin.out.PID.TID, the
+ * thread taken from the TID suffix), or a merged trace whose records
+ * carry their thread. Each trace is aggregated by its own OpenMP
+ * thread into one page table (page_table.h) per traced thread; the
+ * tables are then merged into one with, for every 4K page, the reads
+ * and writes, the number of threads that touched it, the thread with
+ * the most accesses, and, when every trace has timestamps, the thread
+ * that touched it first.
+ *
+ * The report has:
+ *
+ *   - the accesses and the 4K and 2M pages of every thread,
+ *   - a heatmap of the ROWS (32 by default) 2M regions with the most
+ *     accesses, one character per 32K,
+ *   - the TLB reach at 4K and 2M: the fraction of accesses to the
+ *     ENTRIES (1536 by default, a second-level TLB) hottest pages, and
+ *     the pages needed for 90% and 99% of the accesses,
+ *   - pages private to one thread, dominated by one thread with at
+ *     least SHARE (0.9 by default) of their accesses, and shared, and
+ *     the 2M regions whose pages are used mostly by different threads,
+ *   - a first-touch placement: the pages each thread should touch first
+ *     so that they land on its node, and the shared pages, which are
+ *     better interleaved.
+ */
+#include <iostream>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../common.h"
+#include "mapped_trace.h"
+#include "page_table.h"
+
+using namespace std;
+
+#define PAGE_SIZE_4K (1ULL << PT_PAGE_SHIFT)
+#define PAGE_SIZE_2M (1ULL << PT_HUGE_PAGE_SHIFT)
+#define ADDR_MASK ((1ULL << PT_ADDR_BITS) - 1)
+/* 4K pages per character of the heatmap */
+#define HEAT_PAGES (8)
+#define HEAT_RAMP " .:-=+*#%@"
+
+/* Accesses of one thread to a 4K page */
+struct ThreadPage {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t first_ts;
+};
+
+/* Accesses of all threads to a 4K page */
+struct SharedPage {
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t top_count;
+  uint64_t first_ts;
+  uint32_t top_thread;
+  uint32_t first_thread;
+  uint32_t num_threads;
+};
+
+struct ThreadTrace {
+  uint32_t tid;
+  PageTable<ThreadPage> *pages;
+  uint64_t reads;
+  uint64_t writes;
+};
+
+/*
+ * Aggregates one trace into a page table per thread, appended to
+ * threads. Sets *has_ts to whether the trace has timestamps.
+ */
+static bool AggregateTrace(const char *path, uint32_t file_tid,
+                           vector<ThreadTrace> *threads, bool *has_ts) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  *has_ts = !trace.IsLegacy() &&
+      (trace.Header().flags & TRACE_HAS_TIMESTAMP);
+  map<uint32_t, size_t> index;
+  ChunkScratch scratch;
+  MemrefSpan buf;
+  for (size_t c = 0; c < trace.NumChunks(); ++c) {
+    if (!trace.GetChunk(c, scratch, &buf)) {
+      for (size_t t = 0; t < threads->size(); ++t) delete (*threads)[t].pages;
+      threads->clear();
+      return false;
+    }
+    for (size_t i = 0; i < buf.size; ++i) {
+      const MEMREF &mr = buf.data[i];
+      if (mr.type != TRACE_READ && mr.type != TRACE_WRITE) continue;
+      uint32_t tid = buf.tid ? buf.tid[i] : file_tid;
+      pair<map<uint32_t, size_t>::iterator, bool> ret =
+          index.insert(make_pair(tid, threads->size()));
+      if (ret.second) {
+        ThreadTrace t = { tid, new PageTable<ThreadPage>(), 0, 0 };
+        threads->push_back(t);
+      }
+      ThreadTrace &t = (*threads)[ret.first->second];
+      bool write = mr.type == TRACE_WRITE;
+      uint64_t first = ((uint64_t)mr.addr & ADDR_MASK) >> PT_PAGE_SHIFT;
+      uint64_t last = (((uint64_t)mr.addr + (mr.size ? mr.size - 1 : 0)) &
+                       ADDR_MASK) >> PT_PAGE_SHIFT;
+      // An access that spans pages counts once on each, and so does it in
+      // the thread's totals, which stay the sums over its pages
+      for (uint64_t page = first; page <= last; ++page) {
+        ThreadPage &p = (*t.pages)[page << PT_PAGE_SHIFT];
+        if (p.reads + p.writes == 0) p.first_ts = buf.ts ? buf.ts[i] : 0;
+        ++(write ? p.writes : p.reads);
+        ++(write ? t.writes : t.reads);
+      }
+    }
+  }
+  return true;
+}
+
+/* Adds the pages of one thread to the shared table */
+class MergeVisitor {
+ public:
+  MergeVisitor(PageTable<SharedPage> &shared, uint32_t thread)
+      : _shared(shared), _thread(thread) {}
+
+  void operator()(uint64_t base, const PageTable<ThreadPage>::Block &block) {
+    for (size_t j = 0; j < PT_FANOUT; ++j) {
+      const ThreadPage &p = block.pages[j];
+      uint64_t count = p.reads + p.writes;
+      if (count == 0) continue;
+      SharedPage &s = _shared[base + (j << PT_PAGE_SHIFT)];
+      if (s.num_threads == 0 || p.first_ts < s.first_ts) {
+        s.first_ts = p.first_ts;
+        s.first_thread = _thread;
+      }
+      if (count > s.top_count) {
+        s.top_count = count;
+        s.top_thread = _thread;
+      }
+      s.reads += p.reads;
+      s.writes += p.writes;
+      ++s.num_threads;
+    }
+  }
+
+ private:
+  PageTable<SharedPage> &_shared;
+  uint32_t _thread;
+};
+
+/* Counts the touched 4K pages of a thread */
+struct PageCountVisitor {
+  PageCountVisitor(): pages(0) {}
+  void operator()(uint64_t, const PageTable<ThreadPage>::Block &block) {
+    for (size_t j = 0; j < PT_FANOUT; ++j) {
+      pages += block.pages[j].reads + block.pages[j].writes != 0;
+    }
+  }
+  uint64_t pages;
+};
+
+enum { PAGE_PRIVATE = 0, PAGE_DOMINATED, PAGE_SHARED, NUM_SHARING };
+
+struct Region {
+  uint64_t base;
+  uint64_t reads;
+  uint64_t writes;
+  uint32_t pages;
+  bool mixed;
+  uint64_t heat[PT_FANOUT / HEAT_PAGES];
+};
+
+/* Orders regions by decreasing accesses */
+struct ByAccesses {
+  bool operator()(const Region &a, const Region &b) const {
+    return a.reads + a.writes > b.reads + b.writes;
+  }
+};
+
+struct ByBase {
+  bool operator()(const Region &a, const Region &b) const {
+    return a.base < b.base;
+  }
+};
+
+/* Collects the statistics of the report from the shared table */
+class ReportVisitor {
+ public:
+  ReportVisitor(size_t num_threads, double share)
+      : _share(share), _owned(num_threads, 0) {
+    memset(sharing_pages, 0, sizeof(sharing_pages));
+    memset(sharing_accesses, 0, sizeof(sharing_accesses));
+    mixed_regions = 0;
+    misplaced = 0;
+  }
+
+  void operator()(uint64_t base, const PageTable<SharedPage>::Block &block) {
+    Region r;
+    memset(&r, 0, sizeof(r));
+    r.base = base;
+    uint32_t owner = 0;
+    bool has_owner = false;
+    for (size_t j = 0; j < PT_FANOUT; ++j) {
+      const SharedPage &p = block.pages[j];
+      uint64_t count = p.reads + p.writes;
+      if (count == 0) continue;
+      r.reads += p.reads;
+      r.writes += p.writes;
+      ++r.pages;
+      r.heat[j / HEAT_PAGES] += count;
+      pages_4k.push_back(count);
+      int sharing = Sharing(p);
+      ++sharing_pages[sharing];
+      sharing_accesses[sharing] += count;
+      if (sharing == PAGE_SHARED) continue;
+      ++_owned[p.top_thread];
+      misplaced += p.first_thread != p.top_thread;
+      if (has_owner && owner != p.top_thread) r.mixed = true;
+      owner = p.top_thread;
+      has_owner = true;
+    }
+    pages_2m.push_back(r.reads + r.writes);
+    mixed_regions += r.mixed;
+    regions.push_back(r);
+  }
+
+  /* Pages each thread should touch first */
+  uint64_t Owned(size_t thread) const { return _owned[thread]; }
+
+  std::vector<uint64_t> pages_4k;
+  std::vector<uint64_t> pages_2m;
+  std::vector<Region> regions;
+  uint64_t sharing_pages[NUM_SHARING];
+  uint64_t sharing_accesses[NUM_SHARING];
+  uint64_t mixed_regions;
+  uint64_t misplaced;
+
+ private:
+  int Sharing(const SharedPage &p) const {
+    if (p.num_threads == 1) return PAGE_PRIVATE;
+    return p.top_count >= _share * (p.reads + p.writes) ? PAGE_DOMINATED
+                                                        : PAGE_SHARED;
+  }
+
+  double _share;
+  std::vector<uint64_t> _owned;
+};
+
+static double MiB(uint64_t bytes) { return (double)bytes / (1 << 20); }
+
+/* Hottest pages needed for a fraction of the accesses */
+static size_t PagesFor(const vector<uint64_t> &sorted, uint64_t total,
+                       double fraction) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    if (sum >= fraction * total) return i;
+    sum += sorted[i];
+  }
+  return sorted.size();
+}
+
+/* Prints the reach of a TLB of entries pages and returns its coverage */
+static double PrintReach(const char *name, vector<uint64_t> &pages,
+                         uint64_t page_size, size_t entries, uint64_t total) {
+  sort(pages.begin(), pages.end(), greater<uint64_t>());
+  uint64_t covered = 0;
+  for (size_t i = 0; i < pages.size() && i < entries; ++i) covered += pages[i];
+  double coverage = total ? (double)covered / total : 1.0;
+  printf("  %s pages: %zu touched (%.2f MiB), reach %.2f MiB covers %.4f of "
+         "accesses; 90%% in %zu pages, 99%% in %zu pages\n", name,
+         pages.size(), MiB(pages.size() * page_size),
+         MiB(entries * page_size), coverage, PagesFor(pages, total, 0.9),
+         PagesFor(pages, total, 0.99));
+  return coverage;
+}
+
+static void PrintHeatmap(vector<Region> &regions, size_t rows) {
+  sort(regions.begin(), regions.end(), ByAccesses());
+  if (regions.size() > rows) regions.resize(rows);
+  sort(regions.begin(), regions.end(), ByBase());
+  uint64_t max_heat = 0;
+  for (size_t k = 0; k < regions.size(); ++k) {
+    for (size_t c = 0; c < PT_FANOUT / HEAT_PAGES; ++c) {
+      max_heat = max(max_heat, regions[k].heat[c]);
+    }
+  }
+  // The characters after the blank cover equal ranges of log(heat)
+  const int top = sizeof(HEAT_RAMP) - 2;
+  double scale = max_heat > 1 ? (top - 1) / log((double)max_heat) : 0;
+  printf("%14s %12s %6s %5s  %s\n", "region", "accesses", "write%", "pages",
+         "heat (32K per character)");
+  for (size_t k = 0; k < regions.size(); ++k) {
+    const Region &r = regions[k];
+    char heat[PT_FANOUT / HEAT_PAGES + 1];
+    for (size_t c = 0; c < PT_FANOUT / HEAT_PAGES; ++c) {
+      int level = r.heat[c] ? 1 + (int)(log((double)r.heat[c]) * scale) : 0;
+      heat[c] = HEAT_RAMP[min(level, top)];
+    }
+    heat[PT_FANOUT / HEAT_PAGES] = '\0';
+    uint64_t accesses = r.reads + r.writes;
+    printf("%#14llx %12llu %6.2f %5u  |%s|%s\n", (unsigned long long)r.base,
+           (unsigned long long)accesses,
+           accesses ? 100.0 * r.writes / accesses : 0.0, r.pages, heat,
+           r.mixed ? " mixed" : "");
+  }
+}
+
+bool page_heat(char **paths, size_t num_inputs, double share, size_t rows,
+               size_t tlb_entries) {
+  vector<vector<ThreadTrace> > per_input(num_inputs);
+  vector<char> input_ts(num_inputs, 0);
+  bool ok = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+  for (size_t k = 0; k < num_inputs; ++k) {
+    bool has_ts = false;
+    ok = AggregateTrace(paths[k], ThreadOfPath(paths[k], (uint32_t)k),
+                        &per_input[k], &has_ts) && ok;
+    input_ts[k] = has_ts;
+  }
+  vector<ThreadTrace> threads;
+  bool has_ts = true;
+  for (size_t k = 0; k < num_inputs; ++k) {
+    threads.insert(threads.end(), per_input[k].begin(), per_input[k].end());
+    has_ts = has_ts && input_ts[k];
+  }
+  if (!ok) {
+    for (size_t t = 0; t < threads.size(); ++t) delete threads[t].pages;
+    return false;
+  }
+
+  PageTable<SharedPage> shared;
+  for (size_t t = 0; t < threads.size(); ++t) {
+    MergeVisitor merge(shared, (uint32_t)t);
+    threads[t].pages->ForEachBlock(merge);
+  }
+  ReportVisitor report(threads.size(), share);
+  shared.ForEachBlock(report);
+
+  uint64_t total = 0;
+  for (size_t t = 0; t < threads.size(); ++t) {
+    total += threads[t].reads + threads[t].writes;
+  }
+  cout << "Threads: " << threads.size() << endl;
+  printf("%10s %14s %14s %14s %10s %10s\n", "thread", "accesses", "reads",
+         "writes", "pages", "2M pages");
+  for (size_t t = 0; t < threads.size(); ++t) {
+    const ThreadTrace &th = threads[t];
+    // The 2M pages of the thread are the blocks of its table
+    PageCountVisitor count;
+    th.pages->ForEachBlock(count);
+    printf("%10u %14llu %14llu %14llu %10llu %10zu\n", th.tid,
+           (unsigned long long)(th.reads + th.writes),
+           (unsigned long long)th.reads, (unsigned long long)th.writes,
+           (unsigned long long)count.pages, th.pages->NumBlocks());
+  }
+
+  cout << endl << "Heatmap:" << endl;
+  PrintHeatmap(report.regions, rows);
+
+  cout << endl << "TLB reach (" << tlb_entries << " entries):" << endl;
+  double small = PrintReach("4K", report.pages_4k, PAGE_SIZE_4K, tlb_entries,
+                            total);
+  double huge = PrintReach("2M", report.pages_2m, PAGE_SIZE_2M, tlb_entries,
+                           total);
+  if (small >= 0.99) {
+    cout << "  Advice: 4K pages suffice; the hot pages fit in the TLB" << endl;
+  } else if (huge - small >= 0.05) {
+    printf("  Advice: use huge pages; they cover %.4f more of the accesses\n",
+           huge - small);
+  } else {
+    cout << "  Advice: huge pages gain little; the accesses are spread over"
+         << " more than the TLB reaches at either size" << endl;
+  }
+
+  static const char *sharing_names[NUM_SHARING] = {
+    "private", "dominated", "shared"
+  };
+  cout << endl << "Sharing (dominated: one thread makes at least " << share
+       << " of the accesses):" << endl;
+  for (int s = 0; s < NUM_SHARING; ++s) {
+    printf("  %-10s %10llu pages %10.2f MiB %14llu accesses (%.4f)\n",
+           sharing_names[s], (unsigned long long)report.sharing_pages[s],
+           MiB(report.sharing_pages[s] * PAGE_SIZE_4K),
+           (unsigned long long)report.sharing_accesses[s],
+           total ? (double)report.sharing_accesses[s] / total : 0.0);
+  }
+  printf("  2M pages mostly used by different threads: %llu of %zu\n",
+         (unsigned long long)report.mixed_regions, report.pages_2m.size());
+
+  cout << endl << "First-touch placement:" << endl;
+  for (size_t t = 0; t < threads.size(); ++t) {
+    printf("  thread %u: touch first %llu pages (%.2f MiB)\n", threads[t].tid,
+           (unsigned long long)report.Owned(t),
+           MiB(report.Owned(t) * PAGE_SIZE_4K));
+  }
+  printf("  interleave %llu shared pages (%.2f MiB)\n",
+         (unsigned long long)report.sharing_pages[PAGE_SHARED],
+         MiB(report.sharing_pages[PAGE_SHARED] * PAGE_SIZE_4K));
+  if (has_ts) {
+    printf("  pages now touched first by another thread than their user: "
+           "%llu\n", (unsigned long long)report.misplaced);
+  } else {
+    cout << "  (trace with -timestamp to compare with the actual first touch)"
+         << endl;
+  }
+
+  for (size_t t = 0; t < threads.size(); ++t) delete threads[t].pages;
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-d SHARE] [-n ROWS] [-T ENTRIES] trace..."
+       << endl;
+}
+
+int main(int argc, char *argv[]) {
+  double share = 0.9;
+  size_t rows = 32;
+  size_t tlb_entries = 1536;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:n:T:h")) != -1) {
+    switch (opt) {
+      case 'd':
+        share = atof(optarg);
+        break;
+      case 'n':
+        rows = strtoul(optarg, NULL, 10);
+        break;
+      case 'T':
+        tlb_entries = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || share <= 0.5 || share > 1) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!page_heat(argv + optind, argc - optind, share, rows, tlb_entries)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,121 @@
+#ifndef PAGE_TABLE_H_
+#define PAGE_TABLE_H_
+
+/*
+ * Per-page values kept in a radix tree shaped like an x86-64 page table.
+ *
+ * The low 48 bits of an address are split as a hardware page walk
+ * splits them: three levels of 512-entry directories indexed by bits
+ * 47-39, 38-30 and 29-21, and a leaf block with the values of the 512 4K
+ * pages of one 2M region, indexed by bits 20-12. A lookup is three
+ * dependent loads, the table grows one 2M region at a time, and blocks
+ * are visited in address order, so 4K and 2M views of the same pages
+ * come from one structure.
+ *
+ * V must be a POD type; new values are zero-initialized.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PT_LEVEL_BITS (9)
+#define PT_FANOUT (1 << PT_LEVEL_BITS)
+#define PT_PAGE_SHIFT (12)
+#define PT_HUGE_PAGE_SHIFT (PT_PAGE_SHIFT + PT_LEVEL_BITS)
+#define PT_ADDR_BITS (48)
+/* Directory levels above the leaf blocks */
+#define PT_DIR_LEVELS ((PT_ADDR_BITS - PT_HUGE_PAGE_SHIFT) / PT_LEVEL_BITS)
+
+template <typename V>
+class PageTable {
+ public:
+  /* The values of the 4K pages of one 2M region */
+  struct Block {
+    V pages[PT_FANOUT];
+  };
+
+  PageTable(): _root(new Dir()), _num_blocks(0) {}
+  ~PageTable() { Free(_root, PT_DIR_LEVELS); }
+
+  size_t NumBlocks() const { return _num_blocks; }
+
+  /* Returns the value of the 4K page of addr, adding it if missing. */
+  V &operator[](uint64_t addr) {
+    Dir *dir = _root;
+    for (int level = PT_DIR_LEVELS; level > 1; --level) {
+      void *&child = dir->child[Index(addr, level)];
+      if (!child) child = new Dir();
+      dir = static_cast<Dir *>(child);
+    }
+    void *&leaf = dir->child[Index(addr, 1)];
+    if (!leaf) {
+      leaf = new Block();
+      ++_num_blocks;
+    }
+    return static_cast<Block *>(leaf)->pages[Index(addr, 0)];
+  }
+
+  /* Returns the block of the 2M region of addr, or NULL. */
+  const Block *FindBlock(uint64_t addr) const {
+    const Dir *dir = _root;
+    for (int level = PT_DIR_LEVELS; level > 1; --level) {
+      dir = static_cast<const Dir *>(dir->child[Index(addr, level)]);
+      if (!dir) return NULL;
+    }
+    return static_cast<const Block *>(dir->child[Index(addr, 1)]);
+  }
+
+  /* Calls visitor(base, block) for every block, in address order */
+  template <class Visitor>
+  void ForEachBlock(Visitor &visitor) const {
+    Visit(_root, PT_DIR_LEVELS, 0, visitor);
+  }
+
+ private:
+  struct Dir {
+    Dir() { for (int i = 0; i < PT_FANOUT; ++i) child[i] = NULL; }
+    void *child[PT_FANOUT];
+  };
+
+  /* Index at level 0 (the 4K page in its block) to PT_DIR_LEVELS */
+  static size_t Index(uint64_t addr, int level) {
+    return (addr >> (PT_PAGE_SHIFT + level * PT_LEVEL_BITS)) & (PT_FANOUT - 1);
+  }
+
+  template <class Visitor>
+  static void Visit(const Dir *dir, int level, uint64_t base,
+                    Visitor &visitor) {
+    int shift = PT_PAGE_SHIFT + level * PT_LEVEL_BITS;
+    for (size_t i = 0; i < PT_FANOUT; ++i) {
+      if (!dir->child[i]) continue;
+      uint64_t child_base = base | ((uint64_t)i << shift);
+      if (level == 1) {
+        visitor(child_base, *static_cast<const Block *>(dir->child[i]));
+      } else {
+        Visit(static_cast<const Dir *>(dir->child[i]), level - 1, child_base,
+              visitor);
+      }
+    }
+  }
+
+  static void Free(Dir *dir, int level) {
+    for (size_t i = 0; i < PT_FANOUT; ++i) {
+      if (!dir->child[i]) continue;
+      if (level == 1) {
+        delete static_cast<Block *>(dir->child[i]);
+      } else {
+        Free(static_cast<Dir *>(dir->child[i]), level - 1);
+      }
+    }
+    delete dir;
+  }
+
+  // Not copyable
+  PageTable(const PageTable &);
+  PageTable &operator=(const PageTable &);
+
+  Dir *_root;
+  size_t _num_blocks;
+};
+
+#endif /* PAGE_TABLE_H_ */
@@ -0,0 +1,218 @@
+#ifndef RECORD_LAYOUT_H_
+#define RECORD_LAYOUT_H_
+
+/*
+ * In-memory layouts of the records of a chunk for the analysis tools.
+ *
+ *   AosChunk     MEMREF records, 16 bytes each. Legacy raw chunks are
+ *                used in place.
+ *   PackedChunk  PACKED_MEMREF records, 8 bytes each. Sizes that do
+ *                not fit, such as most function and allocation site
+ *                ids, are kept aside by record number.
+ *   SoaChunk     one array per field (types narrowed to a byte), so
+ *                that scans over one field are vectorized.
+ *
+ * All chunks have the same interface, and tools are templates over the
+ * chunk type. The layout is then picked once, at compile time or when
+ * the tool starts, and the inner loops are specialized for each layout
+ * without looking at the format per record:
+ *
+ *   NumRecords(), Addr(i), Type(i), Size(i)
+ *   Resize(n), Set(i, addr, type, size)   decoder output
+ *   Assign(refs, n)                        from MEMREFs
+ *
+ * MappedTrace::GetChunkAs() decodes blocks straight into a chunk.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include "../common.h"
+
+enum {
+  LAYOUT_AOS,
+  LAYOUT_PACKED,
+  LAYOUT_SOA
+};
+
+class AosChunk {
+ public:
+  AosChunk(): _data(NULL), _size(0) {}
+
+  size_t NumRecords() const { return _size; }
+  intptr_t Addr(size_t i) const { return _data[i].addr; }
+  uint32_t Type(size_t i) const { return _data[i].type; }
+  uint32_t Size(size_t i) const { return _data[i].size; }
+
+  void Resize(size_t n) {
+    _storage.resize(n);
+    _data = n ? &_storage[0] : NULL;
+    _size = n;
+  }
+  void Set(size_t i, intptr_t addr, uint32_t type, uint32_t size) {
+    MEMREF &mr = _storage[i];
+    mr.addr = addr;
+    mr.type = type;
+    mr.size = size;
+  }
+  /* Points to refs without copying; they must outlive the chunk's use. */
+  void Assign(const MEMREF *refs, size_t n) {
+    _data = refs;
+    _size = n;
+  }
+
+ private:
+  const MEMREF *_data;
+  size_t _size;
+  std::vector<MEMREF> _storage;
+};
+
+class PackedChunk {
+ public:
+  size_t NumRecords() const { return _refs.size(); }
+  intptr_t Addr(size_t i) const { return PackedAddr(_refs[i]); }
+  uint32_t Type(size_t i) const { return PackedType(_refs[i]); }
+  uint32_t Size(size_t i) const {
+    uint32_t size = PackedSize(_refs[i]);
+    return size < PACKED_SIZE_MAX ? size : WideSize(i);
+  }
+
+  void Resize(size_t n) {
+    _refs.resize(n);
+    _wide.clear();
+  }
+  void Set(size_t i, intptr_t addr, uint32_t type, uint32_t size) {
+    _refs[i] = PackMemref(addr, type, size);
+    if (size >= PACKED_SIZE_MAX) {
+      SetWide(i, size);
+    } else if (!_wide.empty()) {
+      ClearWide(i);
+    }
+  }
+  void Assign(const MEMREF *refs, size_t n) {
+    Resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      Set(i, refs[i].addr, refs[i].type, refs[i].size);
+    }
+  }
+
+ private:
+  typedef std::pair<size_t, uint32_t> Wide;
+
+  static bool Before(const Wide &w, size_t i) { return w.first < i; }
+
+  uint32_t WideSize(size_t i) const {
+    return std::lower_bound(_wide.begin(), _wide.end(), i, Before)->second;
+  }
+  /* Records are usually set in order, which appends */
+  void SetWide(size_t i, uint32_t size) {
+    if (_wide.empty() || _wide.back().first < i) {
+      _wide.push_back(Wide(i, size));
+      return;
+    }
+    std::vector<Wide>::iterator it =
+        std::lower_bound(_wide.begin(), _wide.end(), i, Before);
+    if (it->first == i) {
+      it->second = size;
+    } else {
+      _wide.insert(it, Wide(i, size));
+    }
+  }
+  void ClearWide(size_t i) {
+    std::vector<Wide>::iterator it =
+        std::lower_bound(_wide.begin(), _wide.end(), i, Before);
+    if (it != _wide.end() && it->first == i) _wide.erase(it);
+  }
+
+  std::vector<PACKED_MEMREF> _refs;
+  // Sizes of at least PACKED_SIZE_MAX, sorted by record number
+  std::vector<Wide> _wide;
+};
+
+class SoaChunk {
+ public:
+  size_t NumRecords() const { return _addr.size(); }
+  intptr_t Addr(size_t i) const { return _addr[i]; }
+  uint32_t Type(size_t i) const { return _type[i]; }
+  uint32_t Size(size_t i) const { return _size[i]; }
+
+  const intptr_t *AddrArray() const { return &_addr[0]; }
+  const uint8_t *TypeArray() const { return &_type[0]; }
+  const uint32_t *SizeArray() const { return &_size[0]; }
+
+  void Resize(size_t n) {
+    _addr.resize(n);
+    _type.resize(n);
+    _size.resize(n);
+  }
+  void Set(size_t i, intptr_t addr, uint32_t type, uint32_t size) {
+    _addr[i] = addr;
+    _type[i] = (uint8_t)type;
+    _size[i] = size;
+  }
+  void Assign(const MEMREF *refs, size_t n) {
+    Resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      Set(i, refs[i].addr, refs[i].type, refs[i].size);
+    }
+  }
+
+ private:
+  std::vector<intptr_t> _addr;
+  std::vector<uint8_t> _type;
+  std::vector<uint32_t> _size;
+};
+
+/*
+ * Calls v.Read(addr, size), v.Write(addr, size), v.Call(addr, id) or
+ * v.Ret(addr, id) for every record of the chunk, in order. Allocation
+ * records are skipped.
+ */
+template <class Chunk, class Visitor>
+static inline void VisitRecords(const Chunk &chunk, Visitor &v) {
+  size_t n = chunk.NumRecords();
+  for (size_t i = 0; i < n; ++i) {
+    switch (chunk.Type(i)) {
+      case TRACE_READ:
+        v.Read(chunk.Addr(i), chunk.Size(i));
+        break;
+      case TRACE_WRITE:
+        v.Write(chunk.Addr(i), chunk.Size(i));
+        break;
+      case TRACE_FUNC_CALL:
+        v.Call(chunk.Addr(i), chunk.Size(i));
+        break;
+      case TRACE_FUNC_RET:
+        v.Ret(chunk.Addr(i), chunk.Size(i));
+        break;
+    }
+  }
+}
+
+/* Sum of the sizes of the records of the given type, without branches */
+template <class Chunk>
+static inline uint64_t SumSizes(const Chunk &chunk, uint32_t type) {
+  size_t n = chunk.NumRecords();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += (uint64_t)(chunk.Type(i) == type) * chunk.Size(i);
+  }
+  return sum;
+}
+
+template <>
+inline uint64_t SumSizes(const SoaChunk &chunk, uint32_t type) {
+  size_t n = chunk.NumRecords();
+  if (n == 0) return 0;
+  const uint8_t *types = chunk.TypeArray();
+  const uint32_t *sizes = chunk.SizeArray();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += sizes[i] & -(uint32_t)(types[i] == type);
+  }
+  return sum;
+}
+
+#endif /* RECORD_LAYOUT_H_ */
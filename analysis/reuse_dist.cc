@@ -0,0 +1,259 @@
+/*
+ * Computes the LRU stack (reuse) distance histogram of cache lines per
+ * invocation of the traced function, and the miss ratio curve of a
+ * fully associative LRU cache derived from it.
+ *
+ *   reuse_dist [-l LINE_SIZE] [-s SAMPLING_RATE] trace
+ *
+ * The distance of an access is the number of distinct lines accessed
+ * since the previous access to the same line. It is computed with a
+ * Fenwick tree over access times that marks the last access of every
+ * line, so each access costs O(log n).
+ *
+ * With -s, only lines whose hash falls below the rate are tracked
+ * (SHARDS). Distances and counts of the sampled lines are scaled by
+ * 1 / rate to estimate those of the full trace. Counts of a trace
+ * sampled by the tracer are scaled by the inverse of its sampled
+ * fraction as well; its distances are taken as they are.
+ */
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include "../common.h"
+#include "../addr_table.h"
+#include "mapped_trace.h"
+
+using namespace std;
+
+/* Histogram buckets: [0], [1], [2, 4), [4, 8), ... */
+#define NUM_BUCKETS (48)
+/* Smallest number of time slots in the Fenwick tree */
+#define MIN_TIME_SLOTS (1 << 20)
+/* Modulus of the SHARDS hash threshold */
+#define SHARDS_MODULUS (1 << 24)
+
+struct Histogram {
+  uint64_t buckets[NUM_BUCKETS];
+  uint64_t cold;
+  uint64_t accesses;
+};
+
+static int BucketOf(uint64_t d) {
+  return d == 0 ? 0 : 64 - __builtin_clzll(d);
+}
+
+/* Fenwick tree of 0/1 marks over time slots */
+class Fenwick {
+ public:
+  void Reset(size_t n) { _tree.assign(n + 1, 0); }
+  /*
+   * Zeroes the tree when only slots [0, n) were marked. A node above n
+   * that covers one of them also covers slot n - 1, so it is on the
+   * update path of that slot.
+   */
+  void Clear(size_t n) {
+    n = min(n, Size());
+    if (n == 0) return;
+    memset(&_tree[1], 0, n * sizeof(_tree[0]));
+    for (size_t i = n + (n & -n); i < _tree.size(); i += i & -i) _tree[i] = 0;
+  }
+  size_t Size() const { return _tree.empty() ? 0 : _tree.size() - 1; }
+  void Add(size_t i, int v) {
+    for (++i; i < _tree.size(); i += i & -i) _tree[i] += v;
+  }
+  /* Sum of slots [0, i] */
+  uint64_t Prefix(size_t i) const {
+    uint64_t s = 0;
+    for (++i; i > 0; i -= i & -i) s += _tree[i];
+    return s;
+  }
+
+ private:
+  vector<uint32_t> _tree;
+};
+
+class ReuseDistance {
+ public:
+  ReuseDistance(): _now(0) {
+    _tree.Reset(MIN_TIME_SLOTS);
+    Reset();
+  }
+
+  /* Starts a new invocation; costs the slots used by the last one */
+  void Reset() {
+    _last.Clear();
+    _tree.Clear(_now);
+    _now = 0;
+    memset(&_hist, 0, sizeof(_hist));
+  }
+
+  void Access(intptr_t line) {
+    if (_now == _tree.Size()) Compact();
+    uint64_t &last = _last[line];  // time of the last access + 1
+    ++_hist.accesses;
+    if (last == 0) {
+      ++_hist.cold;
+    } else {
+      uint64_t d = _last.Size() - _tree.Prefix(last - 1);
+      ++_hist.buckets[BucketOf(d)];
+      _tree.Add(last - 1, -1);
+    }
+    _tree.Add(_now, 1);
+    last = ++_now;
+  }
+
+  const Histogram &Hist() const { return _hist; }
+
+ private:
+  /* Renumbers the last access times of all lines to 0, 1, ... */
+  void Compact() {
+    vector<pair<uint64_t, size_t> > order;
+    for (size_t i = 0; i < _last.Capacity(); ++i) {
+      if (_last.Used(i)) order.push_back(make_pair(_last.Value(i), i));
+    }
+    sort(order.begin(), order.end());
+    _tree.Reset(max<size_t>(MIN_TIME_SLOTS, order.size() * 2));
+    for (size_t t = 0; t < order.size(); ++t) {
+      _last.Value(order[t].second) = t + 1;
+      _tree.Add(t, 1);
+    }
+    _now = order.size();
+  }
+
+  AddrTable<uint64_t> _last;
+  Fenwick _tree;
+  uint64_t _now;
+  Histogram _hist;
+};
+
+static void AddHistogram(Histogram &to, const Histogram &from) {
+  for (int b = 0; b < NUM_BUCKETS; ++b) to.buckets[b] += from.buckets[b];
+  to.cold += from.cold;
+  to.accesses += from.accesses;
+}
+
+/*
+ * Prints the histogram and the miss ratio of LRU caches of every power
+ * of two lines. Sampled distances and counts are scaled by 1 / rate.
+ */
+static void PrintHistogram(const Histogram &h, double rate,
+                           double trace_scale, size_t line_size) {
+  double scale = 1.0 / rate;
+  double count_scale = scale * trace_scale;
+  printf("  accesses %.0f cold %.0f\n", h.accesses * count_scale,
+         h.cold * count_scale);
+  printf("  %-24s %s\n", "distance", "count");
+  int last = 0;
+  for (int b = 0; b < NUM_BUCKETS; ++b) {
+    if (h.buckets[b]) last = b;
+  }
+  for (int b = 0; b <= last; ++b) {
+    uint64_t lo = b == 0 ? 0 : 1ULL << (b - 1);
+    uint64_t hi = b == 0 ? 1 : 1ULL << b;
+    char range[64];
+    snprintf(range, sizeof(range), "[%.0f, %.0f)", lo * scale, hi * scale);
+    printf("  %-24s %.0f\n", range, h.buckets[b] * count_scale);
+  }
+  printf("  %-16s %-16s %s\n", "cache lines", "cache bytes", "miss ratio");
+  // A cache of c lines hits the accesses with distance below c. Bucket b
+  // holds distances below 2^b, scaled by 1 / rate.
+  uint64_t hits = 0;
+  for (int b = 0; b <= last + 1 && b < NUM_BUCKETS; ++b) {
+    double lines = (double)(1ULL << b) * scale;
+    hits += h.buckets[b];
+    printf("  %-16.0f %-16.0f %.4f\n", lines, lines * line_size,
+           h.accesses ? 1.0 - (double)hits / h.accesses : 0.0);
+  }
+}
+
+bool reuse(const char *path, size_t line_size, double rate) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  int line_shift = __builtin_ctzl(line_size);
+  uint64_t threshold = (uint64_t)(rate * SHARDS_MODULUS);
+  double trace_scale = SampleScale(trace.Header());
+
+  ReuseDistance rd;
+  Histogram total;
+  memset(&total, 0, sizeof(total));
+  size_t depth = 0;
+  size_t invocation = 0;
+
+  OrderedChunkReader reader(trace);
+  MemrefSpan buf;
+  size_t count = 0;
+  while (reader.Next(&buf)) {
+    for (size_t i = 0; i < buf.size; ++i) {
+      const MEMREF &mr = buf.data[i];
+      if (mr.type == TRACE_FUNC_CALL) {
+        if (depth++ == 0) rd.Reset();
+      } else if (mr.type == TRACE_FUNC_RET) {
+        if (depth == 0) continue;
+        if (--depth == 0) {
+          printf("Invocation %zu:\n", invocation++);
+          PrintHistogram(rd.Hist(), rate, trace_scale, line_size);
+          AddHistogram(total, rd.Hist());
+        }
+      } else if (depth > 0 &&
+                 (mr.type == TRACE_READ || mr.type == TRACE_WRITE)) {
+        uint64_t first = (uint64_t)mr.addr >> line_shift;
+        uint64_t last = ((uint64_t)mr.addr + (mr.size ? mr.size - 1 : 0))
+            >> line_shift;
+        for (uint64_t line = first; line <= last; ++line) {
+          if (threshold < SHARDS_MODULUS &&
+              (HashAddr(line) & (SHARDS_MODULUS - 1)) >= threshold) {
+            continue;
+          }
+          rd.Access((intptr_t)line);
+        }
+      }
+    }
+    count += buf.size;
+  }
+  if (reader.Error()) return false;
+  if (depth > 0) {
+    cerr << "WARNING! Trace ends within an invocation; it is not reported"
+         << endl;
+  }
+
+  cout << "Number of processed trace entries: " << count << endl;
+  cout << "Number of invocations: " << invocation << endl;
+  printf("Total:\n");
+  PrintHistogram(total, rate, trace_scale, line_size);
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-l LINE_SIZE] [-s SAMPLING_RATE] trace"
+       << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t line_size = 64;
+  double rate = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:s:h")) != -1) {
+    switch (opt) {
+      case 'l':
+        line_size = strtoul(optarg, NULL, 10);
+        break;
+      case 's':
+        rate = strtod(optarg, NULL);
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || line_size == 0 || (line_size & (line_size - 1)) ||
+      !(rate > 0 && rate <= 1)) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!reuse(argv[optind], line_size, rate)) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
@@ -1,56 +1,191 @@
+/*
+ * Checks that the calls and returns of a trace nest properly.
+ *
+ *   sanity_check [-q] trace
+ *
+ * The chunks of the trace are checked in parallel. Each chunk reduces to
+ * a summary per thread of the returns it could not match, followed by
+ * the calls it left open. Summaries of neighboring ranges combine thread
+ * by thread, matching the open calls of the left one with the unmatched
+ * returns of the right one, so they are merged pairwise in a parallel
+ * tree. Calls and returns only pair within a thread, so merged traces of
+ * several threads check as each thread would alone. Returns stay in
+ * trace order in every summary, so the first mismatch of the trace is
+ * the one with the smallest record number, wherever it was found.
+ *
+ * Unless -q is given, every call and return is printed in order.
+ */
 #include <iostream>
-#include <stack>
+#include <map>
+#include <vector>
 #include <cstdio>
 #include <cstdlib>
+#include <unistd.h>
 #include "../common.h"
+#include "../trace_format.h"
+#include "mapped_trace.h"
 
 using namespace std;
 
-#define BUF_LEN (1024)
-
-bool validate(char *path) {
-  size_t count = 0;
-  MEMREF *buf = new MEMREF[BUF_LEN];
-  FILE *fp = fopen(path, "rb");
-  size_t nelm = 0;
-  stack<intptr_t> call_stack;
-  
-  while ((nelm = fread(buf, sizeof(MEMREF), BUF_LEN, fp)) > 0) {
-    for (size_t i = 0; i < nelm; ++i) {
-      const MEMREF &mr = buf[i];
-      if (mr.type == TRACE_FUNC_CALL) {
-        call_stack.push(mr.addr);
-        cerr << "Call to " << mr.addr << endl;
-      } else if (mr.type == TRACE_FUNC_RET) {
-        // check the top of the stack matches the ret entry
-        if (call_stack.size() == 0) {
-          cout << "ERROR! No call for return ("
-               << mr.addr << ")" << endl;
-          cout << "Number of processed trace entries: " << count << endl;
-          return false;
+#define NO_ERROR (~(uint64_t)0)
+
+struct Marker {
+  uint64_t record;
+  intptr_t addr;
+};
+
+/*
+ * The first mismatch found in a range, if error_record != NO_ERROR.
+ * call_addr is 0 for a return without a call.
+ */
+struct Mismatch {
+  uint64_t error_record;
+  intptr_t call_addr;
+  intptr_t ret_addr;
+};
+
+/* Unmatched returns and open calls of one thread in a range */
+struct ThreadSummary {
+  std::vector<Marker> rets;
+  std::vector<Marker> calls;
+};
+
+struct Summary {
+  Summary() {
+    first.error_record = NO_ERROR;
+    first.call_addr = first.ret_addr = 0;
+  }
+  std::map<uint32_t, ThreadSummary> threads;
+  Mismatch first;
+};
+
+static void NoteMismatch(Mismatch &m, uint64_t record, intptr_t call_addr,
+                         intptr_t ret_addr) {
+  if (record >= m.error_record) return;
+  m.error_record = record;
+  m.call_addr = call_addr;
+  m.ret_addr = ret_addr;
+}
+
+/* Matches ret against the open calls of t, or keeps it unmatched */
+static void AddReturn(ThreadSummary &t, Mismatch &first, const Marker &ret) {
+  if (t.calls.empty()) {
+    t.rets.push_back(ret);
+    return;
+  }
+  // A mismatched pair is still consumed, so that later pairs line up
+  // as they would after the mismatch in a sequential check
+  if (t.calls.back().addr != ret.addr) {
+    NoteMismatch(first, ret.record, t.calls.back().addr, ret.addr);
+  }
+  t.calls.pop_back();
+}
+
+/* Appends the summary of the range right after left to left */
+static void Combine(Summary &left, Summary &right) {
+  for (map<uint32_t, ThreadSummary>::iterator it = right.threads.begin();
+       it != right.threads.end(); ++it) {
+    ThreadSummary &l = left.threads[it->first];
+    const ThreadSummary &r = it->second;
+    for (size_t i = 0; i < r.rets.size(); ++i) {
+      AddReturn(l, left.first, r.rets[i]);
+    }
+    l.calls.insert(l.calls.end(), r.calls.begin(), r.calls.end());
+  }
+  NoteMismatch(left.first, right.first.error_record, right.first.call_addr,
+               right.first.ret_addr);
+  map<uint32_t, ThreadSummary>().swap(right.threads);
+}
+
+bool validate(const char *path, bool quiet) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  size_t num_chunks = trace.NumChunks();
+  vector<Summary> summaries(num_chunks);
+  // Markers of every chunk in order, for printing
+  vector<vector<MEMREF> > markers(quiet ? 0 : num_chunks);
+  bool ok = true;
+
+#pragma omp parallel reduction(&&:ok)
+  {
+    ChunkScratch scratch;
+    MemrefSpan buf;
+#pragma omp for schedule(dynamic)
+    for (size_t c = 0; c < num_chunks; ++c) {
+      Summary &s = summaries[c];
+      if (!trace.GetChunk(c, scratch, &buf)) {
+        ok = false;
+        continue;
+      }
+      uint64_t base = trace.ChunkFirstRecord(c);
+      for (size_t i = 0; i < buf.size; ++i) {
+        const MEMREF &mr = buf.data[i];
+        if (!IsMarkerType(mr.type)) continue;
+        Marker m = { base + i, mr.addr };
+        ThreadSummary &t = s.threads[buf.tid ? buf.tid[i] : 0];
+        if (mr.type == TRACE_FUNC_CALL) {
+          t.calls.push_back(m);
+        } else {
+          AddReturn(t, s.first, m);
         }
-        intptr_t call_addr = call_stack.top();
-        if (call_addr != mr.addr) {
-          cout << "ERROR! Call (" << call_addr
-               << ") and return (" << mr.addr << ") do not match."
-               << endl;
-          cout << "Number of processed trace entries: " << count << endl;
-          return false;
+        if (!quiet) markers[c].push_back(mr);
+      }
+    }
+  }
+  if (!ok) return false;
+
+  for (size_t stride = 1; stride < num_chunks; stride *= 2) {
+#pragma omp parallel for schedule(dynamic)
+    for (size_t c = 0; c < num_chunks - stride; c += 2 * stride) {
+      Combine(summaries[c], summaries[c + stride]);
+    }
+  }
+
+  Summary total;
+  if (num_chunks > 0) swap(total, summaries[0]);
+  // Returns left unmatched at the level of the whole trace have no call
+  bool missing = false;
+  for (map<uint32_t, ThreadSummary>::iterator it = total.threads.begin();
+       it != total.threads.end(); ++it) {
+    const ThreadSummary &t = it->second;
+    if (!t.rets.empty()) {
+      NoteMismatch(total.first, t.rets[0].record, 0, t.rets[0].addr);
+    }
+    missing = missing || !t.calls.empty();
+  }
+  uint64_t count = min<uint64_t>(total.first.error_record, trace.NumRecords());
+
+  if (!quiet) {
+    for (size_t c = 0; c < markers.size(); ++c) {
+      for (size_t i = 0; i < markers[c].size(); ++i) {
+        const MEMREF &mr = markers[c][i];
+        if (mr.type == TRACE_FUNC_CALL) {
+          cerr << "Call to " << mr.addr << endl;
+        } else {
+          cerr << "Return from " << mr.addr << endl;
         }
-        call_stack.pop();
-        cerr << "Return from " << mr.addr << endl;
-      } else {
-        // No check for memory reads and writes
       }
-      ++count;      
     }
   }
-  
-  if (call_stack.size() != 0) {
+
+  if (total.first.error_record != NO_ERROR) {
+    if (total.first.call_addr == 0) {
+      cout << "ERROR! No call for return ("
+           << total.first.ret_addr << ")" << endl;
+    } else {
+      cout << "ERROR! Call (" << total.first.call_addr
+           << ") and return (" << total.first.ret_addr << ") do not match."
+           << endl;
+    }
+    cout << "Number of processed trace entries: " << count << endl;
+    return false;
+  }
+  if (missing) {
     cout << "ERROR! Missing return for call: ";
-    while (call_stack.size() > 0) {
-      cout << call_stack.top() << " ";
-      call_stack.pop();
+    for (map<uint32_t, ThreadSummary>::iterator it = total.threads.begin();
+         it != total.threads.end(); ++it) {
+      const vector<Marker> &calls = it->second.calls;
+      for (size_t i = calls.size(); i-- > 0;) cout << calls[i].addr << " ";
     }
     cout << endl;
     cout << "Number of processed trace entries: " << count << endl;
@@ -61,9 +196,27 @@ bool validate(char *path) {
   return true;
 }
 
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-q] trace" << endl;
+}
+
 int main(int argc, char *argv[]) {
-  char *file_path = argv[1];
-  if (!validate(file_path)) return EXIT_FAILURE;
+  bool quiet = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "qh")) != -1) {
+    switch (opt) {
+      case 'q':
+        quiet = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!validate(argv[optind], quiet)) return EXIT_FAILURE;
   return EXIT_SUCCESS;
 }
-
@@ -1,71 +1,358 @@
+/*
+ * Extracts the memory accesses of invocations of the traced functions
+ * into traces of their own.
+ *
+ *   scale_extract [-i INDEX] [-n FIRST[-LAST]] [-r] trace output
+ *
+ * Invocations are numbered from 0 in the order of their calls. Without
+ * -n, the first invocation that does not start the trace is extracted
+ * into output. With -n, invocation FIRST, or FIRST to LAST, are
+ * extracted in parallel into output.N. The accesses between the call
+ * and its matching return are written, those of nested calls included;
+ * calls and returns are not. In a trace with thread ids, calls pair with
+ * returns of their own thread, and only that thread's accesses are
+ * written. (Extraction used to stop at the first
+ * return of any kind, which cut an invocation short at the return of
+ * its first nested call.)
+ *
+ * The extractor seeks to the invocations through the invocation index
+ * (invocation_index.h), read from INDEX (trace.idx by default) or built
+ * and saved there. Outputs are written under a temporary name and
+ * renamed when complete; with -r, invocations whose output exists are
+ * skipped, so an interrupted run can be restarted.
+ *
+ * A trace streamed by the tracer (trace_stream.h: a named pipe, unix:PATH
+ * or - for standard input) has no index; its invocations are extracted
+ * in one pass as the records arrive.
+ */
 #include <iostream>
-#include <stack>
+#include <map>
+#include <string>
+#include <vector>
 #include <cstdio>
 #include <cstdlib>
-#include <cassert>
+#include <cstring>
+#include <unistd.h>
 #include "../common.h"
+#include "../trace_format.h"
+#include "mapped_trace.h"
+#include "invocation_index.h"
+#include "trace_stream.h"
 
 using namespace std;
 
-#define BUF_LEN (1024)
-
-bool extract(char *input_path, char *output_path) {
-  size_t count = 0;
-  MEMREF *buf = new MEMREF[BUF_LEN];
-  FILE *fp = fopen(input_path, "rb");
-  FILE *out = fopen(output_path, "wb");  
-  size_t nelm = 0;
-  stack<intptr_t> call_stack;
-  bool in_extraction = false;
-
-    
-  while ((nelm = fread(buf, sizeof(MEMREF), BUF_LEN, fp)) > 0) {
-    for (size_t i = 0; i < nelm; ++i) {
-      const MEMREF &mr = buf[i];
+/*
+ * Trace of one extracted invocation, written under a temporary name and
+ * renamed by Finish() when complete.
+ */
+class InvocationOutput {
+ public:
+  InvocationOutput(): _out(NULL), _count(0) {}
+
+  bool Open(const string &path, const TraceFileHeader &header) {
+    _path = path;
+    _tmp_path = path + ".tmp";
+    _out = fopen(_tmp_path.c_str(), "wb");
+    // Keep the timestamps, thread ids and instruction ids of the input
+    uint32_t fields = header.flags &
+        (TRACE_HAS_TIMESTAMP | TRACE_HAS_THREAD | TRACE_HAS_PC);
+    if (!_out || !_writer.Open(_out, true, fields, &header.sampling)) {
+      cerr << "ERROR! Cannot write " << path << endl;
+      if (_out) fclose(_out);
+      _out = NULL;
+      return false;
+    }
+    return true;
+  }
+
+  /* Appends record i of buf */
+  bool Append(const MemrefSpan &buf, size_t i) {
+    if (!_writer.Append(buf.data[i], buf.ts ? buf.ts[i] : 0,
+                        buf.tid ? buf.tid[i] : 0, buf.pc ? buf.pc[i] : 0)) {
+      cerr << "ERROR! Cannot write " << _path << endl;
+      return false;
+    }
+    ++_count;
+    return true;
+  }
+
+  /* Completes the output if ok, and removes it otherwise */
+  bool Finish(bool ok) {
+    if (ok && !_writer.Flush()) {
+      cerr << "ERROR! Cannot write " << _path << endl;
+      ok = false;
+    }
+    if (fclose(_out) != 0) ok = false;
+    _out = NULL;
+    if (ok && rename(_tmp_path.c_str(), _path.c_str()) != 0) {
+      cerr << "ERROR! Cannot rename " << _tmp_path << endl;
+      ok = false;
+    }
+    if (!ok) {
+      remove(_tmp_path.c_str());
+      return false;
+    }
+    cerr << "Extracted " << _count << " trace entries into " << _path
+         << endl;
+    return true;
+  }
+
+ private:
+  FILE *_out;
+  TraceWriter _writer;
+  string _path;
+  string _tmp_path;
+  size_t _count;
+};
+
+/* Writes the accesses of invocation e of trace to output_path */
+bool extract(const MappedTrace &trace, const InvocationEntry &e,
+             const string &output_path) {
+  if (e.ret_record == INDEX_NO_RETURN) {
+    cerr << "ERROR! No terminating return found." << endl;
+    return false;
+  }
+  InvocationOutput output;
+  if (!output.Open(output_path, trace.Header())) return false;
+  ChunkScratch scratch;
+  MemrefSpan buf;
+  size_t first = trace.ChunkOfRecord(e.call_record);
+  size_t last = trace.ChunkOfRecord(e.ret_record);
+  bool ok = true;
+  for (size_t chunk = first; ok && chunk <= last; ++chunk) {
+    if (!trace.GetChunk(chunk, scratch, &buf)) {
+      ok = false;
+      break;
+    }
+    uint64_t base = trace.ChunkFirstRecord(chunk);
+    size_t begin = chunk == first ? e.call_record - base + 1 : 0;
+    size_t end = chunk == last ? e.ret_record - base : buf.size;
+    for (size_t i = begin; i < end; ++i) {
+      if (IsMarkerType(buf.data[i].type)) continue;
+      if (buf.tid && buf.tid[i] != e.tid) continue;
+      if (!output.Append(buf, i)) {
+        ok = false;
+        break;
+      }
+    }
+  }
+  return output.Finish(ok);
+}
+
+/* An invocation being extracted from a stream */
+struct OpenInvocation {
+  size_t depth;  // calls on the stack of its thread, its own included
+  InvocationOutput *output;
+};
+
+/* The calls on the stack of a thread of a stream */
+struct StreamThread {
+  vector<intptr_t> calls;
+  vector<OpenInvocation> open;
+};
+
+/*
+ * Extracts invocations first to last of a stream (trace_stream.h) in
+ * one pass, without an index. Invocations are numbered as their calls
+ * arrive, and each thread of the stream has its own call stack. The
+ * records of an invocation go to its output while it is on the stack,
+ * so only the invocations open at a time hold a writer. With single,
+ * the first invocation that does not start the stream is written to
+ * output; otherwise invocation N is written to output.N.
+ */
+static bool ExtractStream(const char *input_path, unsigned long long first,
+                          unsigned long long last, bool single,
+                          const string &output_path, bool resume) {
+  TraceStream stream;
+  if (!stream.Open(input_path)) return false;
+  StreamChunkReader reader(stream);
+  map<uint32_t, StreamThread> threads;
+  uint32_t tid = 0;
+  StreamThread *t = &threads[tid];
+  unsigned long long next = 0;
+  size_t num_open = 0;
+  uint64_t record = 0;
+  bool ok = true;
+  MemrefSpan buf;
+  while (ok && (next <= last || num_open > 0) && reader.Next(&buf)) {
+    for (size_t i = 0; ok && i < buf.size; ++i, ++record) {
+      const MEMREF &mr = buf.data[i];
+      if (buf.tid && buf.tid[i] != tid) {
+        tid = buf.tid[i];
+        t = &threads[tid];
+      }
       if (mr.type == TRACE_FUNC_CALL) {
-        call_stack.push(mr.addr);
-        if (count > 0) in_extraction = true;
+        if (single && record == 0) first = last = 1;
+        unsigned long long n = next++;
+        t->calls.push_back(mr.addr);
+        if (n < first || n > last) continue;
+        string path = output_path;
+        if (!single) {
+          char suffix[32];
+          snprintf(suffix, sizeof(suffix), ".%llu", n);
+          path += suffix;
+        }
+        if (resume && access(path.c_str(), F_OK) == 0) continue;
+        OpenInvocation o = { t->calls.size(), new InvocationOutput() };
+        if (!o.output->Open(path, stream.Header())) {
+          delete o.output;
+          ok = false;
+          break;
+        }
+        t->open.push_back(o);
+        ++num_open;
       } else if (mr.type == TRACE_FUNC_RET) {
-        // check the top of the stack matches the ret entry
-        if (call_stack.size() == 0) {
-          cerr << "ERROR! No call for return ("
-               << mr.addr << ")" << endl;
-          cerr << "Number of processed trace entries: " << count << endl;
-          return false;
+        if (t->calls.empty()) {
+          cerr << "ERROR! No call for return (" << mr.addr << ") at record "
+               << record << endl;
+          ok = false;
+          break;
         }
-        intptr_t call_addr = call_stack.top();
-        if (call_addr != mr.addr) {
-          cerr << "ERROR! Call (" << call_addr
-               << ") and return (" << mr.addr << ") do not match."
-               << endl;
-          cerr << "Number of processed trace entries: " << count << endl;
-          return false;
+        if (t->calls.back() != mr.addr) {
+          cerr << "ERROR! Call (" << t->calls.back() << ") and return ("
+               << mr.addr << ") do not match at record " << record << endl;
+          ok = false;
+          break;
         }
-        call_stack.pop();
-        if (in_extraction) {
-          // Done
-          fclose(out);
-          cout << "Extraction success." << endl;
-          return true;
+        if (!t->open.empty() && t->open.back().depth == t->calls.size()) {
+          ok = t->open.back().output->Finish(true) && ok;
+          delete t->open.back().output;
+          t->open.pop_back();
+          --num_open;
         }
+        t->calls.pop_back();
       } else {
-        if (in_extraction) {
-          assert(fwrite(&mr, sizeof(MEMREF), 1, out) == 1);
+        for (size_t k = 0; k < t->open.size(); ++k) {
+          ok = t->open[k].output->Append(buf, i) && ok;
         }
       }
-      ++count;      
     }
   }
+  // Read the rest, so that the tracer is not stopped by a closed stream
+  StreamBlock block;
+  while (ok && stream.Next(&block)) continue;
+  if (reader.Error()) ok = false;
 
-  // SHOULD NOT REACH HERE
-  cerr << "ERROR! No terminating return found." << endl;
-  return false;
+  for (map<uint32_t, StreamThread>::iterator it = threads.begin();
+       it != threads.end(); ++it) {
+    vector<OpenInvocation> &open = it->second.open;
+    for (size_t k = 0; k < open.size(); ++k) {
+      if (ok) cerr << "ERROR! No terminating return found." << endl;
+      open[k].output->Finish(false);
+      delete open[k].output;
+      ok = false;
+    }
+  }
+  if (ok && next <= last) {
+    if (single) {
+      cerr << "ERROR! No invocation to extract." << endl;
+    } else {
+      cerr << "ERROR! The trace has " << next << " invocations" << endl;
+    }
+    ok = false;
+  }
+  return ok;
+}
+
+/* Loads the index at index_path, or builds and saves it */
+static bool GetIndex(const MappedTrace &trace, const string &index_path,
+                     vector<InvocationEntry> *entries) {
+  if (LoadInvocationIndex(index_path.c_str(), trace, entries)) return true;
+  if (!BuildInvocationIndex(trace, entries)) return false;
+  if (!SaveInvocationIndex(index_path.c_str(), trace, *entries)) {
+    cerr << "WARNING! Cannot write index " << index_path << endl;
+  }
+  cerr << "Indexed " << entries->size() << " invocations" << endl;
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-i INDEX] [-n FIRST[-LAST]] [-r] trace output"
+       << endl;
 }
 
 int main(int argc, char *argv[]) {
-  char *input_path = argv[1];
-  char *output_path = argv[2];  
-  if (!extract(input_path, output_path)) return EXIT_FAILURE;
+  const char *index_arg = NULL;
+  const char *range_arg = NULL;
+  bool resume = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:n:rh")) != -1) {
+    switch (opt) {
+      case 'i':
+        index_arg = optarg;
+        break;
+      case 'n':
+        range_arg = optarg;
+        break;
+      case 'r':
+        resume = true;
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 2) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  char *input_path = argv[optind];
+  string output_path = argv[optind + 1];
+  string index_path = index_arg ? index_arg : string(input_path) + ".idx";
+
+  unsigned long long first = 0;
+  unsigned long long last = 0;
+  if (range_arg) {
+    char *end;
+    first = strtoull(range_arg, &end, 10);
+    last = *end == '-' ? strtoull(end + 1, &end, 10) : first;
+    if (*end || last < first) {
+      Usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (IsTraceStream(input_path)) {
+    if (index_arg) cerr << "WARNING! A stream has no index; -i is ignored" << endl;
+    if (!ExtractStream(input_path, first, last, !range_arg, output_path,
+                       resume)) {
+      return EXIT_FAILURE;
+    }
+    cout << "Extraction success." << endl;
+    return EXIT_SUCCESS;
+  }
+
+  MappedTrace trace;
+  if (!trace.Open(input_path)) return EXIT_FAILURE;
+  vector<InvocationEntry> entries;
+  if (!GetIndex(trace, index_path, &entries)) return EXIT_FAILURE;
+
+  if (!range_arg) {
+    for (size_t k = 0; k < entries.size(); ++k) {
+      if (entries[k].call_record == 0) continue;
+      if (!extract(trace, entries[k], output_path)) return EXIT_FAILURE;
+      cout << "Extraction success." << endl;
+      return EXIT_SUCCESS;
+    }
+    cerr << "ERROR! No invocation to extract." << endl;
+    return EXIT_FAILURE;
+  }
+
+  if (last >= entries.size()) {
+    cerr << "ERROR! The trace has " << entries.size() << " invocations"
+         << endl;
+    return EXIT_FAILURE;
+  }
+  bool ok = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+  for (long long k = (long long)first; k <= (long long)last; ++k) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%lld", k);
+    string path = output_path + suffix;
+    if (resume && access(path.c_str(), F_OK) == 0) continue;
+    ok = extract(trace, entries[k], path) && ok;
+  }
+  if (!ok) return EXIT_FAILURE;
+  cout << "Extraction success." << endl;
   return EXIT_SUCCESS;
 }
-
@@ -0,0 +1,305 @@
+/*
+ * Finds the cache lines shared between the threads of a run, and the
+ * lines that are falsely shared.
+ *
+ *   sharing [-l LINE_SIZE] [-n TOP] trace...
+ *
+ * The traces are the per-thread traces of a run (pin.out.PID.TID, the
+ * thread taken from the TID suffix), or a merged trace whose records
+ * carry their thread. Each access marks the bytes [addr, addr + size)
+ * of the lines it covers as read or written by its thread.
+ *
+ * A line accessed by several threads is
+ *
+ *   - truly shared if a thread writes bytes that another thread reads or
+ *     writes,
+ *   - falsely shared if a thread writes the line and another thread
+ *     accesses it, but the two touch disjoint bytes: the line moves
+ *     between their caches although they share no data,
+ *   - both, if it has pairs of threads of each kind,
+ *   - read shared otherwise.
+ *
+ * The TOP (20 by default) falsely and truly shared lines with the most
+ * accesses are listed with a map of their bytes: one character per
+ * byte, the letter of the thread that touched it, in upper case if it
+ * was written, or '*' if several threads did. Sharing is found over the
+ * whole run; whether the threads touched the line at the same time is
+ * not checked.
+ *
+ * Traces are aggregated in parallel, each into private per-thread
+ * tables that are then published into a LineOwnerMap.
+ */
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <omp.h>
+#include "../common.h"
+#include "../addr_table.h"
+#include "mapped_trace.h"
+#include "line_owner_map.h"
+
+using namespace std;
+
+#define MAX_LINE_SIZE (64)
+
+enum {
+  LINE_PRIVATE = 0,
+  LINE_READ_SHARED,
+  LINE_TRUE_SHARED,
+  LINE_FALSE_SHARED,
+  LINE_BOTH_SHARED,
+  NUM_LINE_KINDS
+};
+
+static const char *kind_names[NUM_LINE_KINDS] = {
+  "private", "read shared", "truly shared", "falsely shared", "both"
+};
+
+/* Bits of the bytes [begin, end) of a line */
+static inline uint64_t ByteMask(size_t begin, size_t end) {
+  uint64_t below_end = end >= 64 ? ~0ULL : (1ULL << end) - 1;
+  return below_end & ~((1ULL << begin) - 1);
+}
+
+/* Aggregates one trace and publishes its threads into owners */
+static bool AggregateTrace(const char *path, uint32_t file_tid,
+                           int line_shift, LineOwnerMap *owners,
+                           vector<uint32_t> *tids) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  size_t line_size = (size_t)1 << line_shift;
+  map<uint32_t, AddrTable<Sharer> *> threads;
+  ChunkScratch scratch;
+  MemrefSpan buf;
+  bool ok = true;
+  for (size_t c = 0; ok && c < trace.NumChunks(); ++c) {
+    if (!trace.GetChunk(c, scratch, &buf)) {
+      ok = false;
+      break;
+    }
+    for (size_t i = 0; i < buf.size; ++i) {
+      const MEMREF &mr = buf.data[i];
+      if (mr.type != TRACE_READ && mr.type != TRACE_WRITE) continue;
+      uint32_t tid = buf.tid ? buf.tid[i] : file_tid;
+      AddrTable<Sharer> *&lines = threads[tid];
+      if (!lines) lines = new AddrTable<Sharer>();
+      bool write = mr.type == TRACE_WRITE;
+      uint64_t addr = (uint64_t)mr.addr;
+      uint64_t end = addr + (mr.size ? mr.size : 1);
+      while (addr < end) {
+        uint64_t line = addr >> line_shift;
+        size_t begin = addr & (line_size - 1);
+        size_t stop = min<uint64_t>(end - (line << line_shift), line_size);
+        Sharer &s = (*lines)[(intptr_t)line];
+        s.thread = tid;
+        if (write) {
+          s.write_mask |= ByteMask(begin, stop);
+          ++s.writes;
+        } else {
+          s.read_mask |= ByteMask(begin, stop);
+          ++s.reads;
+        }
+        addr = (line + 1) << line_shift;
+      }
+    }
+  }
+  for (map<uint32_t, AddrTable<Sharer> *>::iterator it = threads.begin();
+       it != threads.end(); ++it) {
+    if (ok) owners->Publish(*it->second);
+    delete it->second;
+#pragma omp critical(sharing_tids)
+    tids->push_back(it->first);
+  }
+  return ok;
+}
+
+/* Kind of a line from its sharers */
+static int Classify(const vector<Sharer> &sharers) {
+  if (sharers.size() == 1) return LINE_PRIVATE;
+  bool truly = false;
+  bool falsely = false;
+  for (size_t i = 0; i < sharers.size(); ++i) {
+    const Sharer &a = sharers[i];
+    for (size_t j = i + 1; j < sharers.size(); ++j) {
+      const Sharer &b = sharers[j];
+      if (!a.write_mask && !b.write_mask) continue;
+      uint64_t a_bytes = a.read_mask | a.write_mask;
+      uint64_t b_bytes = b.read_mask | b.write_mask;
+      if ((a.write_mask & b_bytes) || (b.write_mask & a_bytes)) {
+        truly = true;
+      } else {
+        falsely = true;
+      }
+    }
+  }
+  if (truly && falsely) return LINE_BOTH_SHARED;
+  if (truly) return LINE_TRUE_SHARED;
+  if (falsely) return LINE_FALSE_SHARED;
+  return LINE_READ_SHARED;
+}
+
+struct SharedLine {
+  intptr_t line;
+  uint64_t accesses;
+  uint64_t writes;
+  int kind;
+  vector<Sharer> sharers;
+};
+
+/* Orders lines by decreasing accesses */
+struct ByAccesses {
+  bool operator()(const SharedLine &a, const SharedLine &b) const {
+    if (a.accesses != b.accesses) return a.accesses > b.accesses;
+    return a.line < b.line;
+  }
+};
+
+/* Keeps the top lines with the most accesses, as a heap */
+static void KeepTop(vector<SharedLine> &top, size_t n, SharedLine &line) {
+  if (n == 0) return;
+  if (top.size() == n) {
+    if (!ByAccesses()(line, top.front())) return;
+    pop_heap(top.begin(), top.end(), ByAccesses());
+    top.pop_back();
+  }
+  top.push_back(SharedLine());
+  swap(top.back(), line);
+  push_heap(top.begin(), top.end(), ByAccesses());
+}
+
+/* The bytes of a line, by thread */
+static string ByteMap(const SharedLine &l, size_t line_size,
+                      const map<uint32_t, size_t> &letters) {
+  string bytes(line_size, '.');
+  for (size_t k = 0; k < l.sharers.size(); ++k) {
+    const Sharer &s = l.sharers[k];
+    size_t index = letters.find(s.thread)->second;
+    char letter = index < 26 ? (char)('a' + index) : '?';
+    for (size_t b = 0; b < line_size; ++b) {
+      uint64_t bit = 1ULL << b;
+      if (!((s.read_mask | s.write_mask) & bit)) continue;
+      if (bytes[b] != '.') {
+        bytes[b] = '*';
+      } else {
+        bytes[b] = (s.write_mask & bit) ? letter - 'a' + 'A' : letter;
+      }
+    }
+  }
+  return bytes;
+}
+
+static void PrintLines(const char *title, vector<SharedLine> &lines,
+                       int line_shift, const map<uint32_t, size_t> &letters) {
+  if (lines.empty()) return;
+  sort(lines.begin(), lines.end(), ByAccesses());
+  cout << endl << title << ":" << endl;
+  printf("%18s %-14s %8s %12s %12s  %s\n", "line", "kind", "threads",
+         "accesses", "writes", "bytes");
+  for (size_t k = 0; k < lines.size(); ++k) {
+    const SharedLine &l = lines[k];
+    printf("%#18llx %-14s %8zu %12llu %12llu  %s\n",
+           (unsigned long long)((uint64_t)l.line << line_shift),
+           kind_names[l.kind], l.sharers.size(),
+           (unsigned long long)l.accesses, (unsigned long long)l.writes,
+           ByteMap(l, (size_t)1 << line_shift, letters).c_str());
+  }
+}
+
+bool sharing(char **paths, size_t num_inputs, int line_shift, size_t top) {
+  LineOwnerMap owners;
+  vector<uint32_t> tids;
+  bool ok = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+  for (size_t k = 0; k < num_inputs; ++k) {
+    ok = AggregateTrace(paths[k], ThreadOfPath(paths[k], (uint32_t)k),
+                        line_shift, &owners, &tids) && ok;
+  }
+  if (!ok) return false;
+  sort(tids.begin(), tids.end());
+  tids.erase(unique(tids.begin(), tids.end()), tids.end());
+  map<uint32_t, size_t> letters;
+  for (size_t t = 0; t < tids.size(); ++t) letters[tids[t]] = t;
+
+  uint64_t lines[NUM_LINE_KINDS] = {0};
+  uint64_t accesses[NUM_LINE_KINDS] = {0};
+  vector<SharedLine> top_false;
+  vector<SharedLine> top_true;
+  SharedLine l;
+  for (int s = 0; s < owners.NumShards(); ++s) {
+    const AddrTable<LineOwners> &table = owners.GetShard(s).lines;
+    for (size_t i = 0; i < table.Capacity(); ++i) {
+      if (!table.Used(i)) continue;
+      owners.Sharers(s, table.Value(i), &l.sharers);
+      l.line = table.Key(i);
+      l.accesses = 0;
+      l.writes = 0;
+      for (size_t k = 0; k < l.sharers.size(); ++k) {
+        l.accesses += l.sharers[k].reads + l.sharers[k].writes;
+        l.writes += l.sharers[k].writes;
+      }
+      l.kind = Classify(l.sharers);
+      ++lines[l.kind];
+      accesses[l.kind] += l.accesses;
+      if (l.kind == LINE_FALSE_SHARED || l.kind == LINE_BOTH_SHARED) {
+        KeepTop(top_false, top, l);
+      } else if (l.kind == LINE_TRUE_SHARED) {
+        KeepTop(top_true, top, l);
+      }
+    }
+  }
+
+  uint64_t total = 0;
+  for (int k = 0; k < NUM_LINE_KINDS; ++k) total += accesses[k];
+  cout << "Threads:";
+  for (size_t t = 0; t < tids.size(); ++t) {
+    cout << " " << (t < 26 ? (char)('a' + t) : '?') << "=" << tids[t];
+  }
+  cout << endl;
+  printf("Lines of %d bytes:\n", 1 << line_shift);
+  for (int k = 0; k < NUM_LINE_KINDS; ++k) {
+    printf("  %-14s %12llu lines %14llu accesses (%.4f)\n", kind_names[k],
+           (unsigned long long)lines[k], (unsigned long long)accesses[k],
+           total ? (double)accesses[k] / total : 0.0);
+  }
+  PrintLines("Falsely shared lines", top_false, line_shift, letters);
+  PrintLines("Truly shared lines", top_true, line_shift, letters);
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-l LINE_SIZE] [-n TOP] trace..." << endl;
+}
+
+int main(int argc, char *argv[]) {
+  size_t line_size = 64;
+  size_t top = 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "l:n:h")) != -1) {
+    switch (opt) {
+      case 'l':
+        line_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        top = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || line_size == 0 || line_size > MAX_LINE_SIZE ||
+      (line_size & (line_size - 1))) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!sharing(argv + optind, argc - optind, __builtin_ctzl(line_size), top)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,321 @@
+#ifndef TRACE_STREAM_H_
+#define TRACE_STREAM_H_
+
+/*
+ * Reader of a binary trace streamed by the tracer with -stream, for the
+ * analysis tools that process a trace while it is being recorded.
+ *
+ * A stream cannot be mapped or indexed, so blocks are read one at a
+ * time and handed out in order; memory stays bounded by the blocks in
+ * flight whatever the length of the trace. The path of a stream is
+ *
+ *   -            standard input
+ *   unix:PATH    a Unix domain socket the reader listens on at PATH,
+ *                which the tracer connects to
+ *   PATH         a named pipe, or any file
+ *
+ * Every block starts with TRACE_BLOCK_SYNC and carries a check of its
+ * header, which frames it: on a corrupt header, or a stream joined
+ * without its file header, the reader skips ahead to the next valid
+ * block header. A block whose payload does not decode is dropped whole.
+ * Skipped bytes and dropped blocks are reported.
+ *
+ * StreamChunkReader walks the blocks like OrderedChunkReader walks the
+ * chunks of a mapped trace, so sequential tools can take either.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "../common.h"
+#include "../trace_format.h"
+#include "mapped_trace.h"
+
+/* Size of the reads from the stream */
+#define STREAM_READ_SIZE (1 << 20)
+/* Largest block accepted; larger sizes in a header mean it is corrupt */
+#define STREAM_MAX_BLOCK (1U << 28)
+
+/* A block as read from the stream, not decoded yet */
+struct StreamBlock {
+  TraceBlockHeader header;
+  std::vector<uint8_t> payload;
+};
+
+/* Whether path is read as a stream rather than mapped */
+static inline bool IsTraceStream(const char *path) {
+  if (strcmp(path, "-") == 0 || strncmp(path, "unix:", 5) == 0) return true;
+  struct stat sb;
+  return stat(path, &sb) == 0 && !S_ISREG(sb.st_mode);
+}
+
+class TraceStream {
+ public:
+  TraceStream()
+      : _fd(-1), _begin(0), _end(0), _error(false), _skipped_bytes(0),
+        _dropped_blocks(0) {}
+  ~TraceStream() { Close(); }
+
+  bool Open(const char *path) {
+    if (strcmp(path, "-") == 0) {
+      _fd = dup(STDIN_FILENO);
+    } else if (strncmp(path, "unix:", 5) == 0) {
+      _fd = Accept(path + 5);
+    } else {
+      _fd = open(path, O_RDONLY);
+    }
+    if (_fd < 0) {
+      std::cerr << "ERROR! Cannot open " << path << std::endl;
+      return false;
+    }
+    _buf.resize(STREAM_READ_SIZE);
+    InitFileHeader(_header);
+    const size_t min_size = offsetof(TraceFileHeader, sampling);
+    if (!Fill(sizeof(TRACE_MAGIC) - 1) ||
+        !HasTraceMagic(&_buf[_begin], _end - _begin)) {
+      if (_error) return false;
+      std::cerr << "WARNING! The stream has no file header" << std::endl;
+      return true;
+    }
+    TraceFileHeader fh;
+    if (!Fill(min_size)) return Corrupt();
+    memcpy(&fh, &_buf[_begin], min_size);
+    if (fh.header_size < min_size || fh.header_size > STREAM_READ_SIZE ||
+        !Fill(fh.header_size) ||
+        !ParseFileHeader(&_buf[_begin], fh.header_size, &_header)) {
+      return Corrupt();
+    }
+    if (_header.version != TRACE_VERSION) {
+      std::cerr << "ERROR! Unsupported trace version: " << _header.version
+                << std::endl;
+      return false;
+    }
+    _begin += _header.header_size;
+    return true;
+  }
+
+  void Close() {
+    if (_fd >= 0) close(_fd);
+    _fd = -1;
+    if (_skipped_bytes || _dropped_blocks) {
+      std::cerr << "WARNING! Skipped " << _skipped_bytes
+                << " bytes and dropped " << _dropped_blocks
+                << " corrupt blocks of the stream" << std::endl;
+    }
+    _skipped_bytes = 0;
+    _dropped_blocks = 0;
+  }
+
+  const TraceFileHeader &Header() const { return _header; }
+
+  /*
+   * Reads the next block. Returns false at the end of the stream or on
+   * a read error; Error() tells the two apart.
+   */
+  bool Next(StreamBlock *block) {
+    TraceBlockHeader &bh = block->header;
+    while (Fill(sizeof(bh))) {
+      memcpy(&bh, &_buf[_begin], sizeof(bh));
+      if (!BlockHeaderValid(bh) || bh.comp_size > STREAM_MAX_BLOCK ||
+          bh.raw_size > STREAM_MAX_BLOCK) {
+        Resync();
+        continue;
+      }
+      if (!Fill(sizeof(bh) + bh.comp_size)) {
+        if (_error) return false;
+        // The tracer stopped in the middle of a block
+        _skipped_bytes += _end - _begin;
+        ++_dropped_blocks;
+        return false;
+      }
+      const uint8_t *payload = &_buf[_begin + sizeof(bh)];
+      block->payload.assign(payload, payload + bh.comp_size);
+      _begin += sizeof(bh) + bh.comp_size;
+      return true;
+    }
+    _skipped_bytes += _end - _begin;
+    _begin = _end;
+    return false;
+  }
+
+  bool Error() const { return _error; }
+
+  /* Counts a block that did not decode */
+  void Drop() { ++_dropped_blocks; }
+
+  /*
+   * Decodes block into span, as MappedTrace::GetChunk. The span stays
+   * valid until scratch is used for another block.
+   */
+  static bool Decode(const StreamBlock &block, ChunkScratch &scratch,
+                     MemrefSpan *span) {
+    const uint8_t *payload = block.payload.empty() ? NULL : &block.payload[0];
+    if (!DecodeBlock(block.header, payload, scratch.raw, scratch.refs,
+                     &scratch.fields)) {
+      return false;
+    }
+    span->data = scratch.refs.empty() ? NULL : &scratch.refs[0];
+    span->size = scratch.refs.size();
+    span->ts = scratch.fields.ts.empty() ? NULL : &scratch.fields.ts[0];
+    span->tid = scratch.fields.tid.empty() ? NULL : &scratch.fields.tid[0];
+    span->pc = scratch.fields.pc.empty() ? NULL : &scratch.fields.pc[0];
+    return true;
+  }
+
+  /* Decodes block into chunk, as MappedTrace::GetChunkAs */
+  template <class Chunk>
+  static bool DecodeAs(const StreamBlock &block, ChunkScratch &scratch,
+                       Chunk *chunk) {
+    const uint8_t *payload = block.payload.empty() ? NULL : &block.payload[0];
+    chunk->Resize(block.header.num_records);
+    return DecodeBlockTo(block.header, payload, scratch.raw, *chunk);
+  }
+
+ private:
+  /* Waits for the tracer to connect to a socket at path */
+  static int Accept(const char *path) {
+    struct sockaddr_un sa;
+    if (strlen(path) >= sizeof(sa.sun_path)) return -1;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0) return -1;
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(s, 1) != 0) {
+      close(s);
+      return -1;
+    }
+    std::cerr << "Waiting for the tracer on " << path << std::endl;
+    int fd = accept(s, NULL, NULL);
+    close(s);
+    unlink(path);
+    return fd;
+  }
+
+  /*
+   * Makes n bytes available at _begin. Returns false if the stream ends
+   * first, or on a read error.
+   */
+  bool Fill(size_t n) {
+    if (_end - _begin >= n) return true;
+    if (_begin > 0) {
+      memmove(&_buf[0], &_buf[_begin], _end - _begin);
+      _end -= _begin;
+      _begin = 0;
+    }
+    if (_buf.size() < n) _buf.resize(n);
+    while (_end < n) {
+      ssize_t r = read(_fd, &_buf[_end], _buf.size() - _end);
+      if (r < 0 && errno == EINTR) continue;
+      if (r < 0) {
+        std::cerr << "ERROR! Cannot read the stream: " << strerror(errno)
+                  << std::endl;
+        _error = true;
+        return false;
+      }
+      if (r == 0) return false;
+      _end += r;
+    }
+    return true;
+  }
+
+  /* Skips to the next occurrence of the sync word after _begin */
+  void Resync() {
+    uint32_t sync = TRACE_BLOCK_SYNC;
+    size_t from = _begin + 1;
+    const uint8_t *begin = &_buf[0];
+    const uint8_t *end = begin + _end;
+    const uint8_t *p = std::search(begin + from, end,
+                                   (const uint8_t *)&sync,
+                                   (const uint8_t *)&sync + sizeof(sync));
+    // Keep a partial sync word at the end, it may complete on the next read
+    size_t next = p == end ? std::max(from, _end - (sizeof(sync) - 1))
+                           : p - begin;
+    _skipped_bytes += next - _begin;
+    _begin = next;
+  }
+
+  bool Corrupt() {
+    if (!_error) std::cerr << "ERROR! Corrupt file header" << std::endl;
+    return false;
+  }
+
+  int _fd;
+  std::vector<uint8_t> _buf;
+  size_t _begin;
+  size_t _end;
+  bool _error;
+  TraceFileHeader _header;
+  uint64_t _skipped_bytes;
+  uint64_t _dropped_blocks;
+};
+
+/*
+ * Hands out the blocks of a stream in order, with the interface of
+ * OrderedChunkReader. With OpenMP, the next window of blocks is read
+ * and then decoded in parallel before it is handed out.
+ */
+class StreamChunkReader {
+ public:
+  explicit StreamChunkReader(TraceStream &stream)
+      : _stream(stream), _next(0), _filled(0) {
+    size_t window = 1;
+#ifdef _OPENMP
+    window = 2 * omp_get_max_threads();
+#endif
+    _blocks.resize(window);
+    _scratch.resize(window);
+    _spans.resize(window);
+    _ok.resize(window);
+  }
+
+  /* Returns false at the end of the stream or on a read error. */
+  bool Next(MemrefSpan *span) {
+    while (true) {
+      while (_next < _filled) {
+        size_t i = _next++;
+        if (_ok[i]) {
+          *span = _spans[i];
+          return true;
+        }
+        _stream.Drop();
+      }
+      _next = 0;
+      _filled = 0;
+      while (_filled < _blocks.size() && _stream.Next(&_blocks[_filled])) {
+        ++_filled;
+      }
+      if (_filled == 0) return false;
+#pragma omp parallel for schedule(dynamic)
+      for (size_t i = 0; i < _filled; ++i) {
+        _ok[i] = TraceStream::Decode(_blocks[i], _scratch[i], &_spans[i]);
+      }
+    }
+  }
+
+  bool Error() const { return _stream.Error(); }
+
+ private:
+  TraceStream &_stream;
+  size_t _next;
+  size_t _filled;
+  std::vector<StreamBlock> _blocks;
+  std::vector<ChunkScratch> _scratch;
+  std::vector<MemrefSpan> _spans;
+  std::vector<char> _ok;
+};
+
+#endif /* TRACE_STREAM_H_ */
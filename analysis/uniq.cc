@@ -1,114 +1,217 @@
 #include <iostream>
-#include <map>
+#include <vector>
 #include <utility>
 #include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
-#include <omp.h>
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <cstring>
 #include <unistd.h>
+#include <omp.h>
 #include "../common.h"
+#include "mapped_trace.h"
+#include "trace_stream.h"
+#include "uniq_engine.h"
 
 using namespace std;
 
-#define BUF_LEN (1024)
+/* Queues the reads of one thread to the engine */
+class UniqVisitor {
+ public:
+  UniqVisitor(UniqEngine *engine, int tid): _engine(engine), _tid(tid) {}
 
-typedef map<intptr_t, pair<size_t, uint32_t> > addr_map;
+  void Read(intptr_t addr, uint32_t size) { _engine->Add(_tid, addr, size); }
+  void Write(intptr_t, uint32_t) {}
+  void Call(intptr_t addr, uint32_t) { cerr << "Call to " << addr << endl; }
+  void Ret(intptr_t addr, uint32_t) {
+    cerr << "Retrun from " << addr << endl;
+  }
 
-bool uniq(char *path) {
-  cerr << "MEMREF: " << sizeof(MEMREF) << endl;
-  struct stat sb;
-  assert(stat(path, &sb) == 0);
-  off_t fs = sb.st_size;
-  cerr << "File size: " << fs << endl;
-  assert((fs % sizeof(MEMREF)) == 0);
-  size_t total_nelm = fs / sizeof(MEMREF);
-  cerr << "Total number of elements: " << total_nelm << endl;
-  size_t num_chunks = total_nelm / BUF_LEN;
-  if (total_nelm % BUF_LEN) ++num_chunks;
-  cerr << "Number of chunks: " << num_chunks << endl;
+ private:
+  UniqEngine *_engine;
+  int _tid;
+};
+
+static void Report(UniqEngine *engine, size_t count, size_t bytes_read,
+                   const TraceFileHeader &header) {
+  cout << "Number of elements processed: " << count << endl;
+  cout << "Total bytes read: " << bytes_read << endl;  
+
+  cout << "Number of uniq addresses: " << engine->NumUniq() << endl;
+
+  size_t uniq_read_bytes = 0;
+  size_t dup_read_bytes = 0;
+  engine->ReadBytes(&uniq_read_bytes, &dup_read_bytes);
+  cout << "Total uniq bytes read: " << uniq_read_bytes << endl;
+  cout << "Total dup bytes read: " << dup_read_bytes << endl;
+  if (header.sampling.sample_mode != TRACE_SAMPLE_NONE) {
+    double scale = SampleScale(header);
+    cout << "Sampled fraction of references: "
+         << header.sampling.sample_fraction << endl;
+    cout << "Estimated total bytes read: " << (size_t)(bytes_read * scale)
+         << endl;
+    cout << "Estimated dup bytes read: " << (size_t)(dup_read_bytes * scale)
+         << endl;
+  }
+}
+
+/* Processes the trace with its chunks decoded into the Chunk layout */
+template <class Chunk>
+bool uniq(const MappedTrace &trace) {
+  size_t num_chunks = trace.NumChunks();
   size_t count = 0;
-  addr_map *rm  = NULL;
-  addr_map *wm  = NULL;
-  int num_maps = 0;
+  UniqEngine *engine = NULL;
   size_t bytes_read = 0;
   
 #pragma omp parallel reduction(+:count, bytes_read)
   {
+    int num_threads = omp_get_num_threads();
 #pragma omp single
     {
-      cerr << "Number of threads: " << omp_get_num_threads() << endl;
-      rm = new addr_map[omp_get_num_threads()];
-      wm = new addr_map[omp_get_num_threads()];
-      num_maps = omp_get_num_threads();
+      cerr << "Number of threads: " << num_threads << endl;
+      engine = new UniqEngine(num_threads);
     }
     int tid = omp_get_thread_num();
-    MEMREF *buf = new MEMREF[BUF_LEN];
-    FILE *fp = fopen(path, "rb");
-#pragma omp for schedule(static)
-    for (size_t i = 0; i < num_chunks; ++i) {
-      fseek(fp, i * BUF_LEN * sizeof(MEMREF), SEEK_SET);
-      size_t nelm = fread(buf, sizeof(MEMREF), BUF_LEN, fp);
-      for (size_t ni = 0; ni < nelm; ++ni) {
-        const MEMREF &mr = buf[ni];
-        if (mr.type == TRACE_FUNC_CALL) {
-          cerr << "Call to " << mr.addr << endl;
-        } else if (mr.type == TRACE_FUNC_RET) {
-          cerr << "Retrun from " << mr.addr << endl;          
-        } else if (mr.type == TRACE_READ) {
-          pair<addr_map::iterator, bool> ret = rm[tid].insert(
-              make_pair(mr.addr, make_pair(1, mr.size)));
-          if (!ret.second) {
-            ++ret.first->second.first;
-            ret.first->second.second =
-                std::max(ret.first->second.second, mr.size);
-          }
-          bytes_read += mr.size;
-          
-        }
-        ++count;
+    ChunkScratch scratch;
+    Chunk buf;
+    UniqVisitor visitor(engine, tid);
+    size_t num_rounds = (num_chunks + num_threads - 1) / num_threads;
+    for (size_t round = 0; round < num_rounds; ++round) {
+      size_t i = round * num_threads + tid;
+      if (i < num_chunks) {
+        if (!trace.GetChunkAs(i, scratch, &buf)) exit(EXIT_FAILURE);
+        VisitRecords(buf, visitor);
+        bytes_read += SumSizes(buf, TRACE_READ);
+        count += buf.NumRecords();
       }
+#pragma omp barrier
+      engine->Apply(tid);
+#pragma omp barrier
     }
   }
   
-  cout << "Number of elements processed: " << count << endl;
-  cout << "Total bytes read: " << bytes_read << endl;  
+  Report(engine, count, bytes_read, trace.Header());
+  delete engine;
 
-  for (int i = 1; i < num_maps; ++i) {
-    addr_map::iterator it = rm[i].begin();
-    addr_map::iterator it_end = rm[i].end();
-    for (; it != it_end; ++it) {
-      pair<addr_map::iterator, bool> ret = rm[0].insert(*it);
-      if (!ret.second) {
-        ret.first->second.first += it->second.first;
-        ret.first->second.second = max(ret.first->second.second,
-                it->second.second);
+  return true;  
+}
+
+/*
+ * Processes a stream (trace_stream.h) with the blocks decoded into the
+ * Chunk layout. Each round reads one block per thread, so memory stays
+ * bounded while the tracer is still writing.
+ */
+template <class Chunk>
+bool uniq_stream(TraceStream &stream) {
+  size_t count = 0;
+  UniqEngine *engine = NULL;
+  size_t bytes_read = 0;
+  vector<StreamBlock> blocks;
+  size_t num_blocks = 0;
+
+#pragma omp parallel reduction(+:count, bytes_read)
+  {
+    int num_threads = omp_get_num_threads();
+#pragma omp single
+    {
+      cerr << "Number of threads: " << num_threads << endl;
+      engine = new UniqEngine(num_threads);
+      blocks.resize(num_threads);
+    }
+    int tid = omp_get_thread_num();
+    ChunkScratch scratch;
+    Chunk buf;
+    UniqVisitor visitor(engine, tid);
+    while (true) {
+#pragma omp single
+      {
+        num_blocks = 0;
+        while (num_blocks < blocks.size() && stream.Next(&blocks[num_blocks])) {
+          ++num_blocks;
+        }
       }
+      if (num_blocks == 0) break;
+      if ((size_t)tid < num_blocks) {
+        if (TraceStream::DecodeAs(blocks[tid], scratch, &buf)) {
+          VisitRecords(buf, visitor);
+          bytes_read += SumSizes(buf, TRACE_READ);
+          count += buf.NumRecords();
+        } else {
+#pragma omp critical(uniq_drop)
+          stream.Drop();
+        }
+      }
+#pragma omp barrier
+      engine->Apply(tid);
+#pragma omp barrier
     }
   }
+  bool ok = !stream.Error();
+  if (ok) Report(engine, count, bytes_read, stream.Header());
+  delete engine;
+  return ok;
+}
 
-  cout << "Number of uniq addresses: " << rm[0].size() << endl;
-
-  addr_map::iterator it = rm[0].begin();
-  addr_map::iterator it_end = rm[0].end();
-  size_t uniq_read_bytes = 0;
-  size_t dup_read_bytes = 0;
-  for (; it != it_end; ++it) {
-    uniq_read_bytes += it->second.second;
-    dup_read_bytes += it->second.first * it->second.second;
+bool uniq(const char *path, int layout) {
+  cerr << "MEMREF: " << sizeof(MEMREF) << endl;
+  if (IsTraceStream(path)) {
+    TraceStream stream;
+    if (!stream.Open(path)) return false;
+    switch (layout) {
+      case LAYOUT_PACKED:
+        return uniq_stream<PackedChunk>(stream);
+      case LAYOUT_SOA:
+        return uniq_stream<SoaChunk>(stream);
+      default:
+        return uniq_stream<AosChunk>(stream);
+    }
   }
-  cout << "Total uniq bytes read: " << uniq_read_bytes << endl;
-  cout << "Total dup bytes read: " << dup_read_bytes << endl;
-  
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  cerr << "File size: " << trace.FileSize() << endl;
+  cerr << "Total number of elements: " << trace.NumRecords() << endl;
+  cerr << "Number of chunks: " << trace.NumChunks() << endl;
+  switch (layout) {
+    case LAYOUT_PACKED:
+      return uniq<PackedChunk>(trace);
+    case LAYOUT_SOA:
+      return uniq<SoaChunk>(trace);
+    default:
+      return uniq<AosChunk>(trace);
+  }
+}
 
-  return true;  
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-L aos|packed|soa] trace" << endl;
 }
 
 int main(int argc, char *argv[]) {
-  char *file_path = argv[1];
-  if (!uniq(file_path)) return EXIT_FAILURE;
+  int layout = LAYOUT_AOS;
+  int opt;
+  while ((opt = getopt(argc, argv, "L:h")) != -1) {
+    switch (opt) {
+      case 'L':
+        if (strcmp(optarg, "aos") == 0) {
+          layout = LAYOUT_AOS;
+        } else if (strcmp(optarg, "packed") == 0) {
+          layout = LAYOUT_PACKED;
+        } else if (strcmp(optarg, "soa") == 0) {
+          layout = LAYOUT_SOA;
+        } else {
+          Usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (!uniq(argv[optind], layout)) return EXIT_FAILURE;
   return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,100 @@
+#ifndef UNIQ_ENGINE_H_
+#define UNIQ_ENGINE_H_
+
+/*
+ * Parallel aggregation of reads per address for uniq.
+ *
+ * Reads are partitioned by address hash into one shard per thread. Each
+ * shard is a flat AddrTable owned by a single thread, so the shards never
+ * overlap and no merge step is needed. Processing goes in rounds:
+ *
+ *   1. every thread reads a batch of records and Add()s the reads to its
+ *      outbox for the owning shard,
+ *   2. barrier,
+ *   3. every thread Apply()s the outboxes addressed to its shard,
+ *   4. barrier.
+ *
+ * Memory is bounded by the batch size times the number of threads.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "../common.h"
+#include "../addr_table.h"
+
+/* Distance between the prefetched and the inserted read in Apply */
+#define UNIQ_PREFETCH_DISTANCE (8)
+
+class UniqEngine {
+ public:
+  struct Read {
+    intptr_t addr;
+    uint32_t size;
+  };
+
+  explicit UniqEngine(int num_shards)
+      : _num_shards(num_shards),
+        _outbox(num_shards * num_shards),
+        _shards(num_shards) {}
+
+  int NumShards() const { return _num_shards; }
+
+  /* Called by producer to queue a read for its shard. */
+  void Add(int producer, intptr_t addr, uint32_t size) {
+    Read r = { addr, size };
+    _outbox[producer * _num_shards + ShardOf(addr)].push_back(r);
+  }
+
+  /* Called by the owner of shard after all producers are done adding. */
+  void Apply(int shard) {
+    AddrTable<READSTAT> &table = _shards[shard];
+    for (int p = 0; p < _num_shards; ++p) {
+      std::vector<Read> &box = _outbox[p * _num_shards + shard];
+      size_t n = box.size();
+      for (size_t i = 0; i < n; ++i) {
+        if (i + UNIQ_PREFETCH_DISTANCE < n) {
+          table.Prefetch(box[i + UNIQ_PREFETCH_DISTANCE].addr);
+        }
+        READSTAT &rs = table[box[i].addr];
+        ++rs.count;
+        if (box[i].size > rs.size) rs.size = box[i].size;
+      }
+      box.clear();
+    }
+  }
+
+  const AddrTable<READSTAT> &Shard(int shard) const { return _shards[shard]; }
+
+  size_t NumUniq() const {
+    size_t n = 0;
+    for (int s = 0; s < _num_shards; ++s) n += _shards[s].Size();
+    return n;
+  }
+
+  /* Sums of the largest read size and of count * largest size */
+  void ReadBytes(size_t *uniq_bytes, size_t *dup_bytes) const {
+    *uniq_bytes = 0;
+    *dup_bytes = 0;
+    for (int s = 0; s < _num_shards; ++s) {
+      const AddrTable<READSTAT> &table = _shards[s];
+      for (size_t i = 0; i < table.Capacity(); ++i) {
+        if (!table.Used(i)) continue;
+        *uniq_bytes += table.Value(i).size;
+        *dup_bytes += table.Value(i).count * table.Value(i).size;
+      }
+    }
+  }
+
+ private:
+  int ShardOf(intptr_t addr) const {
+    // The table slot uses the low bits of the hash; shard on the high bits
+    return (int)((HashAddr((uint64_t)addr) >> 32) % (uint64_t)_num_shards);
+  }
+
+  int _num_shards;
+  std::vector<std::vector<Read> > _outbox;
+  std::vector<AddrTable<READSTAT> > _shards;
+};
+
+#endif /* UNIQ_ENGINE_H_ */
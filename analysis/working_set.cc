@@ -0,0 +1,271 @@
+/*
+ * Reports the working set of a trace over time: the distinct cache
+ * lines and pages accessed in every window of N records, and the
+ * footprint of the trace up to the end of every window.
+ *
+ *   working_set [-x] [-b PRECISION] [-l LINE_SIZE] [-P PAGE_SIZE]
+ *               [-n WINDOW] trace
+ *
+ * Windows are counted in trace records (1000000 by default); calls and
+ * returns take their place in the count but do not access memory. An
+ * access touches every line and page in [addr, addr + size).
+ *
+ * By default lines and pages are counted with HyperLogLog sketches
+ * (hyperloglog.h) of 2^PRECISION registers each, so memory does not
+ * depend on the footprint and counts are estimates within about
+ * 1.04 / sqrt(2^PRECISION). With -x counts are exact: every touched page
+ * has a bitmap of its lines, which needs PAGE_SIZE / LINE_SIZE <= 64 and
+ * memory proportional to the footprint in pages.
+ *
+ * Chunks are processed in parallel, a batch at a time. Each chunk
+ * counts the windows it overlaps; the counts of a window that spans
+ * chunks are merged, and complete windows are merged in order into the
+ * cumulative footprint.
+ */
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <omp.h>
+#include "../common.h"
+#include "../addr_table.h"
+#include "mapped_trace.h"
+#include "hyperloglog.h"
+
+using namespace std;
+
+struct FootprintConfig {
+  int line_shift;
+  int page_shift;
+  int precision;
+};
+
+/* Estimated footprint of a set of accesses */
+class SketchFootprint {
+ public:
+  explicit SketchFootprint(const FootprintConfig &config)
+      : _page_shift(config.page_shift - config.line_shift),
+        _lines(config.precision), _pages(config.precision) {}
+
+  void AddLine(uint64_t line) {
+    _lines.Add(line);
+    _pages.Add(line >> _page_shift);
+  }
+
+  void Merge(const SketchFootprint &other) {
+    _lines.Merge(other._lines);
+    _pages.Merge(other._pages);
+  }
+
+  uint64_t Lines() const { return _lines.Estimate(); }
+  uint64_t Pages() const { return _pages.Estimate(); }
+
+  void Swap(SketchFootprint &other) {
+    std::swap(_page_shift, other._page_shift);
+    std::swap(_lines, other._lines);
+    std::swap(_pages, other._pages);
+  }
+
+ private:
+  int _page_shift;
+  HyperLogLog _lines;
+  HyperLogLog _pages;
+};
+
+/* Exact footprint: a bitmap of the touched lines of every page */
+class ExactFootprint {
+ public:
+  explicit ExactFootprint(const FootprintConfig &config)
+      : _page_shift(config.page_shift - config.line_shift),
+        _line_mask((1 << _page_shift) - 1), _pages(16) {}
+
+  void AddLine(uint64_t line) {
+    _pages[(intptr_t)(line >> _page_shift)] |= 1ULL << (line & _line_mask);
+  }
+
+  void Merge(const ExactFootprint &other) {
+    for (size_t i = 0; i < other._pages.Capacity(); ++i) {
+      if (!other._pages.Used(i)) continue;
+      _pages[other._pages.Key(i)] |= other._pages.Value(i);
+    }
+  }
+
+  uint64_t Lines() const {
+    uint64_t n = 0;
+    for (size_t i = 0; i < _pages.Capacity(); ++i) {
+      if (_pages.Used(i)) n += __builtin_popcountll(_pages.Value(i));
+    }
+    return n;
+  }
+  uint64_t Pages() const { return _pages.Size(); }
+
+  void Swap(ExactFootprint &other) {
+    std::swap(_page_shift, other._page_shift);
+    std::swap(_line_mask, other._line_mask);
+    std::swap(_pages, other._pages);
+  }
+
+ private:
+  int _page_shift;
+  uint64_t _line_mask;
+  AddrTable<uint64_t> _pages;
+};
+
+/* Footprints of the windows overlapped by one chunk */
+template <class Footprint>
+struct ChunkWindows {
+  size_t first_window;
+  std::vector<Footprint> windows;
+};
+
+template <class Footprint>
+static void PrintWindow(size_t window, size_t window_size,
+                        const Footprint &fp, const Footprint &total,
+                        const FootprintConfig &config) {
+  uint64_t lines = fp.Lines();
+  uint64_t total_lines = total.Lines();
+  printf("%8zu %14zu %12llu %10llu %10.2f %14llu %12llu %10.2f\n", window,
+         window * window_size, (unsigned long long)lines,
+         (unsigned long long)fp.Pages(),
+         (double)(lines << config.line_shift) / (1 << 20),
+         (unsigned long long)total_lines, (unsigned long long)total.Pages(),
+         (double)(total_lines << config.line_shift) / (1 << 20));
+}
+
+template <class Footprint>
+bool working_set(const char *path, size_t window_size,
+                 const FootprintConfig &config) {
+  MappedTrace trace;
+  if (!trace.Open(path)) return false;
+  size_t num_chunks = trace.NumChunks();
+  size_t batch = 4 * omp_get_max_threads();
+  vector<ChunkWindows<Footprint> > chunks(batch);
+  Footprint current(config);
+  Footprint total(config);
+  size_t current_window = 0;
+  uint64_t count = 0;
+
+  printf("%8s %14s %12s %10s %10s %14s %12s %10s\n", "window", "first record",
+         "lines", "pages", "MiB", "total lines", "total pages", "total MiB");
+  for (size_t base = 0; base < num_chunks; base += batch) {
+    size_t n = min(batch, num_chunks - base);
+    bool ok = true;
+#pragma omp parallel reduction(&&:ok)
+    {
+      ChunkScratch scratch;
+      MemrefSpan buf;
+#pragma omp for schedule(dynamic)
+      for (size_t k = 0; k < n; ++k) {
+        ChunkWindows<Footprint> &cw = chunks[k];
+        cw.windows.clear();
+        if (!trace.GetChunk(base + k, scratch, &buf)) {
+          ok = false;
+          continue;
+        }
+        size_t record = trace.ChunkFirstRecord(base + k);
+        cw.first_window = record / window_size;
+        size_t i = 0;
+        while (i < buf.size) {
+          size_t window = record / window_size;
+          size_t end = min(buf.size, i + (window + 1) * window_size - record);
+          cw.windows.push_back(Footprint(config));
+          Footprint &fp = cw.windows.back();
+          for (; i < end; ++i) {
+            const MEMREF &mr = buf.data[i];
+            if (mr.type != TRACE_READ && mr.type != TRACE_WRITE) continue;
+            uint64_t first = (uint64_t)mr.addr >> config.line_shift;
+            uint64_t last = ((uint64_t)mr.addr + (mr.size ? mr.size - 1 : 0)) >>
+                config.line_shift;
+            for (uint64_t line = first; line <= last; ++line) fp.AddLine(line);
+          }
+          record = trace.ChunkFirstRecord(base + k) + i;
+        }
+      }
+    }
+    if (!ok) return false;
+
+    // Windows are complete once a later window starts
+    for (size_t k = 0; k < n; ++k) {
+      ChunkWindows<Footprint> &cw = chunks[k];
+      for (size_t w = 0; w < cw.windows.size(); ++w) {
+        size_t window = cw.first_window + w;
+        if (window != current_window) {
+          total.Merge(current);
+          PrintWindow(current_window, window_size, current, total, config);
+          current.Swap(cw.windows[w]);
+          current_window = window;
+        } else {
+          current.Merge(cw.windows[w]);
+        }
+      }
+      count += trace.ChunkRecords(base + k);
+    }
+  }
+  if (count > 0) {
+    total.Merge(current);
+    PrintWindow(current_window, window_size, current, total, config);
+  }
+  uint64_t lines = total.Lines();
+  cout << "Number of processed trace entries: " << count << endl;
+  cout << "Footprint: " << lines << " lines (" << (lines << config.line_shift)
+       << " bytes), " << total.Pages() << " pages" << endl;
+  return true;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog << " [-x] [-b PRECISION] [-l LINE_SIZE]"
+       << " [-P PAGE_SIZE] [-n WINDOW] trace" << endl;
+}
+
+static bool IsPowerOfTwo(size_t n) { return n && !(n & (n - 1)); }
+
+int main(int argc, char *argv[]) {
+  bool exact = false;
+  int precision = HLL_DEFAULT_PRECISION;
+  size_t line_size = 64;
+  size_t page_size = 4096;
+  size_t window_size = 1000000;
+  int opt;
+  while ((opt = getopt(argc, argv, "xb:l:P:n:h")) != -1) {
+    switch (opt) {
+      case 'x':
+        exact = true;
+        break;
+      case 'b':
+        precision = atoi(optarg);
+        break;
+      case 'l':
+        line_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'P':
+        page_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'n':
+        window_size = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        Usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || window_size == 0 || !IsPowerOfTwo(line_size) ||
+      !IsPowerOfTwo(page_size) || page_size < line_size ||
+      precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (exact && page_size / line_size > 64) {
+    cerr << "ERROR! -x needs at most 64 lines per page" << endl;
+    return EXIT_FAILURE;
+  }
+  FootprintConfig config;
+  config.line_shift = __builtin_ctzl(line_size);
+  config.page_shift = __builtin_ctzl(page_size);
+  config.precision = precision;
+  bool ok = exact
+      ? working_set<ExactFootprint>(argv[optind], window_size, config)
+      : working_set<SketchFootprint>(argv[optind], window_size, config);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,142 @@
+/*
+ * Compares the record layouts of analysis/record_layout.h: decodes the
+ * blocks of a synthetic trace into each layout, then runs a visitor
+ * over the records and a scan of the read sizes.
+ *
+ *   g++ -O3 -o layout_bench layout_bench.cc
+ *   ./layout_bench [num_records]
+ */
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <time.h>
+#include "../common.h"
+#include "../trace_format.h"
+#include "../analysis/record_layout.h"
+
+using namespace std;
+
+#define BLOCK_LEN (65536)
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Encoded blocks of a trace of streaming and random accesses with calls */
+static void GenerateTrace(size_t num_blocks, vector<vector<uint8_t> > &blocks) {
+  vector<MEMREF> buf(BLOCK_LEN);
+  vector<uint8_t> raw;
+  uint64_t x = 88172645463325252ULL;
+  blocks.resize(num_blocks);
+  for (size_t b = 0; b < num_blocks; ++b) {
+    for (size_t i = 0; i < BLOCK_LEN; ++i) {
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      MEMREF &mr = buf[i];
+      if ((x & 1023) == 0) {
+        mr.addr = 0x400000 + (intptr_t)(x >> 40) % 64 * 16;
+        mr.type = (x >> 10) & 1 ? TRACE_FUNC_CALL : TRACE_FUNC_RET;
+        mr.size = (uint32_t)(x >> 12) % 4;
+        continue;
+      }
+      size_t idx = (x & 3) ? b * BLOCK_LEN + i : (x >> 8) % (1 << 20);
+      mr.addr = 0x7f0000000000LL + (intptr_t)idx * 8;
+      mr.type = ((x >> 4) & 7) == 0 ? TRACE_WRITE : TRACE_READ;
+      mr.size = 1 << ((x >> 2) & 3);
+    }
+    EncodeBlock(&buf[0], NULL, NULL, NULL, BLOCK_LEN, true, raw, blocks[b]);
+  }
+}
+
+/* Sums of the fields, which every layout must agree on */
+class SumVisitor {
+ public:
+  SumVisitor(): addr_sum(0), reads(0), writes(0), markers(0) {}
+
+  void Read(intptr_t addr, uint32_t) {
+    addr_sum += addr;
+    ++reads;
+  }
+  void Write(intptr_t addr, uint32_t) {
+    addr_sum += addr;
+    ++writes;
+  }
+  void Call(intptr_t addr, uint32_t id) { markers += addr + id; }
+  void Ret(intptr_t addr, uint32_t id) { markers += addr + id; }
+
+  uint64_t addr_sum;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t markers;
+};
+
+struct Result {
+  double decode;
+  double visit;
+  double scan;
+  SumVisitor sums;
+  uint64_t bytes_read;
+};
+
+template <class Chunk>
+static Result Run(const vector<vector<uint8_t> > &blocks) {
+  Result r = {0, 0, 0, SumVisitor(), 0};
+  vector<uint8_t> raw;
+  Chunk chunk;
+  for (size_t b = 0; b < blocks.size(); ++b) {
+    TraceBlockHeader bh;
+    memcpy(&bh, &blocks[b][0], sizeof(bh));
+    double t0 = Now();
+    chunk.Resize(bh.num_records);
+    if (!DecodeBlockTo(bh, &blocks[b][sizeof(bh)], raw, chunk)) {
+      cerr << "ERROR! Corrupt block " << b << endl;
+      exit(EXIT_FAILURE);
+    }
+    double t1 = Now();
+    VisitRecords(chunk, r.sums);
+    double t2 = Now();
+    r.bytes_read += SumSizes(chunk, TRACE_READ);
+    double t3 = Now();
+    r.decode += t1 - t0;
+    r.visit += t2 - t1;
+    r.scan += t3 - t2;
+  }
+  return r;
+}
+
+static void Print(const char *name, size_t record_bytes, size_t n,
+                  const Result &r) {
+  printf("  %-8s %2zu B/record  decode %8.2f  visit %8.2f  scan %8.2f "
+         "Mrecords/s\n", name, record_bytes, n / r.decode / 1e6,
+         n / r.visit / 1e6, n / r.scan / 1e6);
+}
+
+static bool Same(const Result &a, const Result &b) {
+  return a.sums.addr_sum == b.sums.addr_sum && a.sums.reads == b.sums.reads &&
+      a.sums.writes == b.sums.writes && a.sums.markers == b.sums.markers &&
+      a.bytes_read == b.bytes_read;
+}
+
+int main(int argc, char *argv[]) {
+  size_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000000;
+  size_t num_blocks = (n + BLOCK_LEN - 1) / BLOCK_LEN;
+  n = num_blocks * BLOCK_LEN;
+  vector<vector<uint8_t> > blocks;
+  GenerateTrace(num_blocks, blocks);
+  printf("Records: %zu\n", n);
+  Result aos = Run<AosChunk>(blocks);
+  Result packed = Run<PackedChunk>(blocks);
+  Result soa = Run<SoaChunk>(blocks);
+  Print("aos", sizeof(MEMREF), n, aos);
+  Print("packed", sizeof(PACKED_MEMREF), n, packed);
+  Print("soa", sizeof(intptr_t) + sizeof(uint8_t) + sizeof(uint32_t), n, soa);
+  if (!Same(aos, packed) || !Same(aos, soa)) {
+    printf("ERROR! Results differ\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
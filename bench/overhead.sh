@@ -0,0 +1,254 @@
+#!/bin/bash
+#
+# Measures the overhead of MemoryTracer on the workloads of overhead_app,
+# in each output mode, and checks the traces it writes.
+#
+#   PIN=$PIN_ROOT/pin bench/overhead.sh [-r RUNS] [-s ELEMENTS] [-n REPS]
+#       [-w WORKLOADS] [-m MODES] [-o RESULTS] [-b BASELINE] [-t PERCENT]
+#       TOOL APP SANITY_CHECK UNIQ
+#
+# TOOL is MemoryTracer.so, APP overhead_app, and SANITY_CHECK and UNIQ the
+# analysis tools. PIN is the pin command, with any options of its own.
+# For each workload (default: stream random chase threads) and mode
+#
+#   text       text trace
+#   binary     compressed binary trace
+#   raw        binary trace without compression
+#   writer     compressed binary trace with -writer_buffers 4
+#   aggregate  summary of the reads, no trace
+#   stream     binary trace streamed to UNIQ through a named pipe
+#
+# the suite reports the slowdown against the native run, records traced
+# per second, bytes written per record and the time application threads
+# stalled on buffer flushes. Times are the fastest of RUNS (3) runs.
+#
+# Every trace is checked: sanity_check must find the calls and returns
+# of each binary trace nested and count as many records as the tracer
+# reported, a text trace must have one line per record, and UNIQ must
+# count every record of a stream. A failed check fails the suite.
+#
+# Results are written as tab-separated lines to RESULTS. Given the
+# results of an earlier run as BASELINE, the suite prints the change of
+# every slowdown, and with -t fails if one grew by more than PERCENT.
+#
+
+RUNS=3
+ELEMENTS=262144
+REPS=4
+WORKLOADS="stream random chase threads"
+MODES="text binary raw writer aggregate stream"
+RESULTS=overhead.tsv
+BASELINE=
+THRESHOLD=
+
+usage() {
+  echo "Usage: PIN=pin $0 [-r RUNS] [-s ELEMENTS] [-n REPS] [-w WORKLOADS]" \
+       "[-m MODES] [-o RESULTS] [-b BASELINE] [-t PERCENT]" \
+       "TOOL APP SANITY_CHECK UNIQ" >&2
+  exit 1
+}
+
+while getopts "r:s:n:w:m:o:b:t:h" opt; do
+  case $opt in
+    r) RUNS=$OPTARG ;;
+    s) ELEMENTS=$OPTARG ;;
+    n) REPS=$OPTARG ;;
+    w) WORKLOADS=$OPTARG ;;
+    m) MODES=$OPTARG ;;
+    o) RESULTS=$OPTARG ;;
+    b) BASELINE=$OPTARG ;;
+    t) THRESHOLD=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 4 ] && [ -n "$PIN" ] || usage
+TOOL=$1
+APP=$2
+SANITY_CHECK=$3
+UNIQ=$4
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/overhead.XXXXXX") || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+# Seconds since the epoch, with nanoseconds
+now() {
+  date +%s.%N
+}
+
+# Prints the value of an awk expression
+calc() {
+  awk "BEGIN { printf \"%.6f\\n\", ($1) }"
+}
+
+# Runs a command once; prints its time in seconds. Its output stays in
+# $WORK/out and $WORK/err.
+time_run() {
+  local start end
+  rm -f "$WORK"/trace*
+  start=$(now)
+  "$@" > "$WORK/out" 2> "$WORK/err" || return 1
+  end=$(now)
+  calc "$end - $start"
+}
+
+# The smaller of two times, the first one possibly empty
+fastest() {
+  if [ -z "$1" ]; then
+    echo "$2"
+  else
+    calc "$1 < $2 ? $1 : $2"
+  fi
+}
+
+# Options of the tracer for a mode
+mode_options() {
+  case $1 in
+    text) echo "-dump_text_trace 1" ;;
+    binary) echo "-dump_text_trace 0" ;;
+    raw) echo "-dump_text_trace 0 -compress_trace 0" ;;
+    writer) echo "-dump_text_trace 0 -writer_buffers 4" ;;
+    aggregate) echo "-mode aggregate" ;;
+    stream) echo "-stream $WORK/fifo" ;;
+    *) return 1 ;;
+  esac
+}
+
+# The per-thread trace files of the last run
+trace_files() {
+  ls "$WORK"/trace.* 2> /dev/null | grep '\.[0-9]*\.[0-9]*$'
+}
+
+# Number of records in the output of the last run of a mode, checking
+# the nesting of binary traces; prints the reason of a failure instead
+count_records() {
+  local mode=$1 count=0 n f
+  case $mode in
+    text)
+      for f in $(trace_files); do
+        n=$(wc -l < "$f")
+        count=$((count + n))
+      done
+      ;;
+    binary|raw|writer)
+      for f in $(trace_files); do
+        if ! "$SANITY_CHECK" -q "$f" > "$WORK/check" 2>&1; then
+          echo "sanity_check failed on $(basename "$f")"
+          return 1
+        fi
+        n=$(sed -n 's/^Number of processed trace entries: //p' "$WORK/check")
+        count=$((count + n))
+      done
+      ;;
+    aggregate)
+      count=$(sed -n 's/^Number of elements processed: //p' "$WORK/trace")
+      ;;
+    stream)
+      count=$(sed -n 's/^Number of elements processed: //p' "$WORK/uniq")
+      ;;
+  esac
+  echo "$count"
+}
+
+# Runs a workload RUNS times under the tracer in a mode. Sets seconds to
+# the fastest run, and records, stall_ms, bytes and check from the last.
+run_traced() {
+  local workload=$1 mode=$2 options reader t f n
+  options=$(mode_options "$mode") || return 1
+  seconds=
+  for ((r = 0; r < RUNS; ++r)); do
+    if [ "$mode" = stream ]; then
+      rm -f "$WORK/fifo"
+      mkfifo "$WORK/fifo" || return 1
+      "$UNIQ" "$WORK/fifo" > "$WORK/uniq" 2> /dev/null &
+      reader=$!
+    fi
+    t=$(time_run $PIN -t "$TOOL" -o "$WORK/trace" -f_regex 'kernel_.*' \
+        $options -- "$APP" "$workload" "$ELEMENTS" "$REPS")
+    if [ -z "$t" ]; then
+      [ "$mode" = stream ] && kill $reader 2> /dev/null
+      return 1
+    fi
+    if [ "$mode" = stream ] && ! wait $reader; then
+      echo "ERROR! $UNIQ failed on the stream" >> "$WORK/err"
+      return 1
+    fi
+    seconds=$(fastest "$seconds" "$t")
+  done
+  records=$(sed -n 's/^Recorded \([0-9]*\) records$/\1/p' "$WORK/err")
+  stall_ms=$(sed -n 's/^Application threads stalled for \([0-9]*\) ms.*/\1/p' \
+      "$WORK/err")
+  [ -n "$records" ] && [ -n "$stall_ms" ] || return 1
+  # The bytes that went through the pipe are not seen
+  bytes=-
+  if [ "$mode" != stream ]; then
+    bytes=0
+    for f in $(trace_files) "$WORK/trace"; do
+      [ -f "$f" ] && bytes=$((bytes + $(wc -c < "$f")))
+    done
+  fi
+  if ! n=$(count_records "$mode"); then
+    check="FAILED: $n"
+  elif [ "$n" != "$records" ]; then
+    check="FAILED: $n records in the output, $records recorded"
+  else
+    check=ok
+  fi
+}
+
+failed=0
+: > "$RESULTS"
+printf "%-8s %-10s %10s %9s %14s %12s %10s  %s\n" workload mode seconds \
+    slowdown "records/s" "bytes/rec" "stall ms" check
+for workload in $WORKLOADS; do
+  native=
+  for ((r = 0; r < RUNS; ++r)); do
+    if ! t=$(time_run "$APP" "$workload" "$ELEMENTS" "$REPS"); then
+      echo "ERROR! $APP $workload failed" >&2
+      exit 1
+    fi
+    native=$(fastest "$native" "$t")
+  done
+  printf "%-8s %-10s %10.3f %9.2f\n" "$workload" native "$native" 1
+  for mode in $MODES; do
+    if ! run_traced "$workload" "$mode"; then
+      printf "%-8s %-10s %s\n" "$workload" "$mode" "FAILED: tracer run"
+      tail -n 5 "$WORK/err" >&2
+      failed=1
+      continue
+    fi
+    [ "$check" = ok ] || failed=1
+    slowdown=$(calc "$seconds / $native")
+    rate=$(calc "$records / $seconds")
+    per_record=-
+    if [ "$bytes" != - ] && [ "$records" -gt 0 ]; then
+      per_record=$(calc "$bytes / $records")
+      per_record=$(printf "%.2f" "$per_record")
+    fi
+    printf "%-8s %-10s %10.3f %9.2f %14.0f %12s %10s  %s\n" "$workload" \
+        "$mode" "$seconds" "$slowdown" "$rate" "$per_record" "$stall_ms" \
+        "$check"
+    printf "%s\t%s\t%.3f\t%.2f\t%.0f\t%s\t%s\t%s\n" "$workload" "$mode" \
+        "$seconds" "$slowdown" "$rate" "$per_record" "$stall_ms" \
+        "${check%%:*}" >> "$RESULTS"
+  done
+done
+
+if [ -n "$BASELINE" ]; then
+  echo
+  echo "Slowdown against $BASELINE:"
+  # Joins the results on workload and mode; prints the change of each
+  # slowdown, and marks the ones beyond the threshold
+  awk -F '\t' -v threshold="$THRESHOLD" '
+    NR == FNR { base[$1 "\t" $2] = $4; next }
+    ($1 "\t" $2) in base && base[$1 "\t" $2] > 0 {
+      change = 100 * ($4 / base[$1 "\t" $2] - 1)
+      mark = threshold != "" && change > threshold ? "  REGRESSION" : ""
+      printf "%-8s %-10s %9.2f -> %9.2f  %+7.1f%%%s\n", $1, $2,
+          base[$1 "\t" $2], $4, change, mark
+      if (mark != "") regressed = 1
+    }
+    END { exit regressed }' "$BASELINE" "$RESULTS" || failed=1
+fi
+
+exit $failed
@@ -0,0 +1,156 @@
+/*
+ * Target program of the tracer overhead suite (bench/overhead.sh). Each
+ * workload runs its accesses in a function named kernel_*, the functions
+ * the suite traces with -f_regex 'kernel_.*':
+ *
+ *   stream   a[i] = b[i] + s * c[i] over three arrays
+ *   random   read-modify-write of random elements of a table
+ *   chase    a walk through a random cycle of 64-byte nodes
+ *   threads  stream and random on private data in each of THREADS
+ *            threads, with one shared counter per thread
+ *
+ *   g++ -O2 -pthread -o overhead_app overhead_app.cc
+ *   ./overhead_app WORKLOAD [elements] [reps] [threads]
+ *
+ * Every workload makes about 3 * elements * reps accesses. The result is
+ * printed so that the compiler keeps the loops.
+ */
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <pthread.h>
+
+using namespace std;
+
+struct Node {
+  Node *next;
+  uint64_t pad[7];
+};
+
+static inline uint64_t XorShift(uint64_t &x) {
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+extern "C" __attribute__((noinline)) void kernel_stream(
+    double *a, const double *b, const double *c, size_t n, size_t reps) {
+  for (size_t r = 0; r < reps; ++r) {
+    double s = 1.0 + r;
+    for (size_t i = 0; i < n; ++i) a[i] = b[i] + s * c[i];
+  }
+}
+
+extern "C" __attribute__((noinline)) uint64_t kernel_random(
+    uint64_t *table, size_t n, size_t reps, uint64_t seed) {
+  uint64_t x = seed | 1;
+  uint64_t sum = 0;
+  for (size_t k = 0; k < n * reps; ++k) {
+    uint64_t &e = table[XorShift(x) % n];
+    sum += e;
+    e = sum;
+  }
+  return sum;
+}
+
+extern "C" __attribute__((noinline)) Node *kernel_chase(Node *p,
+                                                        size_t steps) {
+  for (size_t k = 0; k < steps; ++k) p = p->next;
+  return p;
+}
+
+/* Nodes linked in one random cycle */
+static void MakeCycle(vector<Node> &nodes, uint64_t seed) {
+  size_t n = nodes.size();
+  vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) order[i] = i;
+  uint64_t x = seed | 1;
+  for (size_t i = n - 1; i > 0; --i) {
+    swap(order[i], order[XorShift(x) % (i + 1)]);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    nodes[order[i]].next = &nodes[order[(i + 1) % n]];
+  }
+}
+
+struct Worker {
+  size_t n;
+  size_t reps;
+  uint64_t seed;
+  uint64_t *counter;
+  double result;
+};
+
+static void *RunWorker(void *arg) {
+  Worker *w = static_cast<Worker *>(arg);
+  vector<double> a(w->n), b(w->n, 1.0), c(w->n, 2.0);
+  vector<uint64_t> table(w->n, 1);
+  // Split the accesses between the two kernels
+  kernel_stream(&a[0], &b[0], &c[0], w->n, (w->reps + 1) / 2);
+  *w->counter += kernel_random(&table[0], w->n, w->reps / 2 + 1, w->seed);
+  w->result = a[w->n / 2];
+  return NULL;
+}
+
+static void Usage(const char *prog) {
+  cerr << "Usage: " << prog
+       << " stream|random|chase|threads [elements] [reps] [threads]" << endl;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *workload = argv[1];
+  size_t n = argc > 2 ? strtoul(argv[2], NULL, 10) : (1 << 18);
+  size_t reps = argc > 3 ? strtoul(argv[3], NULL, 10) : 4;
+  size_t num_threads = argc > 4 ? strtoul(argv[4], NULL, 10) : 4;
+  if (n == 0 || reps == 0 || num_threads == 0) {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(workload, "stream") == 0) {
+    vector<double> a(n), b(n, 1.0), c(n, 2.0);
+    kernel_stream(&a[0], &b[0], &c[0], n, reps);
+    printf("%f\n", a[n / 2]);
+  } else if (strcmp(workload, "random") == 0) {
+    vector<uint64_t> table(n, 1);
+    // Two accesses per step; make as many as the other workloads
+    printf("%llu\n", (unsigned long long)kernel_random(&table[0], n,
+                                                       reps * 3 / 2 + 1, 42));
+  } else if (strcmp(workload, "chase") == 0) {
+    vector<Node> nodes(n);
+    MakeCycle(nodes, 42);
+    Node *p = kernel_chase(&nodes[0], 3 * n * reps);
+    printf("%ld\n", (long)(p - &nodes[0]));
+  } else if (strcmp(workload, "threads") == 0) {
+    // Counters on one line, written by all threads
+    vector<uint64_t> counters(num_threads);
+    vector<Worker> workers(num_threads);
+    vector<pthread_t> threads(num_threads);
+    for (size_t t = 0; t < num_threads; ++t) {
+      Worker w = { n / num_threads + 1, reps, 42 + t, &counters[t], 0 };
+      workers[t] = w;
+      if (pthread_create(&threads[t], NULL, RunWorker, &workers[t]) != 0) {
+        cerr << "ERROR! Cannot create thread" << endl;
+        return EXIT_FAILURE;
+      }
+    }
+    double sum = 0;
+    for (size_t t = 0; t < num_threads; ++t) {
+      pthread_join(threads[t], NULL);
+      sum += workers[t].result + counters[t];
+    }
+    printf("%f\n", sum);
+  } else {
+    Usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,114 @@
+/*
+ * Compares the per-record fprintf path of MLOG::DumpBufferToFile with
+ * the buffer-at-once text serializer in text_format.h.
+ *
+ *   g++ -O2 -o text_emitter_bench text_emitter_bench.cc
+ *   ./text_emitter_bench [num_records] [output_file]
+ */
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <time.h>
+#include "../common.h"
+#include "../text_format.h"
+
+using namespace std;
+
+#define BUF_LEN (65536)
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void FillBuffer(vector<MEMREF> &buf, unsigned seed) {
+  srand(seed);
+  intptr_t base = 0x7ffc0000 + (rand() & 0xffff) * 8;
+  for (size_t i = 0; i < buf.size(); ++i) {
+    MEMREF &mr = buf[i];
+    int r = rand() % 100;
+    if (r == 0) {
+      mr.type = TRACE_FUNC_CALL;
+      mr.addr = 0x400500;
+      mr.size = 0;
+    } else if (r == 1) {
+      mr.type = TRACE_FUNC_RET;
+      mr.addr = (i & 1) ? 0 : 0x400500;
+      mr.size = 0;
+    } else {
+      mr.type = r & 1;
+      mr.addr = base + (intptr_t)(rand() % 4096) * 8;
+      mr.size = 1 << (rand() % 6);
+    }
+  }
+}
+
+/* Checks the serializer against snprintf, including edge values. */
+static bool Verify(const vector<MEMREF> &buf) {
+  vector<MEMREF> refs(buf);
+  MEMREF edge[6] = {
+    {0, 0, 0}, {1, 1, 1}, {-1, 0xffffffffU, 0xffffffffU},
+    {(intptr_t)0x0f, 2, 10}, {(intptr_t)0x10, 3, 99}, {(intptr_t)0x100, 3, 100}
+  };
+  refs.insert(refs.end(), edge, edge + 6);
+  vector<char> text(refs.size() * TEXT_RECORD_MAX);
+  size_t len = FormatTextRecords(&refs[0], refs.size(), &text[0]);
+  string expected;
+  char line[TEXT_RECORD_MAX];
+  for (size_t i = 0; i < refs.size(); ++i) {
+    snprintf(line, sizeof(line), "%d %p %u\n", refs[i].type,
+             (void*)refs[i].addr, refs[i].size);
+    expected += line;
+  }
+  return expected.size() == len && memcmp(expected.data(), &text[0], len) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  size_t num_records = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+  const char *path = argc > 2 ? argv[2] : "/dev/null";
+  vector<MEMREF> buf(BUF_LEN);
+  FillBuffer(buf, 1);
+  if (!Verify(buf)) {
+    cerr << "ERROR! Serializer output differs from fprintf" << endl;
+    return EXIT_FAILURE;
+  }
+  size_t num_buffers = (num_records + BUF_LEN - 1) / BUF_LEN;
+
+  FILE *fp = fopen(path, "w");
+  double start = Now();
+  for (size_t b = 0; b < num_buffers; ++b) {
+    const MEMREF *reference = &buf[0];
+    for (size_t i = 0; i < BUF_LEN; i++, reference++) {
+      fprintf(fp, "%d %p %u\n", reference->type, (void*)reference->addr,
+              reference->size);
+    }
+  }
+  fclose(fp);
+  double t_fprintf = Now() - start;
+
+  fp = fopen(path, "w");
+  setvbuf(fp, NULL, _IONBF, 0);
+  vector<char> text(BUF_LEN * TEXT_RECORD_MAX);
+  start = Now();
+  for (size_t b = 0; b < num_buffers; ++b) {
+    size_t len = FormatTextRecords(&buf[0], BUF_LEN, &text[0]);
+    if (fwrite(&text[0], 1, len, fp) != len) {
+      cerr << "ERROR! Write failed" << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  fclose(fp);
+  double t_emitter = Now() - start;
+
+  size_t n = num_buffers * BUF_LEN;
+  cout << "Records: " << n << endl;
+  cout << "fprintf: " << t_fprintf << " s, "
+       << n / t_fprintf / 1e6 << " Mrecords/s" << endl;
+  cout << "emitter: " << t_emitter << " s, "
+       << n / t_emitter / 1e6 << " Mrecords/s" << endl;
+  cout << "Speedup: " << t_fprintf / t_emitter << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+/*
+ * Compares the std::map aggregation formerly used by analysis/uniq with
+ * UniqEngine on synthetic traces of 10^6 records up to max_records,
+ * growing by 10x. Records are generated block by block, so traces of
+ * 10^9 records do not need to fit in memory.
+ *
+ *   g++ -O2 -fopenmp -o uniq_bench uniq_bench.cc
+ *   ./uniq_bench [max_records] [skip_map_above]
+ */
+#include <iostream>
+#include <map>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <omp.h>
+#include "../common.h"
+#include "../analysis/uniq_engine.h"
+
+using namespace std;
+
+#define BLOCK_LEN (65536)
+
+typedef map<intptr_t, pair<size_t, uint32_t> > addr_map;
+
+struct Result {
+  size_t count;
+  size_t bytes_read;
+  size_t num_uniq;
+  size_t uniq_bytes;
+  size_t dup_bytes;
+  double seconds;
+};
+
+/*
+ * Block b of a trace with a footprint of about n / 8 addresses: a mix
+ * of streaming reads, random reads and writes.
+ */
+static void GenerateBlock(size_t b, size_t n, vector<MEMREF> &buf) {
+  uint64_t x = HashAddr(b + 1);
+  size_t footprint = max<size_t>(n / 8, 1024);
+  buf.resize(BLOCK_LEN);
+  for (size_t i = 0; i < BLOCK_LEN; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    MEMREF &mr = buf[i];
+    size_t idx = (x & 3) ? (b * BLOCK_LEN + i) % footprint : (x >> 8) % footprint;
+    mr.addr = 0x10000000 + (intptr_t)idx * 8;
+    mr.type = ((x >> 4) & 7) == 0 ? TRACE_WRITE : TRACE_READ;
+    mr.size = 1 << ((x >> 2) & 3);
+  }
+}
+
+static Result RunMap(size_t num_blocks, size_t n) {
+  Result r = {0, 0, 0, 0, 0, 0};
+  size_t count = 0, bytes_read = 0;
+  int num_maps = 0;
+  addr_map *rm = NULL;
+  double start = omp_get_wtime();
+#pragma omp parallel reduction(+:count, bytes_read)
+  {
+#pragma omp single
+    {
+      num_maps = omp_get_num_threads();
+      rm = new addr_map[num_maps];
+    }
+    int tid = omp_get_thread_num();
+    vector<MEMREF> buf;
+#pragma omp for schedule(static)
+    for (size_t b = 0; b < num_blocks; ++b) {
+      GenerateBlock(b, n, buf);
+      for (size_t i = 0; i < buf.size(); ++i) {
+        const MEMREF &mr = buf[i];
+        if (mr.type == TRACE_READ) {
+          pair<addr_map::iterator, bool> ret = rm[tid].insert(
+              make_pair(mr.addr, make_pair(1, mr.size)));
+          if (!ret.second) {
+            ++ret.first->second.first;
+            ret.first->second.second = max(ret.first->second.second, mr.size);
+          }
+          bytes_read += mr.size;
+        }
+        ++count;
+      }
+    }
+  }
+  for (int i = 1; i < num_maps; ++i) {
+    for (addr_map::iterator it = rm[i].begin(); it != rm[i].end(); ++it) {
+      pair<addr_map::iterator, bool> ret = rm[0].insert(*it);
+      if (!ret.second) {
+        ret.first->second.first += it->second.first;
+        ret.first->second.second = max(ret.first->second.second,
+                                       it->second.second);
+      }
+    }
+  }
+  for (addr_map::iterator it = rm[0].begin(); it != rm[0].end(); ++it) {
+    r.uniq_bytes += it->second.second;
+    r.dup_bytes += it->second.first * it->second.second;
+  }
+  r.num_uniq = rm[0].size();
+  r.seconds = omp_get_wtime() - start;
+  r.count = count;
+  r.bytes_read = bytes_read;
+  delete[] rm;
+  return r;
+}
+
+static Result RunEngine(size_t num_blocks, size_t n) {
+  Result r = {0, 0, 0, 0, 0, 0};
+  size_t count = 0, bytes_read = 0;
+  UniqEngine *engine = NULL;
+  double start = omp_get_wtime();
+#pragma omp parallel reduction(+:count, bytes_read)
+  {
+    int num_threads = omp_get_num_threads();
+#pragma omp single
+    engine = new UniqEngine(num_threads);
+    int tid = omp_get_thread_num();
+    vector<MEMREF> buf;
+    size_t num_rounds = (num_blocks + num_threads - 1) / num_threads;
+    for (size_t round = 0; round < num_rounds; ++round) {
+      size_t b = round * num_threads + tid;
+      if (b < num_blocks) {
+        GenerateBlock(b, n, buf);
+        for (size_t i = 0; i < buf.size(); ++i) {
+          const MEMREF &mr = buf[i];
+          if (mr.type == TRACE_READ) {
+            engine->Add(tid, mr.addr, mr.size);
+            bytes_read += mr.size;
+          }
+          ++count;
+        }
+      }
+#pragma omp barrier
+      engine->Apply(tid);
+#pragma omp barrier
+    }
+  }
+  r.num_uniq = engine->NumUniq();
+  engine->ReadBytes(&r.uniq_bytes, &r.dup_bytes);
+  r.seconds = omp_get_wtime() - start;
+  r.count = count;
+  r.bytes_read = bytes_read;
+  delete engine;
+  return r;
+}
+
+/* Keeps the generate-only pass from being optimized away */
+static volatile size_t sink;
+
+static double RunGenerateOnly(size_t num_blocks, size_t n) {
+  double start = omp_get_wtime();
+  size_t sum = 0;
+#pragma omp parallel reduction(+:sum)
+  {
+    vector<MEMREF> buf;
+#pragma omp for schedule(static)
+    for (size_t b = 0; b < num_blocks; ++b) {
+      GenerateBlock(b, n, buf);
+      sum += buf[0].size;
+    }
+  }
+  sink = sum;
+  return omp_get_wtime() - start;
+}
+
+static void Print(const char *name, const Result &r) {
+  printf("  %-8s %10.3f s %10.2f Mrecords/s  uniq %zu  uniq bytes %zu  "
+         "dup bytes %zu\n", name, r.seconds, r.count / r.seconds / 1e6,
+         r.num_uniq, r.uniq_bytes, r.dup_bytes);
+}
+
+int main(int argc, char *argv[]) {
+  size_t max_records = argc > 1 ? strtoull(argv[1], NULL, 10) : 100000000;
+  size_t skip_map_above = argc > 2 ? strtoull(argv[2], NULL, 10) : 100000000;
+  printf("Threads: %d\n", omp_get_max_threads());
+  for (size_t n = 1000000; n <= max_records; n *= 10) {
+    size_t num_blocks = (n + BLOCK_LEN - 1) / BLOCK_LEN;
+    printf("Records: %zu\n", num_blocks * BLOCK_LEN);
+    printf("  generate %10.3f s\n", RunGenerateOnly(num_blocks, n));
+    Result e = RunEngine(num_blocks, n);
+    Print("engine", e);
+    if (n > skip_map_above) continue;
+    Result m = RunMap(num_blocks, n);
+    Print("map", m);
+    if (m.count != e.count || m.bytes_read != e.bytes_read ||
+        m.num_uniq != e.num_uniq || m.uniq_bytes != e.uniq_bytes ||
+        m.dup_bytes != e.dup_bytes) {
+      printf("ERROR! Results differ\n");
+      return EXIT_FAILURE;
+    }
+    printf("  speedup  %10.2f\n", m.seconds / e.seconds);
+  }
+  return EXIT_SUCCESS;
+}
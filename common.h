@@ -7,15 +7,86 @@ enum {
   TRACE_READ,
   TRACE_WRITE,
   TRACE_FUNC_CALL,
-  TRACE_FUNC_RET
+  TRACE_FUNC_RET,
+  TRACE_ALLOC,
+  TRACE_FREE
 };
 
+/*
+ * A memory access, a call to or return from a traced function, or a
+ * heap allocation or free. For calls and returns, addr is the address
+ * of the function and size is its id in the tracer's functions table.
+ *
+ * An allocation is two TRACE_ALLOC records in a row: the first has the
+ * address of the block and the second its size in bytes, in addr. Both
+ * carry in size the id of the call site in the tracer's allocation sites
+ * table. A free has the address of the block, and 0 in size.
+ */
 struct MEMREF {
   intptr_t addr;
   uint32_t type;
   uint32_t size;
 };
 
+/*
+ * A MEMREF packed into 8 bytes: the low 48 bits of the address, which
+ * is sign-extended back, the type in 3 bits and the size in 13 bits.
+ * Larger sizes, such as the ids of functions and allocation sites above
+ * 8190, saturate at PACKED_SIZE_MAX; PackedChunk keeps them aside.
+ */
+struct PACKED_MEMREF {
+  uint64_t bits;
+};
+
+#define PACKED_ADDR_BITS (48)
+#define PACKED_TYPE_BITS (3)
+#define PACKED_SIZE_MAX ((1U << (64 - PACKED_ADDR_BITS - PACKED_TYPE_BITS)) - 1)
+
+static inline PACKED_MEMREF PackMemref(intptr_t addr, uint32_t type,
+                                       uint32_t size) {
+  PACKED_MEMREF p;
+  p.bits = ((uint64_t)addr & ((1ULL << PACKED_ADDR_BITS) - 1)) |
+      ((uint64_t)type << PACKED_ADDR_BITS) |
+      ((uint64_t)(size < PACKED_SIZE_MAX ? size : PACKED_SIZE_MAX)
+       << (PACKED_ADDR_BITS + PACKED_TYPE_BITS));
+  return p;
+}
+
+static inline intptr_t PackedAddr(PACKED_MEMREF p) {
+  return (intptr_t)((int64_t)(p.bits << (64 - PACKED_ADDR_BITS)) >>
+                    (64 - PACKED_ADDR_BITS));
+}
+
+static inline uint32_t PackedType(PACKED_MEMREF p) {
+  return (uint32_t)(p.bits >> PACKED_ADDR_BITS) & ((1U << PACKED_TYPE_BITS) - 1);
+}
+
+static inline uint32_t PackedSize(PACKED_MEMREF p) {
+  return (uint32_t)(p.bits >> (PACKED_ADDR_BITS + PACKED_TYPE_BITS));
+}
+
+/*
+ * Buffer record of the tracer with -timestamp or -pc: a MEMREF followed
+ * by the time stamp counter, which orders the records of different
+ * threads, and the id of the instruction that made the record. Fields
+ * that are not enabled are left unfilled.
+ */
+struct MEMREF_EXT {
+  MEMREF ref;
+  uint64_t ts;
+  uint32_t pc;
+  uint32_t reserved;
+};
+
+/*
+ * Summary of the reads of one address (or cache line): the number of
+ * reads and the largest read size.
+ */
+struct READSTAT {
+  uint64_t count;
+  uint32_t size;
+};
+
 #endif /* COMMON_H_ */
 
 
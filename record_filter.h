@@ -0,0 +1,124 @@
+#ifndef RECORD_FILTER_H_
+#define RECORD_FILTER_H_
+
+/*
+ * Reduction stage for buffers of records before they are written. It
+ * drops memory accesses that
+ *
+ *   - touch the same cache line with the same type as the last record
+ *     kept before them (coalescing),
+ *   - fall in the drop range, such as the stack of the thread,
+ *   - fall outside all keep ranges, when keep ranges are given.
+ *
+ * Calls and returns are always kept. Records are compacted in place by
+ * a loop without data-dependent branches: every record is copied to the
+ * output position, which only advances when the record is kept.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "common.h"
+
+/* Number of records dropped by each rule */
+struct FilterStats {
+  uint64_t in;
+  uint64_t coalesced;
+  uint64_t stack;
+  uint64_t range;
+};
+
+class RecordFilter {
+ public:
+  RecordFilter()
+      : _line_mask(~(uintptr_t)0), _coalesce(0), _drop_lo(0), _drop_len(0),
+        _prev_key(~(uintptr_t)0) {
+    Reset();
+  }
+
+  /* Coalesces accesses to lines of line_size bytes, a power of two of at
+   * least 8, or turns coalescing off with 0. */
+  void SetLineSize(size_t line_size) {
+    _coalesce = line_size != 0;
+    _line_mask = line_size ? ~(uintptr_t)(line_size - 1) : ~(uintptr_t)0;
+  }
+
+  /* Drops accesses to [lo, hi). */
+  void SetDropRange(uintptr_t lo, uintptr_t hi) {
+    _drop_lo = lo;
+    _drop_len = hi > lo ? hi - lo : 0;
+  }
+
+  /* Keeps only accesses to [lo, hi) and the other keep ranges. */
+  void AddKeepRange(uintptr_t lo, uintptr_t hi) {
+    _keep_lo.push_back(lo);
+    _keep_len.push_back(hi > lo ? hi - lo : 0);
+  }
+
+  bool Active() const {
+    return _coalesce || _drop_len || !_keep_lo.empty();
+  }
+
+  /*
+   * Filters the n records in refs, and their timestamps in ts and
+   * instruction ids in pc unless these are NULL, in place. Returns the
+   * number of records kept.
+   */
+  size_t Apply(MEMREF *refs, uint64_t *ts, uint32_t *pc, size_t n) {
+    const size_t num_keep = _keep_lo.size();
+    const uintptr_t *keep_lo = num_keep ? &_keep_lo[0] : NULL;
+    const uintptr_t *keep_len = num_keep ? &_keep_len[0] : NULL;
+    uintptr_t prev_key = _prev_key;
+    uint64_t coalesced = 0, stack = 0, range = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < n; ++i) {
+      MEMREF r = refs[i];
+      uintptr_t a = (uintptr_t)r.addr;
+      // Line sizes of 8 and more leave room for the type in the key
+      uintptr_t key = (a & _line_mask) | r.type;
+      unsigned access = r.type <= TRACE_WRITE;
+      unsigned dup = _coalesce & (key == prev_key) & access;
+      unsigned in_stack = (a - _drop_lo) < _drop_len;
+      unsigned in_keep = num_keep == 0;
+      for (size_t k = 0; k < num_keep; ++k) {
+        in_keep |= (a - keep_lo[k]) < keep_len[k];
+      }
+      unsigned drop_stack = access & !dup & in_stack;
+      unsigned drop_range = access & !dup & !in_stack & !in_keep;
+      coalesced += dup;
+      stack += drop_stack;
+      range += drop_range;
+      unsigned keep = !(dup | drop_stack | drop_range);
+      // Compare with the last record written, not one dropped since
+      prev_key = keep ? key : prev_key;
+      refs[j] = r;
+      if (ts) ts[j] = ts[i];
+      if (pc) pc[j] = pc[i];
+      j += keep;
+    }
+    _prev_key = prev_key;
+    _stats.in += n;
+    _stats.coalesced += coalesced;
+    _stats.stack += stack;
+    _stats.range += range;
+    return j;
+  }
+
+  const FilterStats &Stats() const { return _stats; }
+  void Reset() {
+    _stats.in = _stats.coalesced = _stats.stack = _stats.range = 0;
+    _prev_key = ~(uintptr_t)0;
+  }
+
+ private:
+  uintptr_t _line_mask;
+  unsigned _coalesce;
+  uintptr_t _drop_lo;
+  uintptr_t _drop_len;
+  std::vector<uintptr_t> _keep_lo;
+  std::vector<uintptr_t> _keep_len;
+  uintptr_t _prev_key;
+  FilterStats _stats;
+};
+
+#endif /* RECORD_FILTER_H_ */
@@ -0,0 +1,126 @@
+#ifndef STAGING_ALLOC_H_
+#define STAGING_ALLOC_H_
+
+/*
+ * Allocator for the staging buffers the tracer splits, encodes and
+ * formats trace buffers into before writing them.
+ *
+ * With huge pages on (SetStagingHugePages), allocations of at least one
+ * huge page are mapped on their own, aligned to the huge page size, and
+ * advised MADV_HUGEPAGE, so that the encoders sweep a buffer through a
+ * few TLB entries instead of one per 4K page. Smaller allocations, and
+ * all allocations with huge pages off, come from operator new. Huge
+ * pages must be switched on before the first allocation.
+ *
+ * The tool is built without exceptions, so a mapping that fails ends
+ * the process with a message, as the tool's other allocation failures
+ * do, instead of throwing.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <new>
+
+#define STAGING_HUGE_PAGE ((size_t)2 << 20)
+
+static inline bool &StagingHugePagesFlag() {
+  static bool on = false;
+  return on;
+}
+
+static inline void SetStagingHugePages(bool on) {
+  StagingHugePagesFlag() = on;
+}
+
+/* Whether an allocation of bytes is mapped on huge pages */
+static inline bool StagingOnHugePages(size_t bytes) {
+  return StagingHugePagesFlag() && bytes >= STAGING_HUGE_PAGE;
+}
+
+static inline size_t StagingMappedSize(size_t bytes) {
+  return (bytes + STAGING_HUGE_PAGE - 1) & ~(STAGING_HUGE_PAGE - 1);
+}
+
+static inline void *StagingAllocate(size_t bytes) {
+  if (!StagingOnHugePages(bytes)) return ::operator new(bytes);
+  size_t size = StagingMappedSize(bytes);
+  // Map one huge page more and trim both ends to align the start
+  size_t span = size + STAGING_HUGE_PAGE;
+  void *p = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "Error: could not map %lu bytes of staging buffer.\n",
+            (unsigned long)span);
+    exit(1);
+  }
+  uintptr_t start = (uintptr_t)p;
+  uintptr_t aligned = (start + STAGING_HUGE_PAGE - 1) &
+      ~(uintptr_t)(STAGING_HUGE_PAGE - 1);
+  if (aligned > start) munmap(p, aligned - start);
+  size_t tail = start + span - (aligned + size);
+  if (tail) munmap((void *)(aligned + size), tail);
+#ifdef MADV_HUGEPAGE
+  // A hint only; without transparent huge pages the mapping still works
+  madvise((void *)aligned, size, MADV_HUGEPAGE);
+#endif
+  return (void *)aligned;
+}
+
+static inline void StagingFree(void *p, size_t bytes) {
+  if (!p) return;
+  if (StagingOnHugePages(bytes)) {
+    munmap(p, StagingMappedSize(bytes));
+  } else {
+    ::operator delete(p);
+  }
+}
+
+template <typename T>
+class StagingAllocator {
+ public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T &reference;
+  typedef const T &const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <typename U>
+  struct rebind {
+    typedef StagingAllocator<U> other;
+  };
+
+  StagingAllocator() {}
+  template <typename U>
+  StagingAllocator(const StagingAllocator<U> &) {}
+
+  pointer address(reference x) const { return &x; }
+  const_pointer address(const_reference x) const { return &x; }
+
+  pointer allocate(size_type n, const void * = 0) {
+    return static_cast<pointer>(StagingAllocate(n * sizeof(T)));
+  }
+  void deallocate(pointer p, size_type n) { StagingFree(p, n * sizeof(T)); }
+
+  size_type max_size() const { return (size_t)-1 / sizeof(T); }
+  void construct(pointer p, const T &value) { new (p) T(value); }
+  void destroy(pointer p) { p->~T(); }
+};
+
+template <typename T, typename U>
+static inline bool operator==(const StagingAllocator<T> &,
+                              const StagingAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+static inline bool operator!=(const StagingAllocator<T> &,
+                              const StagingAllocator<U> &) {
+  return false;
+}
+
+#endif /* STAGING_ALLOC_H_ */
@@ -0,0 +1,86 @@
+/*
+ * Checks that analysis/hot_pc charges every access to its instruction in
+ * a trace with allocation records, which carry instruction ids too.
+ *
+ *   g++ -O2 -o hot_pc_test hot_pc_test.cc
+ *   ./hot_pc_test HOT_PC TRACE
+ *
+ * Writes to TRACE an allocation, then 100 accesses from instruction 7
+ * and 100 from instruction 9, runs HOT_PC on it and compares the
+ * accesses it reports per instruction.
+ */
+#include <iostream>
+#include <map>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include "../common.h"
+#include "../trace_format.h"
+
+using namespace std;
+
+static bool WriteTrace(const char *path) {
+  FILE *fp = fopen(path, "wb");
+  TraceWriter writer;
+  if (!fp || !writer.Open(fp, true, TRACE_HAS_PC)) return false;
+  MEMREF block = { 0x10000, TRACE_ALLOC, 3 };
+  MEMREF size = { 4096, TRACE_ALLOC, 3 };
+  // The allocation is made by an instruction of the site
+  writer.Append(block, 0, 0, 1);
+  writer.Append(size, 0, 0, 1);
+  for (int i = 0; i < 100; ++i) {
+    MEMREF mr = { 0x10000 + 8 * i, TRACE_READ, 8 };
+    writer.Append(mr, 0, 0, 7);
+  }
+  for (int i = 0; i < 100; ++i) {
+    MEMREF mr = { 0x10000 + 8 * i, TRACE_WRITE, 8 };
+    writer.Append(mr, 0, 0, 9);
+  }
+  return writer.Flush() && fclose(fp) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    cerr << "Usage: " << argv[0] << " HOT_PC TRACE" << endl;
+    return EXIT_FAILURE;
+  }
+  if (!WriteTrace(argv[2])) {
+    cerr << "ERROR! Cannot write " << argv[2] << endl;
+    return EXIT_FAILURE;
+  }
+  string command = string(argv[1]) + " -p /dev/null " + argv[2];
+  FILE *out = popen(command.c_str(), "r");
+  if (!out) {
+    cerr << "ERROR! Cannot run " << argv[1] << endl;
+    return EXIT_FAILURE;
+  }
+  // Rows of the report: id, bytes%, bytes, accesses, ...
+  map<unsigned, unsigned long long> accesses;
+  char line[1024];
+  while (fgets(line, sizeof(line), out)) {
+    unsigned id;
+    double percent;
+    unsigned long long bytes, n;
+    if (sscanf(line, "%u %lf %llu %llu", &id, &percent, &bytes, &n) == 4) {
+      accesses[id] = n;
+    }
+  }
+  if (pclose(out) != 0) {
+    cerr << "ERROR! " << argv[1] << " failed" << endl;
+    return EXIT_FAILURE;
+  }
+  map<unsigned, unsigned long long> expected;
+  expected[7] = 100;
+  expected[9] = 100;
+  if (accesses != expected) {
+    cerr << "FAILED: accesses by instruction:";
+    for (map<unsigned, unsigned long long>::iterator it = accesses.begin();
+         it != accesses.end(); ++it) {
+      cerr << " " << it->first << "=" << it->second;
+    }
+    cerr << ", expected 7=100 9=100" << endl;
+    return EXIT_FAILURE;
+  }
+  cout << "Success." << endl;
+  return EXIT_SUCCESS;
+}
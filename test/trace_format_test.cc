@@ -0,0 +1,96 @@
+/*
+ * Checks that EncodeBound holds records whose fields are all at their
+ * largest, and that such records decode back unchanged.
+ *
+ *   g++ -O2 -o trace_format_test trace_format_test.cc
+ *   ./trace_format_test
+ *
+ * Records have the largest size and thread, and alternate the others
+ * between values whose deltas have the largest zigzag encoding.
+ */
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include "../common.h"
+#include "../trace_format.h"
+
+using namespace std;
+
+#define NUM_RECORDS (1000)
+
+/* Records with the largest sizes and deltas, in both directions */
+static void MakeRecords(vector<MEMREF> &refs, TraceFields &fields) {
+  refs.resize(NUM_RECORDS);
+  fields.ts.resize(NUM_RECORDS);
+  fields.tid.resize(NUM_RECORDS);
+  fields.pc.resize(NUM_RECORDS);
+  // Accesses and markers keep separate previous addresses
+  bool flip[2] = {false, false};
+  for (size_t i = 0; i < NUM_RECORDS; ++i) {
+    bool odd = i & 1;
+    MEMREF &mr = refs[i];
+    mr.type = (i & 2) ? TRACE_FUNC_CALL : TRACE_WRITE;
+    mr.size = 0xffffffff;
+    // A delta of -2^63, or 2^63 wrapped to it, zigzags to 2^64 - 1
+    bool &f = flip[IsMarkerType(mr.type)];
+    mr.addr = f ? 0 : INTPTR_MIN;
+    f = !f;
+    fields.ts[i] = odd ? 0 : (uint64_t)1 << 63;
+    fields.tid[i] = 0xffffffff;
+    fields.pc[i] = odd ? 0 : 0xffffffff;
+  }
+}
+
+static bool SameRecords(const vector<MEMREF> &a, const TraceFields &fa,
+                        const vector<MEMREF> &b, const TraceFields &fb) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].addr != b[i].addr || a[i].type != b[i].type ||
+        a[i].size != b[i].size) {
+      return false;
+    }
+  }
+  return fa.ts == fb.ts && fa.tid == fb.tid && fa.pc == fb.pc;
+}
+
+int main() {
+  vector<MEMREF> refs;
+  TraceFields fields;
+  MakeRecords(refs, fields);
+  bool ok = true;
+
+  // Encode into a buffer larger than any bound, then compare
+  vector<uint8_t> raw(NUM_RECORDS * 64);
+  size_t size = EncodeRecords(&refs[0], NUM_RECORDS, &fields.ts[0],
+                              &fields.tid[0], &fields.pc[0], &raw[0]);
+  if (size > EncodeBound(NUM_RECORDS)) {
+    cerr << "FAILED: " << NUM_RECORDS << " records encode to " << size
+         << " bytes, above the bound of " << EncodeBound(NUM_RECORDS)
+         << endl;
+    ok = false;
+  }
+
+  for (int compress = 0; compress < 2; ++compress) {
+    vector<uint8_t> scratch;
+    vector<uint8_t> block;
+    EncodeBlock(&refs[0], &fields.ts[0], &fields.tid[0], &fields.pc[0],
+                NUM_RECORDS, compress != 0, scratch, block);
+    TraceBlockHeader bh;
+    memcpy(&bh, &block[0], sizeof(bh));
+    vector<MEMREF> decoded;
+    TraceFields decoded_fields;
+    if (!BlockHeaderValid(bh) ||
+        !DecodeBlock(bh, &block[sizeof(bh)], scratch, decoded,
+                     &decoded_fields) ||
+        !SameRecords(refs, fields, decoded, decoded_fields)) {
+      cerr << "FAILED: records do not decode back"
+           << (compress ? " with compression" : "") << endl;
+      ok = false;
+    }
+  }
+
+  if (!ok) return EXIT_FAILURE;
+  cout << "Success." << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,127 @@
+#ifndef TEXT_FORMAT_H_
+#define TEXT_FORMAT_H_
+
+/*
+ * Text serializer for MEMREF records. Produces the same bytes as
+ *
+ *   fprintf(fp, "%d %p %u\n", mr.type, (void*)mr.addr, mr.size);
+ *
+ * with glibc, including "(nil)" for null addresses, but formats a whole
+ * buffer at once with table-driven conversions. Records with timestamps
+ * get the timestamp in decimal as a fourth column, and records with
+ * instruction ids get the id prefixed with '#' as the last column.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+
+/* Upper bound of the text size of one record */
+#define TEXT_RECORD_MAX (48)
+/* Upper bound of the text size of the timestamp column */
+#define TEXT_TIMESTAMP_MAX (24)
+/* Upper bound of the text size of the instruction id column */
+#define TEXT_PC_MAX (12)
+
+static const char text_hex_digits[513] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const char text_dec_digits[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+/* Writes v in decimal and returns the end of the output. */
+static inline char *FormatDec(char *p, uint64_t v) {
+  char tmp[20];
+  char *t = tmp + sizeof(tmp);
+  while (v >= 100) {
+    uint32_t r = (uint32_t)(v % 100) * 2;
+    v /= 100;
+    *--t = text_dec_digits[r + 1];
+    *--t = text_dec_digits[r];
+  }
+  if (v >= 10) {
+    *--t = text_dec_digits[v * 2 + 1];
+    *--t = text_dec_digits[v * 2];
+  } else {
+    *--t = (char)('0' + v);
+  }
+  size_t len = tmp + sizeof(tmp) - t;
+  memcpy(p, t, len);
+  return p + len;
+}
+
+/* Same as %p: 0x-prefixed lowercase hex without leading zeros. */
+static inline char *FormatPtr(char *p, uint64_t v) {
+  if (v == 0) {
+    memcpy(p, "(nil)", 5);
+    return p + 5;
+  }
+  *p++ = '0';
+  *p++ = 'x';
+  int bits = 64 - __builtin_clzll(v);
+  int digits = (bits + 3) / 4;
+  char *end = p + digits;
+  char *t = end;
+  while (v >= 0x100) {
+    t -= 2;
+    memcpy(t, text_hex_digits + (v & 0xff) * 2, 2);
+    v >>= 8;
+  }
+  if (v >= 0x10) {
+    t -= 2;
+    memcpy(t, text_hex_digits + v * 2, 2);
+  } else {
+    *--t = text_hex_digits[v * 2 + 1];
+  }
+  return end;
+}
+
+/*
+ * Formats n records into out, which must hold n * TEXT_RECORD_MAX
+ * bytes, plus n * TEXT_TIMESTAMP_MAX bytes with timestamps ts and
+ * n * TEXT_PC_MAX bytes with instruction ids pc. Returns the number of
+ * bytes written.
+ */
+static inline size_t FormatTextRecords(const MEMREF *refs, size_t n, char *out,
+                                       const uint64_t *ts = NULL,
+                                       const uint32_t *pc = NULL) {
+  char *p = out;
+  for (size_t i = 0; i < n; ++i) {
+    const MEMREF &mr = refs[i];
+    int32_t type = (int32_t)mr.type;
+    if (type < 0) {
+      *p++ = '-';
+      p = FormatDec(p, 0U - (uint32_t)type);
+    } else {
+      p = FormatDec(p, (uint32_t)type);
+    }
+    *p++ = ' ';
+    p = FormatPtr(p, (uint64_t)(uintptr_t)mr.addr);
+    *p++ = ' ';
+    p = FormatDec(p, mr.size);
+    if (ts) {
+      *p++ = ' ';
+      p = FormatDec(p, ts[i]);
+    }
+    if (pc) {
+      *p++ = ' ';
+      *p++ = '#';
+      p = FormatDec(p, pc[i]);
+    }
+    *p++ = '\n';
+  }
+  return p - out;
+}
+
+#endif /* TEXT_FORMAT_H_ */
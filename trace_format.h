@@ -0,0 +1,794 @@
+#ifndef TRACE_FORMAT_H_
+#define TRACE_FORMAT_H_
+
+/*
+ * Binary trace format shared by MemoryTracer and the analysis tools.
+ *
+ *   file  := TraceFileHeader block*
+ *   block := TraceBlockHeader payload[comp_size]
+ *
+ * A block holds the records of one buffer flush. Records are encoded
+ * into a byte stream of
+ *
+ *   varint(type | size << TRACE_TYPE_BITS)
+ *   varint(zigzag(addr - previous addr of the same kind))
+ *
+ * where memory accesses and call/return markers keep separate previous
+ * addresses so that markers do not disturb the access deltas. Blocks
+ * whose flags say so append optional fields to every record:
+ *
+ *   varint(zigzag(timestamp - previous timestamp))   TRACE_BLOCK_TIMESTAMP
+ *   varint(thread id)                                 TRACE_BLOCK_THREAD
+ *   varint(zigzag(pc id - previous pc id))            TRACE_BLOCK_PC
+ *
+ * The encoded stream is compressed with a small LZ77 block compressor
+ * and stored uncompressed when compression does not pay off. All deltas
+ * restart at each block, so blocks can be decoded independently.
+ *
+ * Files that do not start with TRACE_MAGIC are read as the legacy raw
+ * MEMREF dumps written by earlier versions of the tracer.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include "common.h"
+
+#define TRACE_MAGIC "MTRACE\r\n"
+#define TRACE_VERSION (1)
+#define TRACE_BLOCK_SYNC (0x4b4c424dU)  /* "MBLK" */
+#define TRACE_TYPE_BITS (4)
+/* Number of records per chunk when reading legacy raw traces */
+#define TRACE_LEGACY_CHUNK (1024)
+/* Default number of records per block for TraceWriter::Append */
+#define TRACE_BLOCK_RECORDS (65536)
+
+/* TraceFileHeader flags: optional fields carried by every record */
+enum {
+  TRACE_HAS_TIMESTAMP = 1,
+  TRACE_HAS_THREAD = 2,
+  TRACE_HAS_PC = 4
+};
+
+/* TraceBlockHeader flags */
+enum {
+  TRACE_BLOCK_COMPRESSED = 1,
+  TRACE_BLOCK_TIMESTAMP = 2,
+  TRACE_BLOCK_THREAD = 4,
+  TRACE_BLOCK_PC = 8
+};
+
+/* Sampling modes of the tracer */
+enum {
+  TRACE_SAMPLE_NONE,
+  TRACE_SAMPLE_INVOCATION,  /* every sample_period-th invocation */
+  TRACE_SAMPLE_BURST,       /* sample_length of every sample_period records */
+  TRACE_SAMPLE_RANDOM       /* each record with probability sample_fraction */
+};
+
+/*
+ * Sampling parameters of a trace. sample_fraction is the expected
+ * fraction of the records that were kept; counts taken from the trace
+ * are scaled by its inverse.
+ */
+struct TraceSampling {
+  uint32_t sample_mode;
+  uint32_t reserved;
+  uint64_t sample_length;
+  uint64_t sample_period;
+  double sample_fraction;
+};
+
+/*
+ * Fields are only ever appended to the file header; readers take the
+ * first header_size bytes and leave later fields zero.
+ */
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  uint32_t flags;
+  uint32_t reserved;
+  TraceSampling sampling;
+};
+
+/* Factor that scales counts of a sampled trace to the full run */
+static inline double SampleScale(const TraceFileHeader &fh) {
+  if (fh.sampling.sample_mode == TRACE_SAMPLE_NONE ||
+      !(fh.sampling.sample_fraction > 0)) {
+    return 1.0;
+  }
+  return 1.0 / fh.sampling.sample_fraction;
+}
+
+static inline bool HasTraceMagic(const void *p, size_t len) {
+  return len >= sizeof(TRACE_MAGIC) - 1 &&
+      memcmp(p, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1) == 0;
+}
+
+/*
+ * Reads the file header from the first len bytes at p, which start
+ * with TRACE_MAGIC. Fields the file does not have are left zero.
+ */
+static inline bool ParseFileHeader(const void *p, size_t len,
+                                   TraceFileHeader *fh) {
+  const size_t min_size = offsetof(TraceFileHeader, sampling);
+  memset(fh, 0, sizeof(*fh));
+  if (len < min_size) return false;
+  memcpy(fh, p, min_size);
+  if (fh->header_size < min_size || fh->header_size > len) return false;
+  memcpy(fh, p, std::min<size_t>(fh->header_size, sizeof(*fh)));
+  return true;
+}
+
+/*
+ * Optional fields of the records of a block, parallel to the records.
+ * A vector is empty when the block does not carry the field. pc holds
+ * the ids of the instructions that made the records, which the tracer
+ * lists in its .pcs table.
+ */
+struct TraceFields {
+  std::vector<uint64_t> ts;
+  std::vector<uint32_t> tid;
+  std::vector<uint32_t> pc;
+};
+
+struct TraceBlockHeader {
+  uint32_t sync;
+  uint32_t num_records;
+  uint32_t raw_size;
+  uint32_t comp_size;
+  uint32_t flags;
+  uint32_t check;
+};
+
+/* ===================================================================== */
+// Varint encoding
+/* ===================================================================== */
+
+static inline uint8_t *PutVarint(uint8_t *p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+/* Returns NULL if the varint runs past end. */
+static inline const uint8_t *GetVarint(const uint8_t *p, const uint8_t *end,
+                                       uint64_t *v) {
+  // Most deltas and sizes take one or two bytes
+  if (p < end && p[0] < 0x80) {
+    *v = p[0];
+    return p + 1;
+  }
+  if (end - p >= 2 && p[1] < 0x80) {
+    *v = (uint64_t)(p[0] & 0x7f) | ((uint64_t)p[1] << 7);
+    return p + 2;
+  }
+  uint64_t r = 0;
+  for (int shift = 0; p < end && shift < 64; shift += 7) {
+    uint8_t b = *p++;
+    r |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *v = r;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+static inline uint64_t ZigZag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t UnZigZag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static inline bool IsMarkerType(uint32_t type) {
+  return type == TRACE_FUNC_CALL || type == TRACE_FUNC_RET;
+}
+
+/* Largest size of a varint of a value of the given number of bits */
+#define VARINT_MAX_BYTES(bits) (((bits) + 6) / 7)
+
+/*
+ * Largest encoded size of a record with all optional fields: its type
+ * and size, the zigzag deltas of its 64-bit address and timestamp, its
+ * thread, and the zigzag delta of two 32-bit instruction ids.
+ */
+#define TRACE_RECORD_MAX_BYTES                                      \
+  (VARINT_MAX_BYTES(32 + TRACE_TYPE_BITS) + VARINT_MAX_BYTES(64) +  \
+   VARINT_MAX_BYTES(64) + VARINT_MAX_BYTES(32) + VARINT_MAX_BYTES(34))
+
+/* Upper bound of the encoded size of n records with all optional fields */
+static inline size_t EncodeBound(size_t n) {
+  return n * TRACE_RECORD_MAX_BYTES;
+}
+
+/*
+ * Encodes n records into out, which must hold EncodeBound(n) bytes. ts,
+ * tid and pc are the optional fields, or NULL when absent.
+ */
+static inline size_t EncodeRecords(const MEMREF *refs, size_t n,
+                                   const uint64_t *ts, const uint32_t *tid,
+                                   const uint32_t *pc, uint8_t *out) {
+  uint8_t *p = out;
+  intptr_t prev[2] = {0, 0};
+  uint64_t prev_ts = 0;
+  uint32_t prev_pc = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const MEMREF &mr = refs[i];
+    int k = IsMarkerType(mr.type);
+    p = PutVarint(p, (uint64_t)mr.type | ((uint64_t)mr.size << TRACE_TYPE_BITS));
+    // Deltas wrap around, as the decoder adds them back
+    p = PutVarint(p, ZigZag((int64_t)((uint64_t)mr.addr - (uint64_t)prev[k])));
+    prev[k] = mr.addr;
+    if (ts) {
+      p = PutVarint(p, ZigZag((int64_t)(ts[i] - prev_ts)));
+      prev_ts = ts[i];
+    }
+    if (tid) p = PutVarint(p, tid[i]);
+    if (pc) {
+      p = PutVarint(p, ZigZag((int64_t)pc[i] - (int64_t)prev_pc));
+      prev_pc = pc[i];
+    }
+  }
+  return p - out;
+}
+
+/* Decoder output that stores records into a MEMREF array */
+struct MemrefOutput {
+  MEMREF *refs;
+  void Set(size_t i, intptr_t addr, uint32_t type, uint32_t size) {
+    refs[i].addr = addr;
+    refs[i].type = type;
+    refs[i].size = size;
+  }
+};
+
+/*
+ * Decodes n records into out, which has room for them and stores record
+ * i with out.Set(i, addr, type, size). flags are the TRACE_BLOCK_* flags
+ * of the block; ts, tid and pc receive the optional fields, and may be
+ * NULL to skip them.
+ */
+template <class Output>
+static inline bool DecodeRecordsTo(const uint8_t *in, size_t len, size_t n,
+                                   uint32_t flags, Output &out, uint64_t *ts,
+                                   uint32_t *tid, uint32_t *pc) {
+  const uint8_t *p = in;
+  const uint8_t *end = in + len;
+  intptr_t prev[2] = {0, 0};
+  uint64_t prev_ts = 0;
+  uint32_t prev_pc = 0;
+  bool has_ts = flags & TRACE_BLOCK_TIMESTAMP;
+  bool has_tid = flags & TRACE_BLOCK_THREAD;
+  bool has_pc = flags & TRACE_BLOCK_PC;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t tsz, d;
+    if ((p = GetVarint(p, end, &tsz)) == NULL) return false;
+    if ((p = GetVarint(p, end, &d)) == NULL) return false;
+    uint32_t type = (uint32_t)(tsz & ((1 << TRACE_TYPE_BITS) - 1));
+    int k = IsMarkerType(type);
+    intptr_t addr = (intptr_t)((uint64_t)prev[k] + (uint64_t)UnZigZag(d));
+    prev[k] = addr;
+    out.Set(i, addr, type, (uint32_t)(tsz >> TRACE_TYPE_BITS));
+    if (has_ts) {
+      if ((p = GetVarint(p, end, &d)) == NULL) return false;
+      prev_ts += (uint64_t)UnZigZag(d);
+      if (ts) ts[i] = prev_ts;
+    }
+    if (has_tid) {
+      if ((p = GetVarint(p, end, &d)) == NULL) return false;
+      if (tid) tid[i] = (uint32_t)d;
+    }
+    if (has_pc) {
+      if ((p = GetVarint(p, end, &d)) == NULL) return false;
+      prev_pc += (uint32_t)UnZigZag(d);
+      if (pc) pc[i] = prev_pc;
+    }
+  }
+  return p == end;
+}
+
+static inline bool DecodeRecords(const uint8_t *in, size_t len, size_t n,
+                                 uint32_t flags, MEMREF *refs, uint64_t *ts,
+                                 uint32_t *tid, uint32_t *pc) {
+  MemrefOutput out = { refs };
+  return DecodeRecordsTo(in, len, n, flags, out, ts, tid, pc);
+}
+
+/* ===================================================================== */
+// Block compressor
+/* ===================================================================== */
+/*
+ * An LZ77 compressor in the spirit of LZ4. A sequence is
+ *
+ *   token literals offset[2] [extra match length]
+ *
+ * where the upper nibble of the token is the literal length and the
+ * lower nibble is the match length minus LZ_MIN_MATCH. A nibble of 15
+ * is continued by bytes of 255 up to a terminating byte below 255. The
+ * last sequence has literals only.
+ */
+
+#define LZ_MIN_MATCH (4)
+#define LZ_HASH_BITS (14)
+#define LZ_MAX_OFFSET (65535)
+/* Extra bytes BlockDecompress may write past the end of its output */
+#define LZ_COPY_SLACK (16)
+
+static inline size_t CompressBound(size_t n) {
+  return n + n / 255 + 16;
+}
+
+static inline uint32_t LzRead32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t LzHash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *LzPutLength(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+static inline uint8_t *LzPutSequence(uint8_t *op, const uint8_t *lit,
+                                     size_t lit_len, size_t offset,
+                                     size_t match_len) {
+  uint8_t *token = op++;
+  size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+  *token = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) |
+                     (ml < 15 ? ml : 15));
+  if (lit_len >= 15) op = LzPutLength(op, lit_len - 15);
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  if (match_len) {
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (ml >= 15) op = LzPutLength(op, ml - 15);
+  }
+  return op;
+}
+
+/*
+ * Compresses in into out, which must hold CompressBound(len) bytes.
+ * Returns the compressed size.
+ */
+static inline size_t BlockCompress(const uint8_t *in, size_t len, uint8_t *out) {
+  std::vector<uint32_t> table(1 << LZ_HASH_BITS, 0);
+  const uint8_t *ip = in;
+  const uint8_t *anchor = in;
+  const uint8_t *end = in + len;
+  uint8_t *op = out;
+
+  if (len >= LZ_MIN_MATCH + 1) {
+    const uint8_t *limit = end - LZ_MIN_MATCH;
+    while (ip < limit) {
+      uint32_t seq = LzRead32(ip);
+      uint32_t h = LzHash(seq);
+      const uint8_t *ref = in + table[h];
+      table[h] = (uint32_t)(ip - in);
+      if (ref < ip && (size_t)(ip - ref) <= LZ_MAX_OFFSET &&
+          LzRead32(ref) == seq) {
+        const uint8_t *mp = ip + LZ_MIN_MATCH;
+        const uint8_t *rp = ref + LZ_MIN_MATCH;
+        while (mp < end && *mp == *rp) {
+          ++mp;
+          ++rp;
+        }
+        op = LzPutSequence(op, anchor, ip - anchor, ip - ref, mp - ip);
+        ip = anchor = mp;
+      } else {
+        ++ip;
+      }
+    }
+  }
+  return LzPutSequence(op, anchor, end - anchor, 0, 0) - out;
+}
+
+static inline const uint8_t *LzGetLength(const uint8_t *ip, const uint8_t *end,
+                                         size_t *len) {
+  uint8_t b;
+  do {
+    if (ip >= end) return NULL;
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return ip;
+}
+
+/*
+ * Returns false if the input is corrupt or does not decompress to
+ * out_len. out must hold out_len + LZ_COPY_SLACK bytes.
+ */
+static inline bool BlockDecompress(const uint8_t *in, size_t len,
+                                   uint8_t *out, size_t out_len) {
+  const uint8_t *ip = in;
+  const uint8_t *end = in + len;
+  uint8_t *op = out;
+  uint8_t *oend = out + out_len;
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t lit_len = token >> 4;
+    if (lit_len == 15 && (ip = LzGetLength(ip, end, &lit_len)) == NULL)
+      return false;
+    if (lit_len > (size_t)(end - ip) || lit_len > (size_t)(oend - op))
+      return false;
+    if (lit_len <= 16 && end - ip >= 16) {
+      // Short literals: one fixed-size copy, running over like matches
+      memcpy(op, ip, 16);
+    } else {
+      memcpy(op, ip, lit_len);
+    }
+    ip += lit_len;
+    op += lit_len;
+    if (ip == end) break;
+    if (end - ip < 2) return false;
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && (ip = LzGetLength(ip, end, &match_len)) == NULL)
+      return false;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - out) ||
+        match_len > (size_t)(oend - op))
+      return false;
+    const uint8_t *mp = op - offset;
+    uint8_t *mend = op + match_len;
+    if (offset >= 8) {
+      // Copy in words, running over the end by up to LZ_COPY_SLACK bytes
+      for (; op < mend; op += 8, mp += 8) memcpy(op, mp, 8);
+    } else {
+      // The match overlaps its own output. [mp, op) always holds whole
+      // periods of the pattern, so copy it over and over, doubling.
+      while (op < mend) {
+        size_t n = std::min<size_t>(op - mp, mend - op);
+        memcpy(op, mp, n);
+        op += n;
+      }
+    }
+    op = mend;
+  }
+  return op == oend;
+}
+
+/* ===================================================================== */
+// Blocks
+/* ===================================================================== */
+
+static inline uint32_t BlockHeaderCheck(const TraceBlockHeader &bh) {
+  uint32_t h = 2166136261U;
+  h = (h ^ bh.num_records) * 16777619U;
+  h = (h ^ bh.raw_size) * 16777619U;
+  h = (h ^ bh.comp_size) * 16777619U;
+  h = (h ^ bh.flags) * 16777619U;
+  return h;
+}
+
+static inline bool BlockHeaderValid(const TraceBlockHeader &bh) {
+  return bh.sync == TRACE_BLOCK_SYNC && bh.check == BlockHeaderCheck(bh);
+}
+
+/*
+ * Encodes and compresses n records with the optional fields ts, tid and
+ * pc, which may be NULL. The block header is followed by the payload in
+ * out. Bytes is a vector of uint8_t, with any allocator.
+ */
+template <class Bytes>
+static inline void EncodeBlock(const MEMREF *refs, const uint64_t *ts,
+                               const uint32_t *tid, const uint32_t *pc,
+                               size_t n, bool compress, Bytes &raw,
+                               Bytes &out) {
+  raw.resize(EncodeBound(n));
+  size_t raw_size = EncodeRecords(refs, n, ts, tid, pc, &raw[0]);
+  out.resize(sizeof(TraceBlockHeader) + CompressBound(raw_size));
+  TraceBlockHeader bh;
+  bh.sync = TRACE_BLOCK_SYNC;
+  bh.num_records = (uint32_t)n;
+  bh.raw_size = (uint32_t)raw_size;
+  bh.flags = 0;
+  if (ts) bh.flags |= TRACE_BLOCK_TIMESTAMP;
+  if (tid) bh.flags |= TRACE_BLOCK_THREAD;
+  if (pc) bh.flags |= TRACE_BLOCK_PC;
+  uint8_t *payload = &out[sizeof(TraceBlockHeader)];
+  size_t comp_size = compress ? BlockCompress(&raw[0], raw_size, payload) : raw_size;
+  if (compress && comp_size < raw_size) {
+    bh.flags |= TRACE_BLOCK_COMPRESSED;
+  } else {
+    memcpy(payload, &raw[0], raw_size);
+    comp_size = raw_size;
+  }
+  bh.comp_size = (uint32_t)comp_size;
+  bh.check = BlockHeaderCheck(bh);
+  memcpy(&out[0], &bh, sizeof(bh));
+  out.resize(sizeof(TraceBlockHeader) + comp_size);
+}
+
+/*
+ * Decodes the payload of a block into out, which has room for
+ * bh.num_records records (see DecodeRecordsTo).
+ */
+template <class Output>
+static inline bool DecodeBlockTo(const TraceBlockHeader &bh,
+                                 const uint8_t *payload,
+                                 std::vector<uint8_t> &raw, Output &out,
+                                 uint64_t *ts = NULL, uint32_t *tid = NULL,
+                                 uint32_t *pc = NULL) {
+  if (bh.num_records == 0) return bh.raw_size == 0;
+  const uint8_t *p = payload;
+  if (bh.flags & TRACE_BLOCK_COMPRESSED) {
+    raw.resize(bh.raw_size + LZ_COPY_SLACK);
+    if (!BlockDecompress(payload, bh.comp_size, &raw[0], bh.raw_size))
+      return false;
+    p = &raw[0];
+  } else if (bh.comp_size != bh.raw_size) {
+    return false;
+  }
+  return DecodeRecordsTo(p, bh.raw_size, bh.num_records, bh.flags, out, ts,
+                         tid, pc);
+}
+
+/*
+ * Decodes the payload of a block into refs, and its optional fields into
+ * fields unless fields is NULL.
+ */
+static inline bool DecodeBlock(const TraceBlockHeader &bh, const uint8_t *payload,
+                               std::vector<uint8_t> &raw,
+                               std::vector<MEMREF> &refs,
+                               TraceFields *fields = NULL) {
+  refs.resize(bh.num_records);
+  uint64_t *ts = NULL;
+  uint32_t *tid = NULL;
+  uint32_t *pc = NULL;
+  if (fields) {
+    fields->ts.resize(bh.flags & TRACE_BLOCK_TIMESTAMP ? bh.num_records : 0);
+    fields->tid.resize(bh.flags & TRACE_BLOCK_THREAD ? bh.num_records : 0);
+    fields->pc.resize(bh.flags & TRACE_BLOCK_PC ? bh.num_records : 0);
+    if (!fields->ts.empty()) ts = &fields->ts[0];
+    if (!fields->tid.empty()) tid = &fields->tid[0];
+    if (!fields->pc.empty()) pc = &fields->pc[0];
+  }
+  MemrefOutput out = { refs.empty() ? NULL : &refs[0] };
+  return DecodeBlockTo(bh, payload, raw, out, ts, tid, pc);
+}
+
+static inline void InitFileHeader(TraceFileHeader &fh) {
+  memset(&fh, 0, sizeof(fh));
+  memcpy(fh.magic, TRACE_MAGIC, sizeof(fh.magic));
+  fh.version = TRACE_VERSION;
+  fh.header_size = sizeof(fh);
+}
+
+/* ===================================================================== */
+// Writer
+/* ===================================================================== */
+
+class TraceWriter {
+ public:
+  TraceWriter(): _fp(NULL), _compress(true), _flags(0) {}
+
+  /*
+   * Writes the file header to fp. flags are the TRACE_HAS_* fields every
+   * record carries, and sampling the sampling of the records, if any.
+   * The writer does not own fp.
+   */
+  bool Open(FILE *fp, bool compress, uint32_t flags = 0,
+            const TraceSampling *sampling = NULL) {
+    _fp = fp;
+    _compress = compress;
+    _flags = flags;
+    TraceFileHeader fh;
+    InitFileHeader(fh);
+    fh.flags = flags;
+    if (sampling) fh.sampling = *sampling;
+    return fwrite(&fh, sizeof(fh), 1, _fp) == 1;
+  }
+
+  uint32_t Flags() const { return _flags; }
+
+  /*
+   * Writes n records as one block. ts, tid and pc must be given if and
+   * only if the file has the field.
+   */
+  bool WriteBlock(const MEMREF *refs, size_t n, const uint64_t *ts = NULL,
+                  const uint32_t *tid = NULL, const uint32_t *pc = NULL) {
+    if (n == 0) return true;
+    EncodeBlock(refs, ts, tid, pc, n, _compress, _raw, _out);
+    return fwrite(&_out[0], 1, _out.size(), _fp) == _out.size();
+  }
+
+  /*
+   * Buffers a record and writes a block every TRACE_BLOCK_RECORDS records.
+   * ts, tid and pc are ignored unless the file has the field.
+   */
+  bool Append(const MEMREF &mr, uint64_t ts = 0, uint32_t tid = 0,
+              uint32_t pc = 0) {
+    _pending.push_back(mr);
+    if (_flags & TRACE_HAS_TIMESTAMP) _pending_ts.push_back(ts);
+    if (_flags & TRACE_HAS_THREAD) _pending_tid.push_back(tid);
+    if (_flags & TRACE_HAS_PC) _pending_pc.push_back(pc);
+    if (_pending.size() < TRACE_BLOCK_RECORDS) return true;
+    return Flush();
+  }
+
+  bool Flush() {
+    bool ok = _pending.empty() ||
+        WriteBlock(&_pending[0], _pending.size(),
+                   _pending_ts.empty() ? NULL : &_pending_ts[0],
+                   _pending_tid.empty() ? NULL : &_pending_tid[0],
+                   _pending_pc.empty() ? NULL : &_pending_pc[0]);
+    _pending.clear();
+    _pending_ts.clear();
+    _pending_tid.clear();
+    _pending_pc.clear();
+    return ok;
+  }
+
+ private:
+  FILE *_fp;
+  bool _compress;
+  uint32_t _flags;
+  std::vector<MEMREF> _pending;
+  std::vector<uint64_t> _pending_ts;
+  std::vector<uint32_t> _pending_tid;
+  std::vector<uint32_t> _pending_pc;
+  std::vector<uint8_t> _raw;
+  std::vector<uint8_t> _out;
+};
+
+/* ===================================================================== */
+// Reader
+/* ===================================================================== */
+
+class TraceReader {
+ public:
+  TraceReader(): _fp(NULL), _legacy(false), _error(false), _data_offset(0) {}
+  ~TraceReader() { Close(); }
+
+  bool Open(const char *path) {
+    _fp = fopen(path, "rb");
+    if (!_fp) {
+      std::cerr << "ERROR! Cannot open " << path << std::endl;
+      return false;
+    }
+    char buf[sizeof(TraceFileHeader)];
+    size_t n = fread(buf, 1, sizeof(buf), _fp);
+    if (HasTraceMagic(buf, n)) {
+      if (!ParseFileHeader(buf, n, &_header)) {
+        std::cerr << "ERROR! Corrupt file header" << std::endl;
+        return false;
+      }
+      if (_header.version != TRACE_VERSION) {
+        std::cerr << "ERROR! Unsupported trace version: " << _header.version
+                  << std::endl;
+        return false;
+      }
+      _data_offset = _header.header_size;
+    } else {
+      _legacy = true;
+      InitFileHeader(_header);
+      _data_offset = 0;
+    }
+    return fseeko(_fp, _data_offset, SEEK_SET) == 0;
+  }
+
+  void Close() {
+    if (_fp) fclose(_fp);
+    _fp = NULL;
+  }
+
+  bool IsLegacy() const { return _legacy; }
+  const TraceFileHeader &Header() const { return _header; }
+
+  /*
+   * Reads the next block into refs, and its optional fields into fields
+   * unless fields is NULL. Returns false at the end of the trace or on a
+   * corrupt block; Error() tells the two apart.
+   */
+  bool ReadBlock(std::vector<MEMREF> &refs, TraceFields *fields = NULL) {
+    _error = false;
+    if (_legacy) {
+      refs.resize(TRACE_LEGACY_CHUNK);
+      size_t nelm = fread(&refs[0], sizeof(MEMREF), TRACE_LEGACY_CHUNK, _fp);
+      refs.resize(nelm);
+      if (fields) {
+        fields->ts.clear();
+        fields->tid.clear();
+        fields->pc.clear();
+      }
+      return nelm > 0;
+    }
+    TraceBlockHeader bh;
+    size_t n = fread(&bh, 1, sizeof(bh), _fp);
+    if (n == 0) return false;
+    if (n != sizeof(bh) || !BlockHeaderValid(bh)) {
+      std::cerr << "ERROR! Corrupt block header" << std::endl;
+      _error = true;
+      return false;
+    }
+    _payload.resize(bh.comp_size);
+    if ((bh.comp_size &&
+         fread(&_payload[0], 1, bh.comp_size, _fp) != bh.comp_size) ||
+        !DecodeBlock(bh, bh.comp_size ? &_payload[0] : NULL, _raw, refs,
+                     fields)) {
+      std::cerr << "ERROR! Corrupt block" << std::endl;
+      _error = true;
+      return false;
+    }
+    return true;
+  }
+
+  bool Error() const { return _error; }
+
+  /* Reads the block starting at offset, as returned by ScanBlocks. */
+  bool ReadBlockAt(off_t offset, std::vector<MEMREF> &refs,
+                   TraceFields *fields = NULL) {
+    if (fseeko(_fp, offset, SEEK_SET) != 0) return false;
+    return ReadBlock(refs, fields);
+  }
+
+  /*
+   * Collects the file offset and record count of every block without
+   * decoding them. Legacy traces are split into TRACE_LEGACY_CHUNK
+   * record chunks.
+   */
+  bool ScanBlocks(std::vector<off_t> &offsets, std::vector<size_t> &counts) {
+    if (fseeko(_fp, 0, SEEK_END) != 0) return false;
+    off_t fs = ftello(_fp);
+    off_t off = _data_offset;
+    if (_legacy) {
+      if (fs % sizeof(MEMREF)) {
+        std::cerr << "ERROR! Size of a raw trace must be a multiple of "
+                  << sizeof(MEMREF) << std::endl;
+        return false;
+      }
+      size_t total = fs / sizeof(MEMREF);
+      for (size_t i = 0; i < total; i += TRACE_LEGACY_CHUNK) {
+        offsets.push_back((off_t)(i * sizeof(MEMREF)));
+        counts.push_back(std::min<size_t>(TRACE_LEGACY_CHUNK, total - i));
+      }
+    } else {
+      while (off < fs) {
+        TraceBlockHeader bh;
+        if (fseeko(_fp, off, SEEK_SET) != 0 ||
+            fread(&bh, sizeof(bh), 1, _fp) != 1 || !BlockHeaderValid(bh)) {
+          std::cerr << "ERROR! Corrupt block header at offset " << off
+                    << std::endl;
+          return false;
+        }
+        offsets.push_back(off);
+        counts.push_back(bh.num_records);
+        off += sizeof(bh) + bh.comp_size;
+      }
+    }
+    return fseeko(_fp, _data_offset, SEEK_SET) == 0;
+  }
+
+ private:
+  FILE *_fp;
+  bool _legacy;
+  bool _error;
+  off_t _data_offset;
+  TraceFileHeader _header;
+  std::vector<uint8_t> _payload;
+  std::vector<uint8_t> _raw;
+};
+
+#endif /* TRACE_FORMAT_H_ */